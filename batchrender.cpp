@@ -0,0 +1,351 @@
+#include "batchrender.h"
+#include "fileutil.h"
+#include "json.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define READ_BUFFER_SIZE (1024 * 1024)
+#define BATCH_RECORDS 256 // 1つのジョブで生成するレコードの数
+#define BATCH_BYTES (1024 * 1024)
+
+namespace {
+
+/**
+ * @brief レコードを先頭から1つずつ読む
+ *
+ * 一定の大きさずつ読み込み、改行で区切る。CSV なら引用符の中の改行では区切らない。
+ */
+class RecordReader {
+private:
+	FILE *fp_ = nullptr;
+	bool close_ = false;
+	bool csv_ = false;
+	bool quoted_ = false; // CSV の引用符の中
+	std::vector<char> buf_;
+	size_t pos_ = 0;
+	size_t len_ = 0;
+	uint64_t bytes_ = 0;
+	bool fill()
+	{
+		len_ = fread(buf_.data(), 1, buf_.size(), fp_);
+		pos_ = 0;
+		bytes_ += len_;
+		return len_ > 0;
+	}
+public:
+	RecordReader(bool csv)
+		: csv_(csv)
+		, buf_(READ_BUFFER_SIZE)
+	{
+	}
+	~RecordReader()
+	{
+		if (close_) {
+			fclose(fp_);
+		}
+	}
+	RecordReader(RecordReader const &) = delete;
+	void operator = (RecordReader const &) = delete;
+	/**
+	 * @param path ファイル。"-" なら標準入力
+	 */
+	bool open(std::string const &path)
+	{
+		if (path == "-") {
+			fp_ = stdin;
+			return true;
+		}
+		fp_ = fopen(path.c_str(), "rb");
+		close_ = fp_ != nullptr;
+		return close_;
+	}
+	uint64_t bytes() const
+	{
+		return bytes_;
+	}
+	/**
+	 * @brief 次のレコード
+	 * @param out 改行を除いたレコード
+	 * @return 終わりなら false
+	 */
+	bool next(std::string *out)
+	{
+		out->clear();
+		bool any = false;
+		while (pos_ < len_ || fill()) {
+			any = true;
+			char const *begin = buf_.data() + pos_;
+			char const *end = buf_.data() + len_;
+			char const *p = begin;
+			if (csv_) {
+				while (p < end && (quoted_ || *p != '\n')) {
+					if (*p == '"') {
+						quoted_ = !quoted_;
+					}
+					p++;
+				}
+			} else {
+				p = (char const *)memchr(begin, '\n', end - begin);
+				if (!p) {
+					p = end;
+				}
+			}
+			out->append(begin, p);
+			pos_ = p - buf_.data();
+			if (p < end) {
+				pos_++;
+				break;
+			}
+		}
+		if (!out->empty() && out->back() == '\r') {
+			out->pop_back();
+		}
+		return any;
+	}
+};
+
+/**
+ * @brief CSV のレコードをフィールドに分ける
+ *
+ * "" で囲んだフィールドには , や改行を含めることができ、"" は " になる。
+ */
+std::vector<std::string> split_csv(std::string_view const &s)
+{
+	std::vector<std::string> fields(1);
+	bool quoted = false;
+	for (size_t i = 0; i < s.size(); i++) {
+		char c = s[i];
+		if (quoted) {
+			if (c != '"') {
+				fields.back() += c;
+			} else if (i + 1 < s.size() && s[i + 1] == '"') {
+				fields.back() += '"';
+				i++;
+			} else {
+				quoted = false;
+			}
+		} else if (c == '"') {
+			quoted = true;
+		} else if (c == ',') {
+			fields.emplace_back();
+		} else {
+			fields.back() += c;
+		}
+	}
+	return fields;
+}
+
+/**
+ * @brief 出力ディレクトリの外を指さないファイル名か
+ */
+bool is_valid_name(std::string const &name)
+{
+	if (name.empty() || name == "." || name == "..") return false;
+	return name.find_first_of("/\\") == std::string::npos;
+}
+
+} // namespace
+
+/**
+ * @brief 1つのジョブで生成するレコード
+ */
+struct BatchRenderer::Batch {
+	size_t first = 0; // 最初のレコードの番号（1から）
+	std::vector<std::string> records;
+};
+
+struct BatchRenderer::Private {
+	kakiage engine;
+	kakiage::Variables defines;
+	std::string output_dir = ".";
+	kakiage::Template name; // 出力ファイル名のテンプレート
+	bool has_name = false;
+	kakiage::Template tmpl;
+	std::string records_path;
+	bool csv = false;
+	std::vector<std::string> columns; // CSV の列名
+	std::atomic<size_t> rendered{0};
+	std::atomic<size_t> failed{0};
+	std::atomic<uint64_t> output_bytes{0};
+	Private(kakiage const &engine, kakiage::Variables const &defines)
+		: engine(engine)
+		, defines(defines)
+	{
+	}
+};
+
+BatchRenderer::BatchRenderer(kakiage const &engine, kakiage::Variables const &defines)
+	: m(new Private(engine, defines))
+{
+	m->engine.dependencies = nullptr;
+}
+
+BatchRenderer::~BatchRenderer()
+{
+	delete m;
+}
+
+void BatchRenderer::set_output_dir(std::string const &dir)
+{
+	m->output_dir = dir;
+	while (m->output_dir.size() > 1 && m->output_dir.back() == '/') {
+		m->output_dir.pop_back();
+	}
+}
+
+/**
+ * @brief 出力ファイル名を生成するテンプレートを設定する
+ * @param source テンプレートテキスト。設定しなければレコードの番号（000001 など）
+ */
+void BatchRenderer::set_name_template(std::string const &source)
+{
+	m->name = m->engine.compile(source);
+	m->has_name = true;
+}
+
+/**
+ * @brief レコードをまとめて生成する
+ * @param batch レコード。JSON はこの中で解析するので書き換える
+ */
+void BatchRenderer::render(Batch *batch)
+{
+	kakiage engine = m->engine; // ワーカーごとに状態を持つので複製する
+	for (size_t i = 0; i < batch->records.size(); i++) {
+		size_t number = batch->first + i;
+		kakiage::Variables map = m->defines;
+		if (m->csv) {
+			std::vector<std::string> fields = split_csv(batch->records[i]);
+			for (size_t j = 0; j < m->columns.size(); j++) {
+				kakiage::define_variable(&map, m->columns[j], j < fields.size() ? fields[j] : std::string());
+			}
+		} else {
+			std::string error;
+			auto doc = JsonDocument::parse(std::move(batch->records[i]), &error);
+			if (!doc || !JsonDocument::define_variables(doc, &map)) {
+				fprintf(stderr, "%s: record %zu: %s\n", m->records_path.c_str(), number, doc ? "not an object" : error.c_str());
+				m->failed++;
+				continue;
+			}
+		}
+		map["_record"] = std::to_string(number);
+
+		std::string name;
+		if (m->has_name) {
+			name = kakiage::trimmed(engine.render(m->name, map));
+		} else {
+			char tmp[32];
+			snprintf(tmp, sizeof(tmp), "%06zu", number);
+			name = tmp;
+		}
+		if (!is_valid_name(name)) {
+			fprintf(stderr, "%s: record %zu: invalid output file name: %s\n", m->records_path.c_str(), number, name.c_str());
+			m->failed++;
+			continue;
+		}
+
+		std::string result = engine.render(m->tmpl, map);
+		std::string path = m->output_dir + '/' + name;
+		FILE *fp = fopen(path.c_str(), "wb");
+		if (!fp) {
+			fprintf(stderr, "Failed to open output file: %s\n", path.c_str());
+			m->failed++;
+			continue;
+		}
+		bool ok = fwrite(result.data(), 1, result.size(), fp) == result.size();
+		ok = fclose(fp) == 0 && ok; // 書き込めなかった分は閉じるときに分かることもある
+		if (!ok) {
+			fprintf(stderr, "Failed to write output file: %s: %s\n", path.c_str(), strerror(errno));
+			m->failed++;
+			continue;
+		}
+		m->rendered++;
+		m->output_bytes += result.size();
+	}
+}
+
+/**
+ * @brief レコードファイルを最後まで処理する
+ * @param records_path JSON Lines か CSV（拡張子が .csv）のファイル。"-" なら標準入力の JSON Lines
+ * @param template_path テンプレートファイル
+ * @param threads ワーカースレッドの数（0 ならハードウェアのスレッド数）
+ * @return 終了コード。失敗したレコードがあれば 1
+ */
+int BatchRenderer::run(std::string const &records_path, std::string const &template_path, int threads)
+{
+	auto t0 = std::chrono::steady_clock::now();
+
+	auto source = read_file(template_path);
+	if (!source) {
+		fprintf(stderr, "Failed to open input file: %s\n", template_path.c_str());
+		return 1;
+	}
+	m->tmpl = m->engine.compile(*source);
+
+	m->records_path = records_path;
+	size_t n = records_path.size();
+	m->csv = n > 4 && (records_path.compare(n - 4, 4, ".csv") == 0 || records_path.compare(n - 4, 4, ".CSV") == 0);
+	RecordReader reader(m->csv);
+	if (!reader.open(records_path)) {
+		fprintf(stderr, "Failed to open record file: %s\n", records_path.c_str());
+		return 1;
+	}
+	if (!make_directory(m->output_dir)) {
+		fprintf(stderr, "Failed to create output directory: %s: %s\n", m->output_dir.c_str(), strerror(errno));
+		return 1;
+	}
+
+	std::string record;
+	if (m->csv && reader.next(&record)) {
+		m->columns = split_csv(record);
+	}
+
+	size_t count = 0;
+	{
+		if (threads < 1) {
+			threads = std::max(1, (int)std::thread::hardware_concurrency());
+		}
+		ThreadPool pool(threads, threads * 2); // 読み込みが先に進みすぎないようにする
+		auto batch = std::make_shared<Batch>();
+		batch->first = 1;
+		size_t bytes = 0;
+		auto Post = [&](){
+			pool.post([this, batch](){
+				render(batch.get());
+			});
+			batch = std::make_shared<Batch>();
+			batch->first = count + 1;
+			bytes = 0;
+		};
+		while (reader.next(&record)) {
+			if (kakiage::trimmed(record).empty()) continue;
+			count++;
+			bytes += record.size();
+			batch->records.push_back(std::move(record));
+			record = {};
+			if (batch->records.size() >= BATCH_RECORDS || bytes >= BATCH_BYTES) {
+				Post();
+			}
+		}
+		if (!batch->records.empty()) {
+			Post();
+		}
+		pool.wait();
+	}
+
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	double mb_in = reader.bytes() / 1e6;
+	double mb_out = m->output_bytes / 1e6;
+	fprintf(stderr, "%zu records, %zu rendered, %zu failed, %.1f MB read, %.1f MB written, %.2f s (%.0f records/s, %.1f MB/s)\n"
+		, count, m->rendered.load(), m->failed.load(), mb_in, mb_out, sec, sec > 0 ? count / sec : 0.0, sec > 0 ? mb_in / sec : 0.0);
+	return m->failed ? 1 : 0;
+}
@@ -0,0 +1,31 @@
+#ifndef BATCHRENDER_H
+#define BATCHRENDER_H
+
+#include "kakiage.h"
+#include <string>
+
+/**
+ * @brief レコードごとにテンプレートを生成してファイルに書く
+ *
+ * JSON Lines（1行に1つのオブジェクト）か CSV（1行目が列名）のファイルを先頭から読み、
+ * 1回だけコンパイルしたテンプレートをワーカースレッドでレコードごとに生成する。
+ * 読み込みは待ち行列が空くまで待つので、ファイル全体をメモリに置くことはない。
+ * レコードのフィールドは定義より優先する。
+ */
+class BatchRenderer {
+private:
+	struct Private;
+	Private *m;
+	struct Batch;
+	void render(Batch *batch);
+public:
+	BatchRenderer(kakiage const &engine, kakiage::Variables const &defines);
+	~BatchRenderer();
+	BatchRenderer(BatchRenderer const &) = delete;
+	void operator = (BatchRenderer const &) = delete;
+	void set_output_dir(std::string const &dir);
+	void set_name_template(std::string const &source);
+	int run(std::string const &records_path, std::string const &template_path, int threads);
+};
+
+#endif // BATCHRENDER_H
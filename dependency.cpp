@@ -0,0 +1,218 @@
+#include "dependency.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// 依存関係ファイルの書式（1行1レコード）
+//
+//   kakiage-deps 1
+//   source <hash>
+//   output <hash>
+//   var <name> <hash|->
+//   env <name> <hash|->
+//   file <hash|-> <name>
+//   cmd <command>
+//   call <name(args)>
+//
+// 名前やコマンドに含まれる '\\' と改行、名前に含まれる空白はエスケープする。
+
+#define DEPENDENCY_MAGIC "kakiage-deps 1"
+
+namespace {
+
+std::string escape(std::string const &s, bool space = false)
+{
+	std::string out;
+	out.reserve(s.size());
+	for (char c : s) {
+		if (c == '\\') {
+			out += "\\\\";
+		} else if (c == '\n') {
+			out += "\\n";
+		} else if (c == '\r') {
+			out += "\\r";
+		} else if (c == ' ' && space) {
+			out += "\\s";
+		} else {
+			out += c;
+		}
+	}
+	return out;
+}
+
+std::string unescape(std::string_view const &s)
+{
+	std::string out;
+	out.reserve(s.size());
+	for (size_t i = 0; i < s.size(); i++) {
+		char c = s[i];
+		if (c == '\\' && i + 1 < s.size()) {
+			i++;
+			c = s[i];
+			if (c == 'n') {
+				c = '\n';
+			} else if (c == 'r') {
+				c = '\r';
+			} else if (c == 's') {
+				c = ' ';
+			}
+		}
+		out += c;
+	}
+	return out;
+}
+
+std::string to_hex(uint64_t h)
+{
+	char tmp[32];
+	sprintf(tmp, "%016llx", (unsigned long long)h);
+	return tmp;
+}
+
+std::string to_hex(std::optional<uint64_t> const &h)
+{
+	return h ? to_hex(*h) : std::string("-");
+}
+
+std::optional<uint64_t> from_hex(std::string_view const &s)
+{
+	if (s == "-") return std::nullopt;
+	return strtoull(std::string(s).c_str(), nullptr, 16);
+}
+
+std::optional<uint64_t> hash_of(std::optional<std::string> const &s)
+{
+	if (!s) return std::nullopt;
+	return kakiage::hash(*s);
+}
+
+/**
+ * @brief 最初の空白で2つに分ける
+ */
+std::pair<std::string_view, std::string_view> split2(std::string_view const &s)
+{
+	size_t i = s.find(' ');
+	if (i == std::string_view::npos) {
+		return {s, {}};
+	}
+	return {s.substr(0, i), s.substr(i + 1)};
+}
+
+} // namespace
+
+/**
+ * @brief 依存関係ファイルを書き出す
+ * @param path ファイルパス
+ * @param deps 依存関係
+ * @return 成功したら true
+ */
+bool save_dependencies(char const *path, kakiage::Dependencies const &deps)
+{
+	FILE *fp = fopen(path, "w");
+	if (!fp) return false;
+	fprintf(fp, "%s\n", DEPENDENCY_MAGIC);
+	fprintf(fp, "source %s\n", to_hex(deps.source).c_str());
+	fprintf(fp, "output %s\n", to_hex(deps.output).c_str());
+	for (auto const &[name, h] : deps.variables) {
+		fprintf(fp, "var %s %s\n", escape(name, true).c_str(), to_hex(h).c_str());
+	}
+	for (auto const &[name, h] : deps.environment) {
+		fprintf(fp, "env %s %s\n", escape(name, true).c_str(), to_hex(h).c_str());
+	}
+	for (auto const &[name, h] : deps.files) {
+		fprintf(fp, "file %s %s\n", to_hex(h).c_str(), escape(name).c_str());
+	}
+	for (auto const &s : deps.commands) {
+		fprintf(fp, "cmd %s\n", escape(s).c_str());
+	}
+	for (auto const &s : deps.calls) {
+		fprintf(fp, "call %s\n", escape(s).c_str());
+	}
+	bool ok = ferror(fp) == 0;
+	fclose(fp);
+	return ok;
+}
+
+/**
+ * @brief 依存関係ファイルを読み込む
+ * @param path ファイルパス
+ * @return 依存関係。ファイルが無いか書式が正しくなければ std::nullopt
+ */
+std::optional<kakiage::Dependencies> load_dependencies(char const *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) return std::nullopt;
+	std::vector<char> vec;
+	while (1) {
+		char buf[65536];
+		size_t n = fread(buf, 1, sizeof(buf), fp);
+		if (n == 0) break;
+		vec.insert(vec.end(), buf, buf + n);
+	}
+	fclose(fp);
+
+	kakiage::Dependencies deps;
+	std::string_view text(vec.data(), vec.size());
+	bool magic = false;
+	while (!text.empty()) {
+		size_t i = text.find('\n');
+		std::string_view line = text.substr(0, i);
+		text = i == std::string_view::npos ? std::string_view() : text.substr(i + 1);
+		if (!magic) {
+			if (line != DEPENDENCY_MAGIC) return std::nullopt;
+			magic = true;
+			continue;
+		}
+		auto [kind, rest] = split2(line);
+		if (kind == "source") {
+			deps.source = from_hex(rest).value_or(0);
+		} else if (kind == "output") {
+			deps.output = from_hex(rest).value_or(0);
+		} else if (kind == "var" || kind == "env") {
+			auto [name, h] = split2(rest);
+			auto *map = kind == "var" ? &deps.variables : &deps.environment;
+			(*map)[unescape(name)] = from_hex(h);
+		} else if (kind == "file") {
+			auto [h, name] = split2(rest);
+			deps.files[unescape(name)] = from_hex(h);
+		} else if (kind == "cmd") {
+			deps.commands.push_back(unescape(rest));
+		} else if (kind == "call") {
+			deps.calls.push_back(unescape(rest));
+		} else if (!line.empty()) {
+			return std::nullopt;
+		}
+	}
+	if (!magic) return std::nullopt;
+	return deps;
+}
+
+/**
+ * @brief 前回の生成から入力が変わっていないか調べる
+ * @param deps 前回の依存関係
+ * @param source 今回のテンプレート本文
+ * @param output 前回の出力ファイルの内容（無ければ std::nullopt）
+ * @param resolver 現在の入力を取得する関数群
+ * @return 変わっていなければ true
+ *
+ * コマンドと evaluator の呼び出しは同じ文字列なら同じ結果を返すとみなす。
+ */
+bool is_up_to_date(kakiage::Dependencies const &deps, std::string const &source, std::optional<std::string> const &output, DependencyResolver const &resolver)
+{
+	if (!output || kakiage::hash(*output) != deps.output) return false;
+	if (kakiage::hash(source) != deps.source) return false;
+	for (auto const &[name, h] : deps.variables) {
+		if (!resolver.variable) return false;
+		if (hash_of(resolver.variable(name)) != h) return false;
+	}
+	for (auto const &[name, h] : deps.environment) {
+		char const *v = getenv(name.c_str());
+		if (hash_of(v ? std::optional<std::string>(v) : std::nullopt) != h) return false;
+	}
+	for (auto const &[name, h] : deps.files) {
+		if (!resolver.file) return false;
+		if (hash_of(resolver.file(name)) != h) return false;
+	}
+	return true;
+}
@@ -0,0 +1,21 @@
+#ifndef DEPENDENCY_H
+#define DEPENDENCY_H
+
+#include "kakiage.h"
+#include <functional>
+#include <optional>
+#include <string>
+
+/**
+ * @brief 依存関係を検証するために現在の入力を取得する関数群
+ */
+struct DependencyResolver {
+	std::function<std::optional<std::string> (std::string const &name)> variable;
+	std::function<std::optional<std::string> (std::string const &name)> file;
+};
+
+bool save_dependencies(char const *path, kakiage::Dependencies const &deps);
+std::optional<kakiage::Dependencies> load_dependencies(char const *path);
+bool is_up_to_date(kakiage::Dependencies const &deps, std::string const &source, std::optional<std::string> const &output, DependencyResolver const &resolver);
+
+#endif // DEPENDENCY_H
@@ -0,0 +1,479 @@
+#include "expression.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+bool issymf(int c)
+{
+	return isalpha((unsigned char)c) || c == '_';
+}
+
+bool issym(int c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+const int MAX_HEIGHT = 256; // 評価は再帰するので、木の高さを制限する
+
+} // namespace
+
+/**
+ * @brief 評価の途中の値
+ *
+ * テキストは置換マップの値か、式の中の定数を指す。コピーしない。
+ */
+struct Expression::Result {
+	enum Type : uint8_t {
+		Integer,
+		Real,
+		Text,
+	};
+	Type type = Integer;
+	int64_t integer = 0;
+	double real = 0;
+	kakiage::Value const *text = nullptr;
+
+	static Result of(int64_t v)
+	{
+		Result r;
+		r.integer = v;
+		return r;
+	}
+	static Result of(double v)
+	{
+		Result r;
+		r.type = Real;
+		r.real = v;
+		return r;
+	}
+	static Result of(bool v)
+	{
+		return of(int64_t(v ? 1 : 0));
+	}
+	bool numeric() const
+	{
+		return type != Text || text->kind() != kakiage::Value::Kind::Text;
+	}
+	/**
+	 * @brief 数にする。数として読めないテキストは #if.name と同じく先頭の整数を読む
+	 */
+	Result number() const
+	{
+		if (type != Text) return *this;
+		if (text->kind() == kakiage::Value::Kind::Real) return of(text->real());
+		return of(text->integer());
+	}
+	double to_real() const
+	{
+		return type == Real ? real : (double)integer;
+	}
+	bool truth() const
+	{
+		switch (type) {
+		case Integer:
+			return integer != 0;
+		case Real:
+			return real != 0;
+		default:
+			return text->boolean();
+		}
+	}
+	/**
+	 * @brief 比較する
+	 * @return -1, 0, 1。比較できなければ（NaN）2
+	 *
+	 * 両方とも数として読めないテキストなら文字列として、そうでなければ数として比べる。
+	 */
+	static int compare(Result const &a, Result const &b)
+	{
+		if (a.type == Text && b.type == Text && !(a.numeric() && b.numeric())) {
+			int c = a.text->text().compare(b.text->text());
+			return (c > 0) - (c < 0);
+		}
+		Result x = a.number();
+		Result y = b.number();
+		if (x.type == Integer && y.type == Integer) {
+			return (x.integer > y.integer) - (x.integer < y.integer);
+		}
+		double u = x.to_real();
+		double v = y.to_real();
+		if (u < v) return -1;
+		if (u > v) return 1;
+		if (u == v) return 0;
+		return 2;
+	}
+};
+
+/**
+ * @brief 再帰下降で式を読み、ノードの配列を作る
+ */
+class Expression::Parser {
+private:
+	char const *p;
+	char const *end;
+	Expression *e;
+	int depth_ = 0; // 括弧と単項演算子の入れ子
+	bool ok_ = true;
+
+	void skip()
+	{
+		while (p < end && isspace((unsigned char)*p)) {
+			p++;
+		}
+	}
+	bool eat(char const *op)
+	{
+		skip();
+		size_t n = strlen(op);
+		if ((size_t)(end - p) < n || memcmp(p, op, n) != 0) return false;
+		if (n == 1 && p + 1 < end && p[1] == '=' && strchr("<>!", *op)) return false; // "<" と "<=" などを区別する
+		p += n;
+		return true;
+	}
+	uint32_t fail()
+	{
+		ok_ = false;
+		return 0;
+	}
+	uint32_t add(Node node)
+	{
+		std::vector<Node> &nodes = e->nodes_;
+		if (node.op >= Node::Not && node.op <= Node::Plus) {
+			node.height = nodes[node.left].height + 1;
+		} else if (node.op >= Node::Add) {
+			node.height = std::max(nodes[node.left].height, nodes[node.right].height) + 1;
+		}
+		if (node.height > MAX_HEIGHT) return fail();
+		nodes.push_back(node);
+		return uint32_t(nodes.size() - 1);
+	}
+	uint32_t unary(Node::Op op, uint32_t operand)
+	{
+		Node node;
+		node.op = op;
+		node.left = operand;
+		return add(node);
+	}
+	uint32_t binary(Node::Op op, uint32_t left, uint32_t right)
+	{
+		Node node;
+		node.op = op;
+		node.left = left;
+		node.right = right;
+		return add(node);
+	}
+	uint32_t text(std::string const &name, std::string const &value, Node::Op op)
+	{
+		Node node;
+		node.op = op;
+		node.index = uint32_t(e->texts_.size());
+		e->names_.push_back(name);
+		e->texts_.emplace_back(value);
+		return add(node);
+	}
+	uint32_t number()
+	{
+		char const *q = p;
+		bool real = false;
+		auto Digits = [&](){
+			char const *r = q;
+			while (q < end && isdigit((unsigned char)*q)) {
+				q++;
+			}
+			return q > r;
+		};
+		bool digits = Digits();
+		if (q < end && *q == '.') {
+			q++;
+			digits = Digits() || digits;
+			real = true;
+		}
+		if (!digits) return fail();
+		if (q < end && (*q == 'e' || *q == 'E')) {
+			q++;
+			if (q < end && (*q == '+' || *q == '-')) {
+				q++;
+			}
+			if (!Digits()) return fail();
+			real = true;
+		}
+		if (q < end && (issym(*q) || *q == '.')) return fail(); // 12abc や 0x1 などは式ではない
+		std::string s(p, q);
+		p = q;
+		Node node;
+		if (real) {
+			node.op = Node::Real;
+			node.real = strformat_ns::misc::my_strtod(s.c_str(), nullptr);
+		} else {
+			node.op = Node::Integer;
+			node.integer = strtoll(s.c_str(), nullptr, 10);
+		}
+		return add(node);
+	}
+	uint32_t string_literal()
+	{
+		char stop = *p++;
+		std::string s;
+		while (1) {
+			if (p >= end) return fail();
+			char c = *p++;
+			if (c == stop) break;
+			if (c == '\\' && p < end) {
+				c = *p++;
+				if (c == 'n') {
+					c = '\n';
+				} else if (c == 'r') {
+					c = '\r';
+				} else if (c == 't') {
+					c = '\t';
+				}
+			}
+			s.push_back(c);
+		}
+		return text({}, s, Node::Text);
+	}
+	uint32_t primary()
+	{
+		skip();
+		if (p >= end) return fail();
+		char c = *p;
+		if (c == '(') {
+			if (++depth_ > MAX_HEIGHT) return fail();
+			p++;
+			uint32_t i = logical_or();
+			if (!ok_ || !eat(")")) return fail();
+			depth_--;
+			return i;
+		}
+		if (c == '\"' || c == '\'') {
+			return string_literal();
+		}
+		if (isdigit((unsigned char)c) || c == '.') {
+			return number();
+		}
+		if (issymf(c)) {
+			char const *q = p;
+			while (q < end && (issym(*q) || (*q == '.' && q + 1 < end && issym(q[1])))) { // user.name
+				q++;
+			}
+			std::string name(p, q);
+			p = q;
+			return text(name, '?' + name + '?', Node::Variable);
+		}
+		return fail();
+	}
+	uint32_t prefix()
+	{
+		if (depth_ > MAX_HEIGHT) return fail();
+		Node::Op op;
+		if (eat("!")) {
+			op = Node::Not;
+		} else if (eat("-")) {
+			op = Node::Negate;
+		} else if (eat("+")) {
+			op = Node::Plus;
+		} else {
+			return primary();
+		}
+		depth_++;
+		uint32_t i = prefix();
+		depth_--;
+		return ok_ ? unary(op, i) : 0;
+	}
+	/**
+	 * @brief 左結合の二項演算子を読む
+	 * @param operand ひとつ優先順位の高いものを読む関数
+	 * @param ops 演算子と、対応するノード
+	 */
+	template <size_t N> uint32_t left_assoc(uint32_t (Parser::*operand)(), std::pair<char const *, Node::Op> const (&ops)[N])
+	{
+		uint32_t left = (this->*operand)();
+		while (ok_) {
+			size_t i = 0;
+			while (i < N && !eat(ops[i].first)) {
+				i++;
+			}
+			if (i == N) break;
+			uint32_t right = (this->*operand)();
+			if (!ok_) break;
+			left = binary(ops[i].second, left, right);
+		}
+		return left;
+	}
+	uint32_t multiplicative()
+	{
+		static const std::pair<char const *, Node::Op> ops[] = {{"*", Node::Mul}, {"/", Node::Div}, {"%", Node::Mod}};
+		return left_assoc(&Parser::prefix, ops);
+	}
+	uint32_t additive()
+	{
+		static const std::pair<char const *, Node::Op> ops[] = {{"+", Node::Add}, {"-", Node::Sub}};
+		return left_assoc(&Parser::multiplicative, ops);
+	}
+	uint32_t relational()
+	{
+		static const std::pair<char const *, Node::Op> ops[] = {{"<=", Node::Le}, {">=", Node::Ge}, {"<", Node::Lt}, {">", Node::Gt}};
+		return left_assoc(&Parser::additive, ops);
+	}
+	uint32_t equality()
+	{
+		static const std::pair<char const *, Node::Op> ops[] = {{"==", Node::Eq}, {"!=", Node::Ne}};
+		return left_assoc(&Parser::relational, ops);
+	}
+	uint32_t logical_and()
+	{
+		static const std::pair<char const *, Node::Op> ops[] = {{"&&", Node::And}};
+		return left_assoc(&Parser::equality, ops);
+	}
+	uint32_t logical_or()
+	{
+		static const std::pair<char const *, Node::Op> ops[] = {{"||", Node::Or}};
+		return left_assoc(&Parser::logical_and, ops);
+	}
+public:
+	Parser(char const *begin, char const *end, Expression *e)
+		: p(begin)
+		, end(end)
+		, e(e)
+	{
+	}
+	bool parse(char const **next)
+	{
+		logical_or();
+		skip();
+		*next = p;
+		return ok_;
+	}
+};
+
+/**
+ * @brief 式を解析する
+ * @param begin 式の先頭
+ * @param end テキストの終端
+ * @param next 式の直後（後ろの空白は読み飛ばす）
+ * @return 式。文法に合わなければ std::nullopt
+ *
+ * 対応の取れない ')' や、式に使えない文字のところで止まる。
+ */
+std::optional<Expression> Expression::parse(char const *begin, char const *end, char const **next)
+{
+	Expression e;
+	Parser parser(begin, end, &e);
+	if (!parser.parse(next) || e.nodes_.empty()) return std::nullopt;
+	return e;
+}
+
+/**
+ * @brief 置換マップの名前ひとつだけの式を作る
+ */
+Expression Expression::variable(std::string const &name)
+{
+	Expression e;
+	Node node;
+	node.op = Node::Variable;
+	e.names_.push_back(name);
+	e.texts_.emplace_back('?' + name + '?');
+	e.nodes_.push_back(node);
+	return e;
+}
+
+Expression::Result Expression::evaluate(uint32_t i, Lookup const &lookup) const
+{
+	Node const &n = nodes_[i];
+	switch (n.op) {
+	case Node::Integer:
+		return Result::of(n.integer);
+	case Node::Real:
+		return Result::of(n.real);
+	case Node::Text:
+	case Node::Variable:
+		{
+			Result r;
+			r.type = Result::Text;
+			r.text = n.op == Node::Variable ? lookup(names_[n.index]) : nullptr;
+			if (!r.text) {
+				r.text = &texts_[n.index];
+			}
+			return r;
+		}
+	case Node::Not:
+		return Result::of(!evaluate(n.left, lookup).truth());
+	case Node::Negate:
+		{
+			Result r = evaluate(n.left, lookup).number();
+			if (r.type == Result::Real) return Result::of(-r.real);
+			return Result::of(int64_t(0 - uint64_t(r.integer)));
+		}
+	case Node::Plus:
+		return evaluate(n.left, lookup).number();
+	case Node::And:
+		return Result::of(evaluate(n.left, lookup).truth() && evaluate(n.right, lookup).truth());
+	case Node::Or:
+		return Result::of(evaluate(n.left, lookup).truth() || evaluate(n.right, lookup).truth());
+	case Node::Eq:
+	case Node::Ne:
+	case Node::Lt:
+	case Node::Le:
+	case Node::Gt:
+	case Node::Ge:
+		{
+			int c = Result::compare(evaluate(n.left, lookup), evaluate(n.right, lookup));
+			switch (n.op) {
+			case Node::Eq: return Result::of(c == 0);
+			case Node::Ne: return Result::of(c != 0);
+			case Node::Lt: return Result::of(c == -1);
+			case Node::Le: return Result::of(c == -1 || c == 0);
+			case Node::Gt: return Result::of(c == 1);
+			default: return Result::of(c == 1 || c == 0);
+			}
+		}
+	default:
+		break;
+	}
+
+	// 算術演算。両方とも整数なら整数で、そうでなければ実数で計算する
+	Result x = evaluate(n.left, lookup).number();
+	Result y = evaluate(n.right, lookup).number();
+	if (x.type == Result::Integer && y.type == Result::Integer) {
+		uint64_t a = x.integer;
+		uint64_t b = y.integer;
+		switch (n.op) {
+		case Node::Add: return Result::of(int64_t(a + b)); // 桁あふれは2の補数で折り返す
+		case Node::Sub: return Result::of(int64_t(a - b));
+		case Node::Mul: return Result::of(int64_t(a * b));
+		default:
+			if (y.integer == 0) {
+				fprintf(stderr, "division by zero\n");
+				return Result::of(int64_t(0));
+			}
+			if (y.integer == -1) { // INT64_MIN / -1 を避ける
+				return Result::of(n.op == Node::Div ? int64_t(0 - a) : int64_t(0));
+			}
+			return Result::of(n.op == Node::Div ? x.integer / y.integer : x.integer % y.integer);
+		}
+	}
+	double a = x.to_real();
+	double b = y.to_real();
+	switch (n.op) {
+	case Node::Add: return Result::of(a + b);
+	case Node::Sub: return Result::of(a - b);
+	case Node::Mul: return Result::of(a * b);
+	case Node::Div: return Result::of(a / b);
+	default: return Result::of(std::fmod(a, b));
+	}
+}
+
+/**
+ * @brief 式を評価して真偽を返す
+ * @param lookup 置換マップの値を引く関数
+ * @return 数なら 0 以外、テキストなら先頭の整数が 0 以外のとき true
+ */
+bool Expression::test(Lookup const &lookup) const
+{
+	return evaluate(uint32_t(nodes_.size() - 1), lookup).truth();
+}
@@ -0,0 +1,70 @@
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include "kakiage.h"
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief #if などの条件式
+ *
+ * テンプレートをコンパイルするときに一度だけ解析して、ノードの配列にしておく。
+ * 評価するときはメモリを確保しない。
+ *
+ *   優先順位の低い順に || && == != < <= > >= + - * / % 単項の ! - +、括弧
+ *   オペランドは整数、実数、"文字列"、'文字列'、置換マップの名前（user.name のように . で区切ってもよい）
+ */
+class Expression {
+public:
+	/**
+	 * @brief 名前から置換マップの値を引く。無ければ nullptr
+	 */
+	using Lookup = std::function<kakiage::Value const *(std::string const &name)>;
+private:
+	struct Node {
+		enum Op : uint8_t {
+			Integer,
+			Real,
+			Text, // texts_[index]
+			Variable, // names_[index]。見つからなければ texts_[index]
+			Not,
+			Negate,
+			Plus,
+			Add,
+			Sub,
+			Mul,
+			Div,
+			Mod,
+			Eq,
+			Ne,
+			Lt,
+			Le,
+			Gt,
+			Ge,
+			And,
+			Or,
+		};
+		Op op = Integer;
+		uint16_t height = 1; // 木の高さ
+		uint32_t left = 0; // 子ノード
+		uint32_t right = 0;
+		uint32_t index = 0;
+		int64_t integer = 0;
+		double real = 0;
+	};
+	struct Result;
+	class Parser;
+	std::vector<Node> nodes_; // 最後のものが根
+	std::vector<std::string> names_;
+	std::vector<kakiage::Value> texts_; // 文字列定数と、見つからなかった名前の値
+	Result evaluate(uint32_t i, Lookup const &lookup) const;
+public:
+	static std::optional<Expression> parse(char const *begin, char const *end, char const **next);
+	static Expression variable(std::string const &name);
+	bool test(Lookup const &lookup) const;
+};
+
+#endif // EXPRESSION_H
@@ -0,0 +1,430 @@
+#include "fastcgi.h"
+#include "socketserver.h"
+#include "templatecache.h"
+#include "urlencode.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// FastCGI Specification 1.0
+
+#define FCGI_VERSION_1 1
+
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_DATA 8
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE 11
+
+#define FCGI_KEEP_CONN 1
+
+#define FCGI_RESPONDER 1
+
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_CANT_MPX_CONN 1
+#define FCGI_UNKNOWN_ROLE 3
+
+#define MAX_STDIN_SIZE (1024 * 1024)
+#define MAX_RECORD_CONTENT 65535
+
+namespace {
+
+bool read_all(int fd, unsigned char *ptr, size_t len)
+{
+	return SocketServer::read_all(fd, ptr, len);
+}
+
+bool write_all(int fd, char const *ptr, size_t len)
+{
+	return SocketServer::write_all(fd, ptr, len);
+}
+
+struct Record {
+	int type = 0;
+	int id = 0;
+	std::vector<unsigned char> content;
+};
+
+bool read_record(int fd, Record *out)
+{
+	unsigned char hdr[8];
+	if (!read_all(fd, hdr, 8)) return false;
+	if (hdr[0] != FCGI_VERSION_1) return false;
+	out->type = hdr[1];
+	out->id = (hdr[2] << 8) | hdr[3];
+	size_t len = (hdr[4] << 8) | hdr[5];
+	size_t pad = hdr[6];
+	out->content.resize(len + pad);
+	if (!read_all(fd, out->content.data(), len + pad)) return false;
+	out->content.resize(len);
+	return true;
+}
+
+bool write_record(int fd, int type, int id, char const *ptr, size_t len)
+{
+	do {
+		size_t n = std::min(len, (size_t)MAX_RECORD_CONTENT);
+		size_t pad = (8 - n % 8) % 8;
+		char hdr[8];
+		hdr[0] = FCGI_VERSION_1;
+		hdr[1] = (char)type;
+		hdr[2] = char(id >> 8);
+		hdr[3] = char(id);
+		hdr[4] = char(n >> 8);
+		hdr[5] = char(n);
+		hdr[6] = (char)pad;
+		hdr[7] = 0;
+		static const char zero[8] = {};
+		if (!write_all(fd, hdr, 8) || !write_all(fd, ptr, n) || !write_all(fd, zero, pad)) {
+			return false;
+		}
+		ptr += n;
+		len -= n;
+	} while (len > 0);
+	return true;
+}
+
+bool write_end_request(int fd, int id, uint32_t app_status, int protocol_status)
+{
+	char body[8] = {};
+	body[0] = char(app_status >> 24);
+	body[1] = char(app_status >> 16);
+	body[2] = char(app_status >> 8);
+	body[3] = char(app_status);
+	body[4] = (char)protocol_status;
+	return write_record(fd, FCGI_END_REQUEST, id, body, 8);
+}
+
+/**
+ * @brief 名前と値の組を解析する
+ */
+void parse_name_value_pairs(std::vector<unsigned char> const &data, std::map<std::string, std::string> *out)
+{
+	unsigned char const *ptr = data.data();
+	unsigned char const *end = ptr + data.size();
+	auto Length = [&](size_t *len){
+		if (ptr >= end) return false;
+		if (ptr[0] & 0x80) {
+			if (ptr + 4 > end) return false;
+			*len = ((size_t)(ptr[0] & 0x7f) << 24) | ((size_t)ptr[1] << 16) | ((size_t)ptr[2] << 8) | ptr[3];
+			ptr += 4;
+		} else {
+			*len = ptr[0];
+			ptr++;
+		}
+		return true;
+	};
+	while (ptr < end) {
+		size_t namelen;
+		size_t valuelen;
+		if (!Length(&namelen) || !Length(&valuelen)) break;
+		if ((size_t)(end - ptr) < namelen + valuelen) break;
+		std::string name((char const *)ptr, namelen);
+		ptr += namelen;
+		std::string value((char const *)ptr, valuelen);
+		ptr += valuelen;
+		(*out)[name] = value;
+	}
+}
+
+void append_name_value_pair(std::string *out, std::string const &name, std::string const &value)
+{
+	auto Length = [&](size_t len){
+		if (len < 128) {
+			*out += (char)len;
+		} else {
+			*out += char((len >> 24) | 0x80);
+			*out += char(len >> 16);
+			*out += char(len >> 8);
+			*out += char(len);
+		}
+	};
+	Length(name.size());
+	Length(value.size());
+	*out += name;
+	*out += value;
+}
+
+/**
+ * @brief "a=1&b=2" 形式の変数を解析する
+ */
+void parse_query(std::string_view const &query, kakiage::Variables *out)
+{
+	size_t pos = 0;
+	while (pos <= query.size()) {
+		size_t i = query.find('&', pos);
+		if (i == std::string_view::npos) {
+			i = query.size();
+		}
+		std::string_view pair = query.substr(pos, i - pos);
+		if (!pair.empty()) {
+			size_t eq = pair.find('=');
+			std::string name = url_decode(pair.substr(0, eq));
+			std::string value;
+			if (eq != std::string_view::npos) {
+				value = url_decode(pair.substr(eq + 1));
+			}
+			if (name.size() > 2 && name.compare(name.size() - 2, 2, "[]") == 0) { // a[]=1&a[]=2 はリスト
+				kakiage::define_variable(out, name, value);
+			} else {
+				out->emplace(name, value); // 最初のものを使う
+			}
+		}
+		pos = i + 1;
+	}
+}
+
+char const *content_type_of(std::string const &path)
+{
+	size_t i = path.rfind('.');
+	if (i != std::string::npos && path.find('/', i) == std::string::npos) {
+		std::string ext = path.substr(i + 1);
+		if (ext == "html" || ext == "htm") return "text/html; charset=utf-8";
+		if (ext == "txt") return "text/plain; charset=utf-8";
+		if (ext == "json") return "application/json";
+		if (ext == "xml") return "application/xml";
+		if (ext == "css") return "text/css";
+		if (ext == "js") return "text/javascript";
+	}
+	return "text/html; charset=utf-8";
+}
+
+} // namespace
+
+struct FastCGIServer::Request {
+	int id = 0;
+	bool keep_conn = false;
+	std::vector<unsigned char> params_data; // 名前と値の組はレコードをまたぐことがあるので、まとめてから解析する
+	std::map<std::string, std::string> params;
+	std::string stdin_data;
+	bool stdin_overflow = false; // 本文が MAX_STDIN_SIZE を超えた
+};
+
+struct FastCGIServer::Private {
+	kakiage engine;
+	kakiage::Variables defines;
+	TemplateCache cache;
+	std::string document_root;
+	Private(kakiage const &engine, kakiage::Variables const &defines)
+		: engine(engine)
+		, defines(defines)
+		, cache(&this->engine)
+	{
+	}
+};
+
+FastCGIServer::FastCGIServer(kakiage const &engine, kakiage::Variables const &defines)
+	: m(new Private(engine, defines))
+{
+	m->engine.dependencies = nullptr;
+}
+
+FastCGIServer::~FastCGIServer()
+{
+	delete m;
+}
+
+/**
+ * @brief テンプレートを探すディレクトリを設定する
+ *
+ * 設定しなければ SCRIPT_FILENAME パラメータをそのまま使う。
+ */
+void FastCGIServer::set_document_root(std::string const &dir)
+{
+	m->document_root = dir;
+	while (!m->document_root.empty() && m->document_root.back() == '/') {
+		m->document_root.pop_back();
+	}
+}
+
+/**
+ * @brief 1つの要求に応答する
+ */
+void FastCGIServer::respond(int fd, Request const &req)
+{
+	auto Param = [&](char const *name)->std::string{
+		auto it = req.params.find(name);
+		return it != req.params.end() ? it->second : std::string();
+	};
+
+	std::string path;
+	if (m->document_root.empty()) {
+		path = Param("SCRIPT_FILENAME");
+	} else {
+		std::string uri = Param("DOCUMENT_URI");
+		if (uri.empty()) {
+			uri = Param("SCRIPT_NAME") + Param("PATH_INFO");
+		}
+		if (uri.empty()) {
+			uri = Param("REQUEST_URI");
+			uri = uri.substr(0, uri.find('?'));
+		}
+		if (uri.empty() || uri[0] != '/') {
+			uri = '/' + uri;
+		}
+		if (uri.back() == '/') {
+			uri += "index.html";
+		}
+		path = m->document_root + uri;
+	}
+
+	TemplateCache::TemplatePtr tmpl;
+	if (!req.stdin_overflow && !path.empty() && (path + '/').find("/../") == std::string::npos) { // ルートの外には出さない
+		tmpl = m->cache.load(path);
+	}
+
+	std::string response;
+	if (req.stdin_overflow) { // 一部だけの本文で生成しない
+		response = "Status: 413 Payload Too Large\r\nContent-Type: text/plain\r\n\r\nPayload Too Large\n";
+	} else if (!tmpl) {
+		response = "Status: 404 Not Found\r\nContent-Type: text/plain\r\n\r\nNot Found\n";
+	} else {
+		kakiage::Variables map;
+		parse_query(Param("QUERY_STRING"), &map);
+		if (Param("CONTENT_TYPE").find("application/x-www-form-urlencoded") == 0) {
+			parse_query(req.stdin_data, &map);
+		}
+		for (auto const &[name, value] : m->defines) {
+			map[name] = value;
+		}
+		for (auto const &[name, value] : req.params) {
+			map[name] = value;
+		}
+
+		kakiage engine = m->engine; // ワーカーごとに状態を持つので複製する
+		std::string result = engine.render(*tmpl, map);
+
+		response = "Content-Type: ";
+		response += content_type_of(path);
+		response += "\r\nContent-Length: ";
+		response += std::to_string(result.size());
+		response += "\r\n\r\n";
+		if (Param("REQUEST_METHOD") != "HEAD") {
+			response += result;
+		}
+	}
+	write_record(fd, FCGI_STDOUT, req.id, response.data(), response.size());
+	write_record(fd, FCGI_STDOUT, req.id, nullptr, 0);
+	write_end_request(fd, req.id, 0, FCGI_REQUEST_COMPLETE);
+}
+
+/**
+ * @brief 要求を1つ処理する
+ * @return 接続を続けるなら true
+ *
+ * 接続の多重化はしない。FCGI_KEEP_CONN が指定されていれば、接続を残して次の要求を待つ。
+ */
+bool FastCGIServer::serve(int fd)
+{
+	Request req;
+	bool active = false;
+	Record rec;
+	while (read_record(fd, &rec)) {
+		switch (rec.type) {
+		case FCGI_GET_VALUES:
+			{
+				std::map<std::string, std::string> names;
+				parse_name_value_pairs(rec.content, &names);
+				std::string out;
+				for (auto const &[name, value] : names) {
+					(void)value;
+					if (name == "FCGI_MPXS_CONNS") {
+						append_name_value_pair(&out, name, "0");
+					} else if (name == "FCGI_MAX_CONNS" || name == "FCGI_MAX_REQS") {
+						append_name_value_pair(&out, name, std::to_string(SOMAXCONN));
+					}
+				}
+				if (!write_record(fd, FCGI_GET_VALUES_RESULT, 0, out.data(), out.size())) return false;
+				if (!active) return true;
+			}
+			break;
+		case FCGI_BEGIN_REQUEST:
+			if (rec.content.size() < 8) return false;
+			if (active) {
+				write_end_request(fd, rec.id, 0, FCGI_CANT_MPX_CONN);
+				break;
+			}
+			if (((rec.content[0] << 8) | rec.content[1]) != FCGI_RESPONDER) {
+				write_end_request(fd, rec.id, 0, FCGI_UNKNOWN_ROLE);
+				break;
+			}
+			req = Request();
+			req.id = rec.id;
+			req.keep_conn = (rec.content[2] & FCGI_KEEP_CONN) != 0;
+			active = true;
+			break;
+		case FCGI_ABORT_REQUEST:
+			if (active && rec.id == req.id) {
+				write_end_request(fd, req.id, 0, FCGI_REQUEST_COMPLETE);
+				return req.keep_conn;
+			}
+			break;
+		case FCGI_PARAMS:
+			if (active && rec.id == req.id) {
+				if (rec.content.empty()) {
+					parse_name_value_pairs(req.params_data, &req.params);
+					req.params_data.clear();
+				} else {
+					req.params_data.insert(req.params_data.end(), rec.content.begin(), rec.content.end());
+				}
+			}
+			break;
+		case FCGI_STDIN:
+			if (active && rec.id == req.id) {
+				if (!rec.content.empty()) {
+					if (req.stdin_data.size() + rec.content.size() <= MAX_STDIN_SIZE) {
+						req.stdin_data.append((char const *)rec.content.data(), rec.content.size());
+					} else {
+						req.stdin_overflow = true;
+						req.stdin_data.clear();
+					}
+				} else {
+					respond(fd, req);
+					return req.keep_conn;
+				}
+			}
+			break;
+		case FCGI_DATA:
+			break;
+		default:
+			{
+				char body[8] = {};
+				body[0] = (char)rec.type;
+				if (!write_record(fd, FCGI_UNKNOWN_TYPE, 0, body, 8)) return false;
+				if (!active) return true;
+			}
+			break;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief 待ち受けて要求を処理する
+ * @param address Unix ドメインソケットのパス、または [host]:port
+ * @param threads ワーカースレッド数（0 ならハードウェアのスレッド数）
+ * @return 終了コード
+ */
+int FastCGIServer::run(std::string const &address, int threads)
+{
+	int sock = SocketServer::listen(address);
+	if (sock < 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", address.c_str(), strerror(errno));
+		return 1;
+	}
+	int r = SocketServer::run(sock, threads, [this](int fd){
+		return serve(fd);
+	});
+	if (address.find('/') != std::string::npos) {
+		unlink(address.c_str());
+	}
+	return r;
+}
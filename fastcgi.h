@@ -0,0 +1,31 @@
+#ifndef FASTCGI_H
+#define FASTCGI_H
+
+#include "kakiage.h"
+#include <map>
+#include <string>
+
+/**
+ * @brief FastCGI レスポンダー
+ *
+ * 要求パスに対応するテンプレートを生成して返す。
+ * CGI パラメータと、クエリ文字列（および application/x-www-form-urlencoded の本文）の変数を置換マップに加える。
+ * 優先順位は CGI パラメータ、定義、クエリ変数の順。
+ */
+class FastCGIServer {
+private:
+	struct Private;
+	Private *m;
+	struct Request;
+	bool serve(int fd);
+	void respond(int fd, Request const &req);
+public:
+	FastCGIServer(kakiage const &engine, kakiage::Variables const &defines);
+	~FastCGIServer();
+	FastCGIServer(FastCGIServer const &) = delete;
+	void operator = (FastCGIServer const &) = delete;
+	void set_document_root(std::string const &dir);
+	int run(std::string const &address, int threads);
+};
+
+#endif // FASTCGI_H
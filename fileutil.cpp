@@ -0,0 +1,86 @@
+#include "fileutil.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+/**
+ * @brief ファイルを読み込む
+ * @param path ファイルパス
+ * @return ファイルの内容。開けなければ std::nullopt
+ */
+std::optional<std::string> read_file(std::string const &path)
+{
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp) return std::nullopt;
+	std::string text;
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		text.append(buf, n);
+	}
+	fclose(fp);
+	return text;
+}
+
+/**
+ * @brief 置き換える前に書き込む一時ファイルの名前
+ * @param path 置き換えるファイル
+ * @return path にプロセス ID と通し番号を付けたもの
+ *
+ * キャッシュは複数のスレッドで共有されるので、プロセス ID だけでは同じ名前になることがある。
+ */
+std::string temp_path(std::string const &path)
+{
+	static std::atomic<unsigned long> counter{0};
+#ifdef _WIN32
+	long pid = _getpid();
+#else
+	long pid = getpid();
+#endif
+	return path + '.' + std::to_string(pid) + '.' + std::to_string(counter++);
+}
+
+/**
+ * @brief 一時ファイルに書いてから置き換える
+ * @param path ファイルパス
+ * @param data 内容
+ * @return 成功したら true
+ *
+ * 読み込み中のプロセスやスレッドが書きかけのファイルを見ることはない。
+ */
+bool write_file(std::string const &path, std::string_view const &data)
+{
+	std::string tmp = temp_path(path);
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (!fp) return false;
+	bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief ディレクトリを作る
+ * @param dir ディレクトリ
+ * @return 作ったか、既にあれば true
+ */
+bool make_directory(std::string const &dir)
+{
+#ifdef _WIN32
+	int r = _mkdir(dir.c_str());
+#else
+	int r = mkdir(dir.c_str(), 0777);
+#endif
+	return r == 0 || errno == EEXIST;
+}
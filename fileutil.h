@@ -0,0 +1,13 @@
+#ifndef FILEUTIL_H
+#define FILEUTIL_H
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+std::optional<std::string> read_file(std::string const &path);
+std::string temp_path(std::string const &path);
+bool write_file(std::string const &path, std::string_view const &data);
+bool make_directory(std::string const &dir);
+
+#endif // FILEUTIL_H
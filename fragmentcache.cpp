@@ -0,0 +1,104 @@
+#include "fragmentcache.h"
+#include "dependency.h"
+#include "fileutil.h"
+#include <cstdio>
+#include <sys/stat.h>
+
+// ファイルに保存する場合、キーのハッシュを名前にして、生成結果を <hash>.frag に、
+// 依存関係を <hash>.frag.deps に書く。保存した時刻は生成結果のファイルの更新日時とする。
+
+/**
+ * @brief コンストラクタ
+ * @param dir 保存先のディレクトリ。空ならプロセス内にだけ保持する
+ */
+FragmentCache::FragmentCache(std::string const &dir)
+	: dir_(dir)
+{
+	while (dir_.size() > 1 && dir_.back() == '/') {
+		dir_.pop_back();
+	}
+}
+
+std::string FragmentCache::path_of(std::string const &key) const
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/%016llx.frag", (unsigned long long)kakiage::hash(key));
+	return dir_ + name;
+}
+
+/**
+ * @brief キャッシュを探す
+ * @param key キー
+ * @return 見つからなければ nullptr
+ */
+FragmentCache::EntryPtr FragmentCache::find(std::string const &key)
+{
+	{
+		std::lock_guard lock(mutex_);
+		auto it = map_.find(key);
+		if (it != map_.end()) {
+			return it->second;
+		}
+	}
+	if (dir_.empty()) {
+		return {};
+	}
+
+	std::string path = path_of(key);
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		return {};
+	}
+	auto deps = load_dependencies((path + ".deps").c_str());
+	if (!deps || deps->source != kakiage::hash(key)) {
+		return {};
+	}
+	auto output = read_file(path);
+	if (!output || kakiage::hash(*output) != deps->output) {
+		return {}; // 書き換えの途中
+	}
+	auto e = std::make_shared<Entry>();
+	e->output = std::move(*output);
+	e->dependencies = std::move(*deps);
+	e->stored = st.st_mtime;
+
+	std::lock_guard lock(mutex_);
+	map_[key] = e;
+	return e;
+}
+
+/**
+ * @brief キャッシュに保存する
+ * @param key キー
+ * @param entry 生成結果
+ */
+void FragmentCache::store(std::string const &key, EntryPtr const &entry)
+{
+	{
+		std::lock_guard lock(mutex_);
+		if (map_.size() >= max_entries_ && map_.find(key) == map_.end()) {
+			auto oldest = map_.begin();
+			for (auto it = map_.begin(); it != map_.end(); it++) {
+				if (it->second->stored < oldest->second->stored) {
+					oldest = it;
+				}
+			}
+			map_.erase(oldest);
+		}
+		map_[key] = entry;
+	}
+	if (dir_.empty()) {
+		return;
+	}
+
+	make_directory(dir_);
+	std::string path = path_of(key);
+	if (write_file(path, entry->output)) {
+		std::string tmp = temp_path(path + ".deps");
+		if (save_dependencies(tmp.c_str(), entry->dependencies)) {
+			rename(tmp.c_str(), (path + ".deps").c_str());
+		} else {
+			remove(tmp.c_str());
+		}
+	}
+}
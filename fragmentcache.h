@@ -0,0 +1,37 @@
+#ifndef FRAGMENTCACHE_H
+#define FRAGMENTCACHE_H
+
+#include "kakiage.h"
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief {{.#cache}} ブロックの生成結果のキャッシュ
+ *
+ * プロセス内に保持し、ディレクトリを指定すればファイルにも保存する。スレッドセーフ。
+ * 有効期限と依存関係の検証は kakiage が行う。
+ */
+class FragmentCache {
+public:
+	struct Entry {
+		std::string output;
+		kakiage::Dependencies dependencies; // source はキーのハッシュ、output は生成結果のハッシュ
+		time_t stored = 0; // 保存した時刻
+	};
+	using EntryPtr = std::shared_ptr<Entry const>;
+private:
+	std::mutex mutex_;
+	std::map<std::string, EntryPtr> map_;
+	std::string dir_;
+	size_t max_entries_ = 1024;
+	std::string path_of(std::string const &key) const;
+public:
+	FragmentCache(std::string const &dir = {});
+	EntryPtr find(std::string const &key);
+	void store(std::string const &key, EntryPtr const &entry);
+};
+
+#endif // FRAGMENTCACHE_H
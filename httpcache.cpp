@@ -0,0 +1,370 @@
+#include "httpcache.h"
+#include "fileutil.h"
+#include "kakiage.h"
+#include "webclient.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifndef _WIN32
+#include <strings.h>
+#endif
+
+// ファイルに保存する場合、URL のハッシュを名前にした <hash>.http に、
+// 次の形式のヘッダと、空行に続けて本文を書く。
+//
+//   kakiage-http 1
+//   url <url>
+//   stored <time>
+//   max-age <seconds>
+//   no-cache <0|1>
+//   etag <etag>
+//   last-modified <date>
+
+#define HTTPCACHE_MAGIC "kakiage-http 1"
+
+namespace {
+
+int x_strnicmp(char const *s1, char const *s2, size_t n)
+{
+#ifdef _WIN32
+	return ::_strnicmp(s1, s2, n);
+#else
+	return ::strncasecmp(s1, s2, n);
+#endif
+}
+
+/**
+ * @brief HTTP-date（IMF-fixdate）を解析する
+ * @return 時刻。解析できなければ -1
+ */
+time_t parse_http_date(std::string const &s)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char mon[4] = {};
+	struct tm tm = {};
+	if (sscanf(s.c_str(), "%*3s, %d %3s %d %d:%d:%d", &tm.tm_mday, mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+		return -1;
+	}
+	char const *p = strstr(months, mon);
+	if (!p || mon[0] == 0 || (p - months) % 3 != 0) {
+		return -1;
+	}
+	tm.tm_mon = int(p - months) / 3;
+	tm.tm_year -= 1900;
+#ifdef _WIN32
+	return _mkgmtime(&tm);
+#else
+	return timegm(&tm);
+#endif
+}
+
+/**
+ * @brief 応答ヘッダからキャッシュの有効期間を決める
+ * @return 保存してよければ true
+ */
+bool apply_cache_headers(WebClient::Response const &res, time_t now, HttpCache::Entry *e)
+{
+	bool no_store = false;
+	bool has_max_age = false;
+	e->no_cache = false;
+	e->max_age = 0;
+	std::string cc = WebClient::header_value(res, "Cache-Control");
+	size_t pos = 0;
+	while (pos < cc.size()) {
+		size_t i = cc.find(',', pos);
+		if (i == std::string::npos) {
+			i = cc.size();
+		}
+		std::string_view d = kakiage::trimmed(std::string_view(cc).substr(pos, i - pos));
+		pos = i + 1;
+		auto IS = [&](char const *name){
+			size_t n = strlen(name);
+			return d.size() >= n && x_strnicmp(d.data(), name, n) == 0 && (d.size() == n || d[n] == '=');
+		};
+		if (IS("no-store")) {
+			no_store = true;
+		} else if (IS("no-cache")) {
+			e->no_cache = true;
+		} else if (IS("max-age") && d.size() > 8) {
+			e->max_age = strtol(std::string(d.substr(8)).c_str(), nullptr, 10);
+			has_max_age = true;
+		}
+	}
+	if (!has_max_age) {
+		std::string expires = WebClient::header_value(res, "Expires");
+		if (!expires.empty()) {
+			time_t t = parse_http_date(expires);
+			time_t date = parse_http_date(WebClient::header_value(res, "Date"));
+			e->max_age = t < 0 ? 0 : long(t - (date < 0 ? now : date)); // 解析できない Expires は期限切れとみなす
+		}
+	}
+	std::string age = WebClient::header_value(res, "Age");
+	if (!age.empty()) {
+		e->max_age -= strtol(age.c_str(), nullptr, 10);
+	}
+	if (e->max_age < 0) {
+		e->max_age = 0;
+	}
+	e->stored = now;
+	e->etag = WebClient::header_value(res, "ETag");
+	e->last_modified = WebClient::header_value(res, "Last-Modified");
+	if (no_store) return false;
+	return e->max_age > 0 || !e->etag.empty() || !e->last_modified.empty(); // どちらも無ければ再利用できない
+}
+
+} // namespace
+
+/**
+ * @brief コンストラクタ
+ * @param dir 保存先のディレクトリ。空ならプロセス内にだけ保持する
+ */
+HttpCache::HttpCache(std::string const &dir)
+	: dir_(dir)
+{
+	while (dir_.size() > 1 && dir_.back() == '/') {
+		dir_.pop_back();
+	}
+}
+
+std::string HttpCache::path_of(std::string const &url) const
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/%016llx.http", (unsigned long long)kakiage::hash(url));
+	return dir_ + name;
+}
+
+/**
+ * @brief 保存した応答をファイルから読み込む
+ */
+HttpCache::EntryPtr HttpCache::load(std::string const &url)
+{
+	auto text = read_file(path_of(url));
+	if (!text) return {};
+	size_t i = text->find("\n\n");
+	if (i == std::string::npos) return {};
+	std::string_view header(text->data(), i + 1);
+
+	auto e = std::make_shared<Entry>();
+	bool magic = false;
+	while (!header.empty()) {
+		size_t j = header.find('\n');
+		std::string_view line = header.substr(0, j);
+		header = header.substr(j + 1);
+		if (!magic) {
+			if (line != HTTPCACHE_MAGIC) return {};
+			magic = true;
+			continue;
+		}
+		size_t k = line.find(' ');
+		std::string_view name = line.substr(0, k);
+		std::string value(k == std::string_view::npos ? std::string_view() : line.substr(k + 1));
+		if (name == "url") {
+			e->url = value;
+		} else if (name == "stored") {
+			e->stored = (time_t)strtoll(value.c_str(), nullptr, 10);
+		} else if (name == "max-age") {
+			e->max_age = strtol(value.c_str(), nullptr, 10);
+		} else if (name == "no-cache") {
+			e->no_cache = value == "1";
+		} else if (name == "etag") {
+			e->etag = value;
+		} else if (name == "last-modified") {
+			e->last_modified = value;
+		}
+	}
+	if (!magic || e->url != url) return {}; // ハッシュの衝突
+	e->body = text->substr(i + 2);
+	return e;
+}
+
+/**
+ * @brief 応答をファイルに保存する
+ *
+ * 一時ファイルに書いてから置き換える。
+ */
+void HttpCache::save(EntryPtr const &e)
+{
+	if (e->url.find('\n') != std::string::npos || e->etag.find('\n') != std::string::npos || e->last_modified.find('\n') != std::string::npos) {
+		return;
+	}
+	std::string text = HTTPCACHE_MAGIC "\n";
+	text += "url " + e->url + '\n';
+	text += "stored " + std::to_string((long long)e->stored) + '\n';
+	text += "max-age " + std::to_string(e->max_age) + '\n';
+	text += std::string("no-cache ") + (e->no_cache ? "1" : "0") + '\n';
+	text += "etag " + e->etag + '\n';
+	text += "last-modified " + e->last_modified + '\n';
+	text += '\n';
+	text += e->body;
+	make_directory(dir_);
+	write_file(path_of(e->url), text);
+}
+
+void HttpCache::put(EntryPtr const &e)
+{
+	std::lock_guard lock(mutex_);
+	if (map_.size() >= max_entries_ && map_.find(e->url) == map_.end()) {
+		auto oldest = map_.begin();
+		for (auto it = map_.begin(); it != map_.end(); it++) {
+			if (it->second->stored < oldest->second->stored) {
+				oldest = it;
+			}
+		}
+		map_.erase(oldest);
+	}
+	map_[e->url] = e;
+}
+
+/**
+ * @brief 保存した応答を探す（プロセス内になければファイルから）
+ */
+HttpCache::EntryPtr HttpCache::lookup(std::string const &url)
+{
+	{
+		std::lock_guard lock(mutex_);
+		auto it = map_.find(url);
+		if (it != map_.end()) {
+			return it->second;
+		}
+	}
+	if (!dir_.empty()) {
+		EntryPtr e = load(url);
+		if (e) {
+			put(e); // 次からはファイルを読まない
+		}
+		return e;
+	}
+	return {};
+}
+
+/**
+ * @brief 保存した応答を捨てる
+ */
+void HttpCache::erase(std::string const &url)
+{
+	{
+		std::lock_guard lock(mutex_);
+		map_.erase(url);
+	}
+	if (!dir_.empty()) {
+		remove(path_of(url).c_str());
+	}
+}
+
+/**
+ * @brief 問い合わせずに使える期間内か
+ */
+bool HttpCache::is_fresh(EntryPtr const &entry, time_t now)
+{
+	return entry && !entry->no_cache && now - entry->stored < entry->max_age;
+}
+
+/**
+ * @brief 保存した応答があれば条件付きにした要求を作る
+ */
+WebClient::Request HttpCache::make_request(std::string const &url, EntryPtr const &cached)
+{
+	WebClient::Request req(url);
+	if (cached) {
+		if (!cached->etag.empty()) {
+			req.add_header("If-None-Match: " + cached->etag);
+		}
+		if (!cached->last_modified.empty()) {
+			req.add_header("If-Modified-Since: " + cached->last_modified);
+		}
+	}
+	return req;
+}
+
+/**
+ * @brief 応答を保存して、本文を返す
+ * @param cached 要求を作るのに使った保存済みの応答
+ * @param now 要求した時刻
+ * @return 本文。2xx でも 304 でもなければ std::nullopt
+ */
+std::optional<std::string> HttpCache::store(std::string const &url, EntryPtr const &cached, time_t now, WebClient::Response const &res)
+{
+	if (res.code == 304 && cached) { // 変わっていない
+		auto e = std::make_shared<Entry>(*cached);
+		std::string etag = e->etag;
+		std::string last_modified = e->last_modified;
+		apply_cache_headers(res, now, e.get());
+		if (e->etag.empty()) {
+			e->etag = etag; // 304 で省略されたら前の値を使う
+		}
+		if (e->last_modified.empty()) {
+			e->last_modified = last_modified;
+		}
+		put(e);
+		if (!dir_.empty()) {
+			save(e);
+		}
+		return e->body;
+	}
+	if (res.code < 200 || res.code > 299) {
+		return std::nullopt;
+	}
+
+	auto e = std::make_shared<Entry>();
+	e->url = url;
+	e->body.assign(res.content.begin(), res.content.end());
+	if (apply_cache_headers(res, now, e.get())) {
+		put(e);
+		if (!dir_.empty()) {
+			save(e);
+		}
+	} else if (cached) {
+		erase(url); // 古い ETag で問い合わせ続けないようにする
+	}
+	return e->body;
+}
+
+/**
+ * @brief URL の内容を取得する
+ * @param url URL
+ * @return 本文。失敗するか、2xx 以外の応答なら std::nullopt
+ */
+std::optional<std::string> HttpCache::fetch(std::string const &url)
+{
+	EntryPtr cached = lookup(url);
+	time_t now = time(nullptr);
+	if (is_fresh(cached, now)) {
+		return cached->body; // 新しいので問い合わせない
+	}
+
+	WebClient http(WebContext::shared()); // 接続を使い回す
+	http.get(make_request(url, cached));
+	return store(url, cached, now, http.response());
+}
+
+/**
+ * @brief 複数の URL の内容をまとめて取得する
+ *
+ * 問い合わせが必要なものは WebClient::fetch_all で並行して取得する。
+ * @return urls と同じ順の本文。失敗したものは std::nullopt
+ */
+std::vector<std::optional<std::string>> HttpCache::fetch_all(std::vector<std::string> const &urls)
+{
+	std::vector<std::optional<std::string>> results(urls.size());
+	std::vector<WebClient::Request> requests;
+	std::vector<size_t> indexes;
+	std::vector<EntryPtr> cached;
+	time_t now = time(nullptr);
+	for (size_t i = 0; i < urls.size(); i++) {
+		EntryPtr e = lookup(urls[i]);
+		if (is_fresh(e, now)) {
+			results[i] = e->body;
+		} else {
+			requests.push_back(make_request(urls[i], e));
+			indexes.push_back(i);
+			cached.push_back(e);
+		}
+	}
+	WebClient::fetch_all(WebContext::shared(), requests, [&](size_t k, WebClient::FetchResult const &r){
+		size_t i = indexes[k];
+		results[i] = store(urls[i], cached[k], now, r.response);
+	});
+	return results;
+}
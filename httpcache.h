@@ -0,0 +1,54 @@
+#ifndef HTTPCACHE_H
+#define HTTPCACHE_H
+
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "webclient.h"
+
+/**
+ * @brief {{.#fetch}} が使う HTTP 応答のキャッシュ
+ *
+ * Cache-Control（max-age, no-cache, no-store）と Expires で決まる期間は保存した本文を返す。
+ * 期間を過ぎたら ETag と Last-Modified で条件付きリクエストを送り、304 なら保存した本文を使う。
+ * プロセス内に保持し、ディレクトリを指定すればファイルにも保存する。スレッドセーフ。
+ */
+class HttpCache {
+public:
+	struct Entry {
+		std::string url;
+		std::string body;
+		std::string etag;
+		std::string last_modified;
+		time_t stored = 0; // 取得または検証した時刻
+		long max_age = 0; // stored からの有効期間（秒）
+		bool no_cache = false; // 毎回検証する
+	};
+	using EntryPtr = std::shared_ptr<Entry const>;
+private:
+	std::mutex mutex_;
+	std::map<std::string, EntryPtr> map_;
+	std::string dir_;
+	size_t max_entries_ = 256;
+	std::string path_of(std::string const &url) const;
+	EntryPtr load(std::string const &url);
+	void save(EntryPtr const &entry);
+	void put(EntryPtr const &entry);
+	void erase(std::string const &url);
+	EntryPtr lookup(std::string const &url);
+	static bool is_fresh(EntryPtr const &entry, time_t now);
+	static WebClient::Request make_request(std::string const &url, EntryPtr const &cached);
+	std::optional<std::string> store(std::string const &url, EntryPtr const &cached, time_t now, WebClient::Response const &res);
+public:
+	HttpCache(std::string const &dir = {});
+	HttpCache(HttpCache const &) = delete;
+	void operator = (HttpCache const &) = delete;
+	std::optional<std::string> fetch(std::string const &url);
+	std::vector<std::optional<std::string>> fetch_all(std::vector<std::string> const &urls);
+};
+
+#endif // HTTPCACHE_H
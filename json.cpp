@@ -0,0 +1,499 @@
+#include "json.h"
+#include <cctype>
+#include <cstring>
+
+namespace {
+
+const size_t MAX_DEPTH = 1000; // signature は再帰するので、入れ子の深さを制限する
+
+/**
+ * @brief 8バイトの中に '"' '\\' または制御文字があるか
+ *
+ * 該当するバイトがあれば必ず true になる。その後ろのバイトで誤って true になることはあるが、1バイトずつ調べ直すので構わない。
+ */
+inline bool has_special(uint64_t w)
+{
+	uint64_t const ones = 0x0101010101010101ull;
+	uint64_t const highs = 0x8080808080808080ull;
+	uint64_t q = w ^ (ones * '"');
+	uint64_t b = w ^ (ones * '\\');
+	return (((q - ones) & ~q) | ((b - ones) & ~b) | ((w - ones * 0x20) & ~w)) & highs;
+}
+
+void put_utf8(char **out, uint32_t c)
+{
+	char *p = *out;
+	if (c < 0x80) {
+		*p++ = (char)c;
+	} else if (c < 0x800) {
+		*p++ = (char)(0xc0 | (c >> 6));
+		*p++ = (char)(0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		*p++ = (char)(0xe0 | (c >> 12));
+		*p++ = (char)(0x80 | ((c >> 6) & 0x3f));
+		*p++ = (char)(0x80 | (c & 0x3f));
+	} else {
+		*p++ = (char)(0xf0 | (c >> 18));
+		*p++ = (char)(0x80 | ((c >> 12) & 0x3f));
+		*p++ = (char)(0x80 | ((c >> 6) & 0x3f));
+		*p++ = (char)(0x80 | (c & 0x3f));
+	}
+	*out = p;
+}
+
+} // namespace
+
+/**
+ * @brief 文書を先頭から一度だけ読む
+ *
+ * 再帰せず、閉じていない配列やオブジェクトをスタックに積む。
+ * 子は閉じるまで scratch_ に置き、閉じたときにまとめて nodes_ の末尾に移すので、兄弟は連続して並ぶ。
+ */
+class JsonDocument::Parser {
+private:
+	struct Open {
+		Type type;
+		uint32_t begin; // scratch_ の中の最初の子
+		char const *key;
+		uint32_t keylen;
+	};
+	JsonDocument *doc_;
+	char *p_;
+	char *end_;
+	int line_ = 1;
+	std::string error_;
+	std::vector<Node> scratch_;
+	std::vector<Open> stack_;
+	char const *key_ = nullptr; // 次の値のメンバー名
+	uint32_t keylen_ = 0;
+
+	bool fail(char const *message)
+	{
+		if (error_.empty()) {
+			error_ = std::string(message) + " (line " + std::to_string(line_) + ")";
+		}
+		return false;
+	}
+	void skip()
+	{
+		while (p_ < end_) {
+			char c = *p_;
+			if (c == '\n') {
+				line_++;
+			} else if (c != ' ' && c != '\t' && c != '\r') {
+				break;
+			}
+			p_++;
+		}
+	}
+	bool hex4(uint32_t *value)
+	{
+		if (end_ - p_ < 4) return false;
+		uint32_t v = 0;
+		for (int i = 0; i < 4; i++) {
+			char c = *p_++;
+			v <<= 4;
+			if (c >= '0' && c <= '9') {
+				v |= c - '0';
+			} else if (c >= 'a' && c <= 'f') {
+				v |= c - 'a' + 10;
+			} else if (c >= 'A' && c <= 'F') {
+				v |= c - 'A' + 10;
+			} else {
+				return false;
+			}
+		}
+		*value = v;
+		return true;
+	}
+	/**
+	 * @brief 文字列を読み、その場でエスケープを解く
+	 *
+	 * エスケープを解いたものは元より長くならないので、読んだところに上書きする。
+	 */
+	bool string(char const **text, uint32_t *len)
+	{
+		char *begin = ++p_;
+		char *out = nullptr; // 最初のエスケープまでは書き換えない
+		for (;;) {
+			while (end_ - p_ >= 8) {
+				uint64_t w;
+				memcpy(&w, p_, 8);
+				if (has_special(w)) break;
+				if (out) {
+					memmove(out, p_, 8);
+					out += 8;
+				}
+				p_ += 8;
+			}
+			if (p_ >= end_) return fail("unterminated string");
+			unsigned char c = *p_;
+			if (c == '"') {
+				*text = begin;
+				*len = uint32_t((out ? out : p_) - begin);
+				p_++;
+				return true;
+			}
+			if (c < 0x20) return fail("control character in string");
+			if (c != '\\') {
+				if (out) {
+					*out++ = c;
+				}
+				p_++;
+				continue;
+			}
+			if (!out) {
+				out = p_;
+			}
+			if (end_ - p_ < 2) return fail("unterminated string");
+			c = p_[1];
+			p_ += 2;
+			switch (c) {
+			case '"':
+			case '\\':
+			case '/':
+				*out++ = c;
+				break;
+			case 'b':
+				*out++ = '\b';
+				break;
+			case 'f':
+				*out++ = '\f';
+				break;
+			case 'n':
+				*out++ = '\n';
+				break;
+			case 'r':
+				*out++ = '\r';
+				break;
+			case 't':
+				*out++ = '\t';
+				break;
+			case 'u':
+				{
+					uint32_t u;
+					if (!hex4(&u)) return fail("invalid \\u escape");
+					if (u >= 0xd800 && u < 0xdc00) {
+						uint32_t low;
+						if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u') return fail("unpaired surrogate");
+						p_ += 2;
+						if (!hex4(&low) || low < 0xdc00 || low >= 0xe000) return fail("unpaired surrogate");
+						u = 0x10000 + ((u - 0xd800) << 10) + (low - 0xdc00);
+					} else if (u >= 0xdc00 && u < 0xe000) {
+						return fail("unpaired surrogate");
+					}
+					put_utf8(&out, u);
+				}
+				break;
+			default:
+				return fail("invalid escape");
+			}
+		}
+	}
+	bool digits()
+	{
+		if (p_ >= end_ || !isdigit((unsigned char)*p_)) return false;
+		do {
+			p_++;
+		} while (p_ < end_ && isdigit((unsigned char)*p_));
+		return true;
+	}
+	bool number(Node *node)
+	{
+		char const *begin = p_;
+		if (*p_ == '-') {
+			p_++;
+		}
+		if (p_ < end_ && *p_ == '0') {
+			p_++;
+		} else if (!digits()) {
+			return fail("invalid number");
+		}
+		if (p_ < end_ && *p_ == '.') {
+			p_++;
+			if (!digits()) return fail("invalid number");
+		}
+		if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+			p_++;
+			if (p_ < end_ && (*p_ == '+' || *p_ == '-')) {
+				p_++;
+			}
+			if (!digits()) return fail("invalid number");
+		}
+		node->type = Number;
+		node->text = begin;
+		node->len = uint32_t(p_ - begin);
+		return true;
+	}
+	bool literal(char const *word, Type type, Node *node)
+	{
+		size_t n = strlen(word);
+		if ((size_t)(end_ - p_) < n || memcmp(p_, word, n) != 0) return fail("invalid literal");
+		p_ += n;
+		node->type = type;
+		return true;
+	}
+	bool scalar(Node *node)
+	{
+		switch (*p_) {
+		case '"':
+			node->type = String;
+			return string(&node->text, &node->len);
+		case 't':
+			return literal("true", True, node);
+		case 'f':
+			return literal("false", False, node);
+		case 'n':
+			return literal("null", Null, node);
+		}
+		return number(node);
+	}
+	bool key()
+	{
+		skip();
+		if (p_ >= end_ || *p_ != '"') return fail("expected a member name");
+		if (!string(&key_, &keylen_)) return false;
+		skip();
+		if (p_ >= end_ || *p_ != ':') return fail("expected ':'");
+		p_++;
+		return true;
+	}
+	void close()
+	{
+		Open o = stack_.back();
+		stack_.pop_back();
+		Node node;
+		node.type = o.type;
+		node.key = o.key;
+		node.keylen = o.keylen;
+		node.len = uint32_t(scratch_.size() - o.begin);
+		node.first = (uint32_t)doc_->nodes_.size();
+		doc_->nodes_.insert(doc_->nodes_.end(), scratch_.begin() + o.begin, scratch_.end());
+		scratch_.resize(o.begin);
+		scratch_.push_back(node);
+	}
+public:
+	Parser(JsonDocument *doc)
+		: doc_(doc)
+		, p_(doc->text_.data())
+		, end_(doc->text_.data() + doc->text_.size())
+	{
+	}
+	std::string const &error() const
+	{
+		return error_;
+	}
+	bool run()
+	{
+		for (;;) {
+			skip();
+			if (p_ >= end_) return fail("unexpected end of document");
+			char c = *p_;
+			if (c == '{' || c == '[') {
+				if (stack_.size() >= MAX_DEPTH) return fail("nested too deeply");
+				stack_.push_back({c == '{' ? Object : Array, (uint32_t)scratch_.size(), key_, keylen_});
+				key_ = nullptr;
+				keylen_ = 0;
+				p_++;
+				skip();
+				if (p_ < end_ && *p_ == (c == '{' ? '}' : ']')) {
+					p_++;
+					close();
+				} else {
+					if (c == '{' && !key()) return false;
+					continue;
+				}
+			} else {
+				Node node;
+				node.key = key_;
+				node.keylen = keylen_;
+				key_ = nullptr;
+				keylen_ = 0;
+				if (!scalar(&node)) return false;
+				scratch_.push_back(node);
+			}
+			// 値の後
+			for (;;) {
+				skip();
+				if (stack_.empty()) {
+					if (p_ < end_) return fail("extra characters after document");
+					doc_->nodes_.push_back(scratch_.back()); // 根
+					return true;
+				}
+				if (p_ >= end_) return fail("unexpected end of document");
+				Type type = stack_.back().type;
+				if (*p_ == ',') {
+					p_++;
+					if (type == Object && !key()) return false;
+					break;
+				}
+				if (*p_ != (type == Object ? '}' : ']')) return fail("expected ',' or a closing bracket");
+				p_++;
+				close();
+			}
+		}
+	}
+};
+
+JsonDocument::~JsonDocument()
+{
+	if (values_) {
+		for (size_t i = 0; i < nodes_.size(); i++) {
+			delete values_[i].load(std::memory_order_relaxed);
+		}
+	}
+}
+
+/**
+ * @brief JSON 文書を読む
+ * @param text 文書。この中で文字列のエスケープを解く
+ * @param error 失敗したときの理由
+ * @return 文書。失敗したら nullptr
+ */
+std::shared_ptr<JsonDocument const> JsonDocument::parse(std::string text, std::string *error)
+{
+	if (text.size() > UINT32_MAX) {
+		if (error) *error = "document too large";
+		return nullptr;
+	}
+	std::shared_ptr<JsonDocument> doc(new JsonDocument);
+	doc->text_ = std::move(text);
+	Parser parser(doc.get());
+	if (!parser.run()) {
+		if (error) *error = parser.error();
+		return nullptr;
+	}
+	doc->nodes_.shrink_to_fit();
+	doc->values_.reset(new std::atomic<kakiage::Value *>[doc->nodes_.size()]());
+	return doc;
+}
+
+/**
+ * @brief ノードから値を作る
+ * @param node ノード
+ * @param owner 配列やオブジェクトの値が持つ文書
+ *
+ * true は "1"、false は "0"、null は空になる。配列やオブジェクトのテキストは子の数。
+ */
+kakiage::Value JsonDocument::make_value(uint32_t node, std::shared_ptr<JsonDocument const> const &owner) const
+{
+	Node const &n = nodes_[node];
+	switch (n.type) {
+	case False:
+		return kakiage::Value("0");
+	case True:
+		return kakiage::Value("1");
+	case Number:
+	case String:
+		return kakiage::Value(std::string(n.text, n.len));
+	case Array:
+	case Object:
+		return kakiage::Value(std::to_string(n.len), owner, node);
+	default:
+		return kakiage::Value();
+	}
+}
+
+/**
+ * @brief ノードの値。初めて参照されたときに作る
+ */
+kakiage::Value const *JsonDocument::value(uint32_t node) const
+{
+	std::atomic<kakiage::Value *> &slot = values_[node];
+	kakiage::Value *v = slot.load(std::memory_order_acquire);
+	if (!v) {
+		// 文書の中の値は文書を所有しない（所有すると循環参照になる）
+		std::shared_ptr<JsonDocument const> self(std::shared_ptr<JsonDocument const>(), this);
+		kakiage::Value *created = new kakiage::Value(make_value(node, self));
+		if (slot.compare_exchange_strong(v, created, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			v = created;
+		} else {
+			delete created; // 他のスレッドが先に作った
+		}
+	}
+	return v;
+}
+
+/**
+ * @brief 配列やオブジェクトの子の数
+ * @return それ以外なら 0
+ */
+size_t JsonDocument::size(uint32_t node) const
+{
+	Node const &n = nodes_[node];
+	return (n.type == Array || n.type == Object) ? n.len : 0;
+}
+
+/**
+ * @brief 配列の要素
+ * @param node 配列のノード
+ * @param i 位置
+ * @return 要素。範囲外なら nullptr
+ */
+kakiage::Value const *JsonDocument::item(uint32_t node, size_t i) const
+{
+	if (i >= size(node)) return nullptr;
+	return value(nodes_[node].first + (uint32_t)i);
+}
+
+/**
+ * @brief オブジェクトのメンバー
+ * @param node オブジェクトのノード
+ * @param name 名前
+ * @return メンバー。同じ名前が複数あれば最後のもの。無ければ nullptr
+ */
+kakiage::Value const *JsonDocument::member(uint32_t node, std::string_view name) const
+{
+	Node const &n = nodes_[node];
+	if (n.type != Object) return nullptr;
+	for (uint32_t i = n.len; i > 0; i--) {
+		Node const &m = nodes_[n.first + i - 1];
+		if (m.keylen == name.size() && memcmp(m.key, name.data(), name.size()) == 0) {
+			return value(n.first + i - 1);
+		}
+	}
+	return nullptr;
+}
+
+/**
+ * @brief 依存関係に記録する内容
+ * @return 配列やオブジェクトなら、子をすべて並べたもの
+ */
+std::string JsonDocument::signature(uint32_t node) const
+{
+	Node const &n = nodes_[node];
+	if (n.type != Array && n.type != Object) return make_value(node, nullptr).text();
+	std::string s(1, n.type == Array ? '[' : '{');
+	for (uint32_t i = 0; i < n.len; i++) {
+		Node const &m = nodes_[n.first + i];
+		if (n.type == Object) {
+			s += std::to_string(m.keylen);
+			s += ':';
+			s.append(m.key, m.keylen);
+		}
+		std::string t = signature(n.first + i);
+		s += std::to_string(t.size());
+		s += ':';
+		s += t;
+	}
+	s += n.type == Array ? ']' : '}';
+	return s;
+}
+
+/**
+ * @brief 根のオブジェクトのメンバーを置換マップに定義する
+ * @param doc 文書
+ * @param map 置換マップ
+ * @return 根がオブジェクトでなければ false
+ */
+bool JsonDocument::define_variables(std::shared_ptr<JsonDocument const> const &doc, kakiage::Variables *map)
+{
+	uint32_t root = doc->root();
+	Node const &n = doc->nodes_[root];
+	if (n.type != Object) return false;
+	for (uint32_t i = 0; i < n.len; i++) {
+		Node const &m = doc->nodes_[n.first + i];
+		(*map)[std::string(m.key, m.keylen)] = doc->make_value(n.first + i, doc);
+	}
+	return true;
+}
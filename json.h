@@ -0,0 +1,67 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include "kakiage.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief 置換マップに読み込む JSON 文書
+ *
+ * 文書を一度だけ走査して、ノードを配列（アリーナ）に並べる。文字列は元のテキストの中でエスケープを解き、コピーしない。
+ * 配列やオブジェクトの子は連続して並ぶので、n 番目の要素はすぐに引ける。
+ * テンプレートから参照された値だけを、初めて参照されたときに kakiage::Value にする。
+ * 読み込んだ後は変更しないので、複数のスレッドで同時に使ってもよい。
+ */
+class JsonDocument {
+public:
+	enum Type : uint8_t {
+		Null,
+		False,
+		True,
+		Number,
+		String,
+		Array,
+		Object,
+	};
+private:
+	struct Node {
+		Type type = Null;
+		uint32_t keylen = 0;
+		uint32_t len = 0; // 文字列や数の長さ。配列やオブジェクトなら子の数
+		uint32_t first = 0; // 配列やオブジェクトの最初の子
+		char const *key = nullptr; // オブジェクトのメンバーなら名前
+		char const *text = nullptr;
+	};
+	class Parser;
+	std::string text_; // 文字列はこの中でエスケープを解く
+	std::vector<Node> nodes_; // 最後のものが根
+	std::unique_ptr<std::atomic<kakiage::Value *>[]> values_; // 作った値。ノードと同じ並び
+	JsonDocument() = default;
+	kakiage::Value make_value(uint32_t node, std::shared_ptr<JsonDocument const> const &owner) const;
+	kakiage::Value const *value(uint32_t node) const;
+public:
+	~JsonDocument();
+	JsonDocument(JsonDocument const &) = delete;
+	JsonDocument &operator = (JsonDocument const &) = delete;
+	static std::shared_ptr<JsonDocument const> parse(std::string text, std::string *error);
+	uint32_t root() const
+	{
+		return (uint32_t)nodes_.size() - 1;
+	}
+	Type type(uint32_t node) const
+	{
+		return nodes_[node].type;
+	}
+	size_t size(uint32_t node) const;
+	kakiage::Value const *item(uint32_t node, size_t i) const;
+	kakiage::Value const *member(uint32_t node, std::string_view name) const;
+	std::string signature(uint32_t node) const;
+	static bool define_variables(std::shared_ptr<JsonDocument const> const &doc, kakiage::Variables *map);
+};
+
+#endif // JSON_H
@@ -1,8 +1,17 @@
+#include "dependency.h"
+#include "expression.h"
+#include "fragmentcache.h"
 #include "htmlencode.h"
+#include "httpcache.h"
+#include "json.h"
 #include "kakiage.h"
 #include "urlencode.h"
+#include <algorithm>
 #include <cstring>
+#include <ctime>
 #include <optional>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include "strformat.h"
 
@@ -34,6 +43,60 @@ static inline void append(std::vector<char> *out, std::string_view const &s)
 	append(out, s.data(), s.data() + s.size());
 }
 
+/**
+ * @brief 名前を読む
+ * @param p 先頭
+ * @param end 終端
+ * @return 名前の直後。名前でなければ p
+ *
+ * "user.name" や "items.0" のように . で区切ったものもひとつの名前とする。
+ */
+char const *scan_name(char const *p, char const *end)
+{
+	if (p < end && issymf(*p)) {
+		p++;
+		while (p < end && (issym(*p) || (*p == '.' && p + 1 < end && issym(p[1])))) {
+			p++;
+		}
+	}
+	return p;
+}
+
+/**
+ * @brief リストの位置として読む
+ * @param s 10進数
+ * @param index 位置
+ * @return 数でなければ false
+ */
+bool parse_index(std::string_view s, size_t *index)
+{
+	if (s.empty() || s.size() > 9) return false;
+	size_t i = 0;
+	for (char c : s) {
+		if (!isdigit((unsigned char)c)) return false;
+		i = i * 10 + (c - '0');
+	}
+	*index = i;
+	return true;
+}
+
+/**
+ * @brief "user.name" の . より後ろをたどる
+ * @param value 先頭の名前の値
+ * @param name 名前
+ * @param dot 最初の . の位置
+ * @return 値。途中で見つからなければ nullptr
+ */
+kakiage::Value const *member_path(kakiage::Value const *value, std::string_view name, size_t dot)
+{
+	while (value && dot != std::string::npos) {
+		size_t next = name.find('.', dot + 1);
+		value = value->member(name.substr(dot + 1, next - dot - 1));
+		dot = next;
+	}
+	return value;
+}
+
 std::string_view to_string(std::vector<char> const &vec)
 {
 	if (!vec.empty()) {
@@ -152,6 +215,26 @@ std::vector<std::string_view> split_words(std::string_view const &str, char sep)
 	return split_words(begin, end, sep);
 }
 
+/**
+ * @brief 依存関係を追加する
+ */
+void merge_dependencies(kakiage::Dependencies *to, kakiage::Dependencies const &from)
+{
+	to->variables.insert(from.variables.begin(), from.variables.end());
+	to->files.insert(from.files.begin(), from.files.end());
+	to->environment.insert(from.environment.begin(), from.environment.end());
+	for (auto const &s : from.commands) {
+		if (std::find(to->commands.begin(), to->commands.end(), s) == to->commands.end()) {
+			to->commands.push_back(s);
+		}
+	}
+	for (auto const &s : from.calls) {
+		if (std::find(to->calls.begin(), to->calls.end(), s) == to->calls.end()) {
+			to->calls.push_back(s);
+		}
+	}
+}
+
 std::optional<std::string> run(std::string const &command)
 {
 #ifdef _WIN32
@@ -180,6 +263,115 @@ std::string_view kakiage::trimmed(const std::string_view &s)
 	return s.substr(i, j - i);
 }
 
+/**
+ * @brief 文字列のハッシュ値を求める（FNV-1a 64bit）
+ * @param s 文字列
+ * @return ハッシュ値
+ */
+uint64_t kakiage::hash(std::string_view const &s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (char c : s) {
+		h ^= (unsigned char)c;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+void kakiage::depend_variable(std::string const &name, std::string const *value) const
+{
+	if (dependencies) {
+		std::optional<uint64_t> h;
+		if (value) {
+			h = hash(*value);
+		}
+		dependencies->variables.emplace(name, h);
+	}
+}
+
+/**
+ * @brief 名前の値を探す
+ * @param name 名前
+ * @param map 置換マップ
+ * @return 値。#for の変数、置換マップの順に探す。無ければ nullptr
+ *
+ * 置換マップを引いたときは依存関係に記録する。
+ */
+kakiage::Value const *kakiage::find_variable(std::string const &name, Variables const *map) const
+{
+	for (Scope const *s = scope_; s; s = s->outer) {
+		if (*s->name == name) return s->value;
+	}
+	size_t dot = name.find('.');
+	if (dot != std::string::npos && scope_) {
+		std::string_view head = std::string_view(name).substr(0, dot);
+		for (Scope const *s = scope_; s; s = s->outer) {
+			if (*s->name == head) return member_path(s->value, name, dot); // ループの変数は記録しない
+		}
+	}
+	Value const *value = lookup_variable(*map, name);
+	if (!value) {
+		depend_variable(name, nullptr);
+	} else if (dependencies && !value->is_scalar()) {
+		std::string s = value->signature();
+		depend_variable(name, &s);
+	} else {
+		depend_variable(name, &value->text());
+	}
+	return value;
+}
+
+void kakiage::depend_file(std::string const &name, std::optional<std::string> const &text) const
+{
+	if (dependencies) {
+		std::optional<uint64_t> h;
+		if (text) {
+			h = hash(*text);
+		}
+		dependencies->files.emplace(name, h);
+	}
+}
+
+void kakiage::depend_environment(std::string const &name, char const *value) const
+{
+	if (dependencies) {
+		std::optional<uint64_t> h;
+		if (value) {
+			h = hash(value);
+		}
+		dependencies->environment.emplace(name, h);
+	}
+}
+
+void kakiage::depend_command(std::string const &command) const
+{
+	if (dependencies) {
+		auto &v = dependencies->commands;
+		if (std::find(v.begin(), v.end(), command) == v.end()) {
+			v.push_back(command);
+		}
+	}
+}
+
+void kakiage::depend_call(std::string const &name, std::vector<std::string> const &args) const
+{
+	if (dependencies) {
+		std::string s = name;
+		s += '(';
+		for (size_t i = 0; i < args.size(); i++) {
+			if (i > 0) {
+				s += ',';
+			}
+			s += args[i];
+		}
+		s += ')';
+		auto &v = dependencies->calls;
+		if (std::find(v.begin(), v.end(), s) == v.end()) {
+			v.push_back(s);
+		}
+	}
+}
+
 std::string kakiage::string_literal(char const *begin, char const *end, char stop, char const **next)
 {
 	std::vector<char> vec;
@@ -248,7 +440,493 @@ static void parse_string_raw(char const *begin, char const *end, char const **ne
 	}
 }
 
-std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char const *end, char const *sep, char const *stop, std::map<std::string, std::string> const *map, char const **next)
+/**
+ * @brief 事前に解析した %(format, ...) の呼び出し
+ *
+ * 引数がすべて文字列リテラル、数値などの定数、または置換マップの名前だけのものに限る。
+ * 定数は数値への変換も済ませておく。
+ */
+struct kakiage::FormatCall {
+	struct Arg {
+		bool symbol = false; // true なら name を置換マップから引く
+		std::string name;
+		strformat_ns::text_arg value; // 定数
+	};
+	std::vector<Arg> args; // args[0] は書式
+	uint32_t length = 0; // "%(" から ")" の直後まで
+};
+
+/**
+ * @brief {{.#for.item(list)}} の名前
+ */
+struct kakiage::Loop {
+	std::string item; // 要素を束縛する名前
+	std::string list;
+};
+
+/**
+ * @brief テンプレートをコンパイルするときに解析しておいたもの
+ *
+ * 位置はテンプレートテキストの先頭からのオフセット。
+ */
+struct kakiage::Precompiled {
+	std::unordered_map<uint32_t, FormatCall> calls; // '%' の位置 → 呼び出し
+	std::unordered_map<uint32_t, Expression> conditions; // #if などの位置 → 条件式
+	std::unordered_map<uint32_t, Loop> loops; // #for の位置
+	std::unordered_map<uint32_t, FormatCall::Arg> fetches; // #fetch の位置 → 定数か名前だけの URL
+};
+
+/**
+ * @brief 置換マップに定義を加える
+ * @param map 置換マップ
+ * @param name 名前。"name[]" ならリスト name の末尾に加える
+ * @param value 値
+ */
+void kakiage::define_variable(Variables *map, std::string const &name, std::string const &value)
+{
+	if (name.size() > 2 && name.compare(name.size() - 2, 2, "[]") == 0) {
+		(*map)[name.substr(0, name.size() - 2)].push_back(value);
+	} else {
+		(*map)[name] = value;
+	}
+}
+
+/**
+ * @brief 置換マップから値を引く
+ * @param map 置換マップ
+ * @param name 名前。"user.name" のように . で区切ると、リストの要素やオブジェクトのメンバーをたどる
+ * @return 値。無ければ nullptr
+ *
+ * 区切ったものより、. を含む名前そのものの定義が優先する。
+ */
+kakiage::Value const *kakiage::lookup_variable(Variables const &map, std::string const &name)
+{
+	auto it = map.find(name);
+	if (it != map.end()) return &it->second;
+	size_t dot = name.find('.');
+	if (dot == std::string::npos) return nullptr;
+	it = map.find(std::string_view(name).substr(0, dot));
+	if (it == map.end()) return nullptr;
+	return member_path(&it->second, name, dot);
+}
+
+/**
+ * @brief 整数として読む
+ * @return 先頭の10進数。数でなければ 0
+ */
+int64_t kakiage::Value::integer() const
+{
+	if (!(cached_.load(std::memory_order_acquire) & HasInteger)) {
+		integer_.store(strtoll(text().c_str(), nullptr, 10), std::memory_order_relaxed);
+		cached_.fetch_or(HasInteger, std::memory_order_release);
+	}
+	return integer_.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief 実数として読む
+ * @return 先頭の10進数。ロケールによらず小数点は '.'
+ */
+double kakiage::Value::real() const
+{
+	if (!(cached_.load(std::memory_order_acquire) & HasReal)) {
+		real_.store(strformat_ns::misc::my_strtod(text().c_str(), nullptr), std::memory_order_relaxed);
+		cached_.fetch_or(HasReal, std::memory_order_release);
+	}
+	return real_.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief テキスト全体が数として読めるか調べる
+ * @return 前後の空白を除いて、符号付きの10進整数なら Integer、小数点か指数があれば Real
+ */
+kakiage::Value::Kind kakiage::Value::kind() const
+{
+	if (!(cached_.load(std::memory_order_acquire) & HasKind)) {
+		std::string_view s = trimmed(text());
+		size_t i = 0;
+		auto Digits = [&](){
+			size_t n = 0;
+			while (i < s.size() && isdigit((unsigned char)s[i])) {
+				i++;
+				n++;
+			}
+			return n;
+		};
+		if (i < s.size() && (s[i] == '+' || s[i] == '-')) {
+			i++;
+		}
+		size_t n = Digits();
+		Kind k = Kind::Integer;
+		if (i < s.size() && s[i] == '.') {
+			i++;
+			n += Digits();
+			k = Kind::Real;
+		}
+		if (n > 0 && i < s.size() && (s[i] == 'e' || s[i] == 'E')) {
+			i++;
+			if (i < s.size() && (s[i] == '+' || s[i] == '-')) {
+				i++;
+			}
+			if (Digits() == 0) {
+				n = 0;
+			}
+			k = Kind::Real;
+		}
+		if (n == 0 || i < s.size()) {
+			k = Kind::Text;
+		}
+		kind_.store(k, std::memory_order_relaxed);
+		cached_.fetch_or(HasKind, std::memory_order_release);
+	}
+	return kind_.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief リストか
+ * @return 要素を持つリストか JSON の配列なら true
+ */
+bool kakiage::Value::is_list() const
+{
+	return items_ || (json_ && json_->type(node_) == JsonDocument::Array);
+}
+
+/**
+ * @brief リストの要素
+ * @return リストでなければ空。JSON の配列も空
+ */
+std::vector<kakiage::Value> const &kakiage::Value::items() const
+{
+	static const std::vector<Value> empty;
+	return items_ ? *items_ : empty;
+}
+
+/**
+ * @brief リストの要素の数
+ * @return リストでなければ 0
+ */
+size_t kakiage::Value::item_count() const
+{
+	if (items_) return items_->size();
+	if (json_ && json_->type(node_) == JsonDocument::Array) return json_->size(node_);
+	return 0;
+}
+
+/**
+ * @brief リストの要素
+ * @param i 位置
+ * @return 要素。範囲外なら nullptr
+ */
+kakiage::Value const *kakiage::Value::item(size_t i) const
+{
+	if (items_) return i < items_->size() ? &(*items_)[i] : nullptr;
+	if (json_) return json_->item(node_, i);
+	return nullptr;
+}
+
+/**
+ * @brief オブジェクトのメンバー
+ * @param name 名前。リストなら10進数の位置
+ * @return メンバー。無ければ nullptr
+ */
+kakiage::Value const *kakiage::Value::member(std::string_view name) const
+{
+	if (!items_ && json_ && json_->type(node_) == JsonDocument::Object) return json_->member(node_, name);
+	size_t i = 0;
+	if (!is_list() || !parse_index(name, &i)) return nullptr;
+	return item(i);
+}
+
+/**
+ * @brief リストの末尾に要素を加える。リストでなければリストにする
+ */
+void kakiage::Value::push_back(Value const &item)
+{
+	if (!items_) {
+		auto items = std::make_shared<std::vector<Value>>();
+		for (size_t i = 0; i < item_count(); i++) { // JSON の配列なら、その要素に続ける
+			items->push_back(*this->item(i)); // 要素は文書を所有しないので、json_ は持ったままにする
+		}
+		items_ = items;
+	} else if (items_.use_count() > 1) { // 共有しているものは変えない
+		items_ = std::make_shared<std::vector<Value>>(*items_);
+	}
+	items_->push_back(item);
+	text_ = strformat_ns::text_arg(std::to_string(items_->size()));
+	cached_.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * @brief 依存関係に記録する内容
+ * @return テキスト。リストなら要素をすべて並べたもの
+ */
+std::string kakiage::Value::signature() const
+{
+	if (!items_) return json_ ? json_->signature(node_) : text();
+	std::string s = "[";
+	for (Value const &v : *items_) {
+		std::string t = v.signature();
+		s += std::to_string(t.size());
+		s += ':';
+		s += t;
+	}
+	s += ']';
+	return s;
+}
+
+/**
+ * @brief %( の直後から引数を読み、事前に解析できる呼び出しなら返す
+ * @param begin %( の直後
+ * @param end テキストの終端
+ * @return 呼び出し。parse_string に任せるべきものなら std::nullopt
+ */
+std::optional<kakiage::FormatCall> kakiage::parse_format_call(char const *begin, char const *end)
+{
+	FormatCall call;
+	char const *p = begin;
+	while (1) {
+		FormatCall::Arg arg;
+		while (p < end && isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (p < end && (*p == '\"' || *p == '\'')) {
+			std::string s = string_literal(p + 1, end, *p, &p);
+			if (p >= end) return std::nullopt;
+			p++;
+			while (p < end && isspace((unsigned char)*p)) { // parse_string と同じく、空でなければ後ろの空白も含む
+				if (!s.empty()) {
+					s.push_back(*p);
+				}
+				p++;
+			}
+			arg.value = strformat_ns::text_arg(s);
+		} else {
+			char const *q = p;
+			while (q < end && !strchr(",)\"'`<[$%(", *q)) {
+				q++;
+			}
+			std::string s(trimmed(std::string_view(p, q - p)));
+			p = q;
+			if (issymf(s[0])) {
+				arg.symbol = true;
+				arg.name = s;
+			} else {
+				arg.value = strformat_ns::text_arg(s);
+			}
+		}
+		if (p >= end || (*p != ',' && *p != ')')) return std::nullopt;
+		arg.value.prepare(); // テンプレートはスレッド間で共有されるので、ここで変換しておく
+		call.args.push_back(std::move(arg));
+		if (*p++ == ')') break;
+	}
+	call.length = uint32_t(p - begin + 2);
+	return call;
+}
+
+/**
+ * @brief {{.#fetch}} の URL が定数か置換マップの名前だけなら返す
+ * @param begin ディレクティブ名の直後
+ * @param end テキストの終端
+ * @return 引数が1つの呼び出し。コマンドやインクルードなど、実行しないと決まらないものなら std::nullopt
+ *
+ * 置換マップは生成の途中で変わらないので、先読みした URL は本体で求めるものと同じになる。
+ */
+std::optional<kakiage::FormatCall> kakiage::parse_fetch(char const *begin, char const *end)
+{
+	char const *p = begin;
+	FormatCall::Arg arg;
+	if (p < end && *p == '(') {
+		auto call = parse_format_call(p + 1, end);
+		if (!call || call->args.size() != 1) return std::nullopt;
+		p += call->length - 1;
+		arg = std::move(call->args[0]);
+	} else if (p < end && *p == '.') {
+		char const *q = p + 1;
+		while (q < end && !strchr("}\"'`<[$%(", *q)) {
+			q++;
+		}
+		std::string t(trimmed(std::string_view(p + 1, q - p - 1)));
+		if (t.empty()) return std::nullopt;
+		if (issymf(t[0])) {
+			arg.symbol = true;
+			arg.name = t;
+		} else {
+			arg.value = strformat_ns::text_arg(t);
+			arg.value.prepare();
+		}
+		p = q;
+	} else {
+		return std::nullopt;
+	}
+	if (end - p < 2 || p[0] != '}' || p[1] != '}') return std::nullopt;
+	FormatCall call;
+	call.args.push_back(std::move(arg));
+	call.length = uint32_t(p - begin);
+	return call;
+}
+
+/**
+ * @brief #if などの条件を式として解析する
+ * @param begin ディレクティブ名の直後
+ * @param end テキストの終端
+ * @param next タグの直後
+ * @return 条件式。{{.#if.name}} または {{.#if(式)}} の形でなければ std::nullopt
+ *
+ * 式にならないもの（コマンドや %() など）は、これまでどおり parse_tag で値を求める。
+ */
+std::optional<Expression> kakiage::parse_condition(char const *begin, char const *end, char const **next)
+{
+	char const *p = begin;
+	std::optional<Expression> e;
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isspace((unsigned char)*p)) {
+			p++;
+		}
+		char const *left = p;
+		p = scan_name(p, end);
+		char const *right = p;
+		while (p < end && isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (left == right) return std::nullopt;
+		e = Expression::variable(std::string(left, right));
+	} else if (p < end && *p == '(') {
+		e = Expression::parse(p + 1, end, &p);
+		if (!e || p >= end || *p != ')') return std::nullopt;
+		p++;
+	}
+	if (!e || end - p < 2 || p[0] != '}' || p[1] != '}') return std::nullopt;
+	*next = p + 2;
+	return e;
+}
+
+/**
+ * @brief {{.#for.item(list)}} を解析する
+ * @param begin ディレクティブ名の直後
+ * @param end テキストの終端
+ * @param next タグの直後
+ * @return 名前。この形でなければ std::nullopt（evaluator を呼ぶ #for）
+ */
+std::optional<kakiage::Loop> kakiage::parse_loop(char const *begin, char const *end, char const **next)
+{
+	char const *p = begin;
+	auto Symbol = [&](){
+		while (p < end && isspace((unsigned char)*p)) {
+			p++;
+		}
+		char const *left = p;
+		p = scan_name(p, end);
+		std::string s(left, p);
+		while (p < end && isspace((unsigned char)*p)) {
+			p++;
+		}
+		return s;
+	};
+	if (p >= end || *p++ != '.') return std::nullopt;
+	Loop loop;
+	loop.item = Symbol();
+	if (loop.item.empty() || loop.item.find('.') != std::string::npos || p >= end || *p++ != '(') return std::nullopt;
+	loop.list = Symbol();
+	if (loop.list.empty() || end - p < 3 || p[0] != ')' || p[1] != '}' || p[2] != '}') return std::nullopt;
+	*next = p + 3;
+	return loop;
+}
+
+/**
+ * @brief タグの中の %() と、#if などの条件を事前に解析する
+ * @param source テンプレートテキスト
+ * @param segments セグメント
+ * @param count セグメントの数
+ * @param out compile の途中で解析した条件式。無ければ nullptr
+ * @return 解析できたもの
+ */
+std::shared_ptr<kakiage::Precompiled const> kakiage::precompile(std::string_view const &source, Segment const *segments, size_t count, std::shared_ptr<Precompiled> out)
+{
+	if (!out) {
+		out = std::make_shared<Precompiled>();
+	}
+	char const *begin = source.data();
+	char const *end = begin + source.size();
+	for (size_t i = 0; i < count; i++) {
+		Segment const &seg = segments[i];
+		if (seg.type != Segment::Tag) continue;
+		if ((seg.directive == Directive::If || seg.directive == Directive::Ifn || seg.directive == Directive::Elif || seg.directive == Directive::Elifn) && out->conditions.find(seg.offset) == out->conditions.end()) {
+			char const *next;
+			auto e = parse_condition(begin + seg.offset, end, &next);
+			if (e) {
+				out->conditions.emplace(seg.offset, std::move(*e));
+			}
+		} else if (seg.directive == Directive::Loop) {
+			char const *next;
+			auto loop = parse_loop(begin + seg.offset, end, &next);
+			if (loop) {
+				out->loops.emplace(seg.offset, std::move(*loop));
+			}
+		} else if (seg.directive == Directive::Fetch) {
+			auto call = parse_fetch(begin + seg.offset, end);
+			if (call) {
+				out->fetches.emplace(seg.offset, std::move(call->args[0]));
+			}
+		}
+		char const *right = begin + seg.offset + seg.length;
+		for (char const *p = begin + seg.offset; p + 1 < right; p++) {
+			if (p[0] == '%' && p[1] == '(') {
+				auto call = parse_format_call(p + 2, end);
+				if (call) {
+					out->calls.emplace(uint32_t(p - begin), std::move(*call));
+				}
+			}
+		}
+	}
+	return out;
+}
+
+/**
+ * @brief 事前に解析した %() を実行する
+ * @param ptr '%' の位置
+ * @param map 置換マップ
+ * @param out 出力先
+ * @param next ')' の直後
+ * @return 事前に解析したものが無ければ false
+ */
+bool kakiage::format_compiled(char const *ptr, Variables const *map, std::vector<char> *out, char const **next) const
+{
+	if (!rendering_ || !rendering_->precompiled_) return false;
+	std::string_view source = rendering_->source_;
+	if (ptr < source.data() || ptr >= source.data() + source.size()) return false;
+	auto const &calls = rendering_->precompiled_->calls;
+	auto it = calls.find(uint32_t(ptr - source.data()));
+	if (it == calls.end()) return false;
+	FormatCall const &call = it->second;
+
+	strf f(out); // 結果を直接書き込む
+	for (size_t i = 0; i < call.args.size(); i++) {
+		FormatCall::Arg const &a = call.args[i];
+		strformat_ns::text_arg const *v = &a.value;
+		strformat_ns::text_arg undefined;
+		if (a.symbol) {
+			Value const *value = find_variable(a.name, map);
+			if (value) {
+				v = &value->format_arg(); // 数値への変換は値が覚えている
+			} else {
+				undefined = strformat_ns::text_arg('?' + a.name + '?');
+				fprintf(stderr, "undefined symbol '%s'\n", undefined.text().data());
+				v = &undefined;
+			}
+		}
+		if (i == 0) {
+			f.append(v->text());
+		} else {
+			f.arg(*v);
+		}
+	}
+	f.flush();
+	*next = ptr + call.length;
+	return true;
+}
+
+std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char const *end, char const *sep, char const *stop, Variables const *map, bool eval, char const **next) const
 {
 	*next = end;
 	
@@ -261,9 +939,9 @@ std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char con
 				std::vector<char> const &v = out.back();
 				std::string s(trimmed(std::string_view(v.data(), v.size())));
 				if (issymf(s[0])) {
-					auto it = map->find(s);
-					if (it != map->end()) {
-						s = it->second;
+					Value const *v = find_variable(s, map);
+					if (v) {
+						s = v->text();
 					} else {
 						s = '?' + s + '?';
 						fprintf(stderr, "undefined symbol '%s'\n", s.data());
@@ -294,7 +972,7 @@ std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char con
 			out.push_back({});
 			out.back().reserve(256);
 			if (c == '(') {
-				auto list = parse_string(right, end, nullptr, ")", nullptr, &right);
+				auto list = parse_string(right, end, nullptr, ")", nullptr, eval, &right);
 				for (auto const &vec : list) {
 					out.back().insert(out.back().end(), vec.begin(), vec.end());
 				}
@@ -311,7 +989,9 @@ std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char con
 				e = '>';
 			} else if (c == '[') {
 				e = ']';
-				fprintf(stderr, "square bracket is reserved\n");
+				if (eval) {
+					fprintf(stderr, "square bracket is reserved\n");
+				}
 			}
 			
 			std::string s = string_literal(right, end, e, &right);
@@ -319,7 +999,10 @@ std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char con
 				right++;
 			}
 			std::vector<char> v;
-			if (c == '`') {
+			if (!eval) {
+				// lexical analysis only
+			} else if (c == '`') {
+				depend_command(s);
 				auto r = run(s); // run command
 				if (r) {
 					append(&v, trimmed(*r)); // append result
@@ -329,6 +1012,7 @@ std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char con
 			} else if (c == '<') {
 				if (includer) {
 					auto t = includer(s); // load template
+					depend_file(s, t);
 					if (t) {
 						append(&v, trimmed(*t)); // append result
 					} else {
@@ -343,21 +1027,28 @@ std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char con
 			out.back() = v;
 			convert = false;
 		} else if (right + 1 < end && (c == '$' || c == '%') && right[1] == '(') { // $(ENV) or %(format, ...)
+			if (c == '%' && eval && map && format_compiled(right, map, &out.back(), &right)) {
+				convert = false;
+				continue;
+			}
 			right += 2;
-			auto list = parse_string(right, end, ",", ")", nullptr, &right);
+			auto list = parse_string(right, end, ",", ")", c == '%' ? map : nullptr, eval, &right); // %() の引数は置換マップの名前も取る
 			if (right < end) {
 				right++;
 			}
-			if (c == '$') { // $(ENV)
+			if (!eval) {
+				// lexical analysis only
+			} else if (c == '$') { // $(ENV)
 				std::string v = to_string(list);
 				char *text = getenv(v.data()); // get environment variable
+				depend_environment(v, text);
 				if (text) {
 					append(&out.back(), text);
 				} else {
 					fprintf(stderr, "environment variable '%s' not found\n", v.data());
 				}
 			} else if (c == '%') { // %(format, ...)
-				strf f;
+				strf f(&out.back()); // 結果を直接書き込む
 				for (size_t i = 0; i < list.size(); i++) {
 					std::string a(to_string(list[i]));
 					if (i == 0) {
@@ -366,7 +1057,7 @@ std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char con
 						f.arg(a);
 					}
 				}
-				append(&out.back(), f.str());
+				f.flush();
 			}
 			convert = false;
 		} else {
@@ -382,68 +1073,161 @@ std::vector<std::vector<char>> kakiage::parse_string(char const *begin, char con
 }
 
 /**
- * @brief ページを生成する（テンプレートエンジン）
- * @param source テンプレートテキスト
- * @param map 置換マップ
- * @return ページテキスト
+ * @brief ディレクティブ名を解析する
+ * @param name '#' で始まる名前
+ * @return ディレクティブ
  */
-std::string kakiage::generate(const std::string &source, const std::map<std::string, std::string> &map, int include_depth)
+kakiage::Directive kakiage::find_directive(std::string const &name)
 {
-	std::map<std::string, std::string> macro;
-	defines.push_back(&macro);
-	
-	std::vector<char> out;
-	out.reserve(4096);
-	
-	int comment_depth = 0;
-	
-	char const *begin = source.data();
-	char const *end = begin + source.size();
-	char const *ptr = begin;
-	
-	std::vector<unsigned char> condition_stack; // すべてtrueなら条件分岐が真として処理する。格納される値は 0 か 1 のみ。
-	unsigned char condition = 1;
-	enum {
-		COND_FALSE,
-		COND_TRUE,
-		COND_DONE,
-		COND_ELSE,
+	if (name == "#raw") return Directive::Raw;
+	if (name == "#html") return Directive::HTML;
+	if (name == "#url") return Directive::URL;
+	if (name == "#put") return Directive::Put;
+	if (name == "#define") return Directive::Define;
+	if (name == "#include") return Directive::Include;
+	if (name == "#if") return Directive::If;
+	if (name == "#ifn") return Directive::Ifn;
+	if (name == "#elif") return Directive::Elif;
+	if (name == "#elifn") return Directive::Elifn;
+	if (name == "#else") return Directive::Else;
+	if (name == "#end") return Directive::End;
+	if (name == "#for") return Directive::For;
+	if (name == "#cache") return Directive::Cache;
+	if (name == "#fetch") return Directive::Fetch;
+	fprintf(stderr, "unknown directive '%s'\n", name.data());
+	return Directive::None;
+}
+
+/**
+ * @brief タグの名前と引数を解析する
+ * @param directive ディレクティブ
+ * @param ptr ディレクティブ名の直後
+ * @param end テキストの終端
+ * @param map 置換マップ
+ * @param eval false なら字句解析のみ行い、コマンドの実行などはしない
+ * @param key 名前
+ * @param values 引数
+ * @return タグの直後
+ */
+char const *kakiage::parse_tag(Directive directive, char const *ptr, char const *end, Variables const *map, bool eval, std::string *key, std::vector<std::string> *values) const
+{
+	auto ParseSymbol = [&](){
+		size_t i = 0;
+		while (ptr + i < end && ((i == 0) ? issymf(ptr[i]) : issym(ptr[i]))) {
+			i++;
+		}
+		std::string s(ptr, i);
+		ptr += i;
+		return s;
 	};
 	
-	auto UpdateCondition = [&](){
-		condition = COND_TRUE;
-		for (char c : condition_stack) {
-			if (c == COND_FALSE || c == COND_DONE) {
-				condition = c;
-				break;
+	std::vector<std::vector<char>> vec;
+	
+	if (directive != Directive::None) {
+		if (ptr < end) {
+			bool keyflag = false;
+			if (directive == Directive::Define || directive == Directive::Put || directive == Directive::For) {
+				keyflag = true;
+				if (*ptr == '.') {
+					ptr++;
+					*key = ParseSymbol();
+				}
+			}
+			if (ptr < end) {
+				if (*ptr == '(') {
+					ptr++;
+					vec = parse_string(ptr, end, ",", ")}", map, eval, &ptr);
+					if (ptr < end && *ptr == ')') {
+						ptr++;
+					}
+				} else if (directive == Directive::Define || directive == Directive::For) {
+					if (*ptr == '.' || *ptr == '=' || isspace((unsigned char)*ptr)) {
+						ptr++;
+						std::vector<char> v;
+						parse_string_raw(ptr, end, &ptr, &v);
+						vec.push_back(v);
+					}
+				} else if (*ptr == '.') {
+					ptr++;
+					vec = parse_string(ptr, end, nullptr, "}", map, eval, &ptr);
+				}
+			}
+			if (keyflag) {
+				if (key->empty() && !vec.empty()) {
+					*key = to_string(vec[0]);
+					vec.erase(vec.begin());
+				}
 			}
 		}
-	};
-	auto outc = [&](char c){
-		if (condition == COND_TRUE && comment_depth == 0) {
-			out.push_back(c);
+	} else {
+		vec = parse_string(ptr, end, nullptr, "}", map, eval, &ptr);
+	}
+	for (auto const &vec : vec) {
+		values->emplace_back(to_string(vec));
+	}
+	if (ptr < end && *ptr == '}') {
+		ptr++;
+		if (ptr < end && *ptr == '}') {
+			ptr++;
 		}
+	}
+	return ptr;
+}
+
+/**
+ * @brief テンプレートをコンパイルする
+ * @param source テンプレートテキスト
+ * @return コンパイル済みテンプレート
+ *
+ * テキスト、タグ、ブロックの終端に分割する。コメントとエスケープはここで処理される。
+ * タグの引数は字句解析だけ行い、評価は render で行う。
+ */
+kakiage::Template kakiage::compile(std::string const &source) const
+{
+	struct Storage {
+		std::string source;
+		std::vector<Segment> segments;
 	};
-	auto outs = [&](std::string_view const &s){
-		if (condition == COND_TRUE && comment_depth == 0) {
-			append(&out, s);
+	auto storage = std::make_shared<Storage>();
+	storage->source = source;
+	std::vector<Segment> &segments = storage->segments;
+	auto precompiled = std::make_shared<Precompiled>();
+	
+	int comment_depth = 0;
+	
+	char const *begin = storage->source.data();
+	char const *end = begin + storage->source.size();
+	char const *ptr = begin;
+	
+	auto Add = [&](Segment::Type type, char const *left, char const *right, Directive directive){
+		Segment seg;
+		seg.type = type;
+		seg.directive = directive;
+		seg.offset = uint32_t(left - begin);
+		seg.length = uint32_t(right - left);
+		if (type == Segment::Text && !segments.empty()) {
+			Segment &last = segments.back();
+			if (last.type == Segment::Text && last.offset + last.length == seg.offset) {
+				last.length += seg.length; // 連続するテキストはまとめる
+				return;
+			}
 		}
+		segments.push_back(seg);
 	};
-	auto FindMacro = [&](std::string const &name)->std::optional<std::string>{
-		size_t i = defines.size();
-		while (i > 0) {
-			i--;
-			auto it = defines[i]->find(name);
-			if (it != defines[i]->end()) {
-				return it->second;
+	auto EatNL = [&](){ // 改行を読み飛ばす
+		if (ptr < end && *ptr == '\r') {
+			ptr++;
+			if (ptr < end && *ptr == '\n') {
+				ptr++;
 			}
+			return;
+		}
+		if (ptr < end && *ptr == '\n') {
+			ptr++;
+			return;
 		}
-		return std::nullopt;
 	};
 	
-	condition_stack.push_back(COND_TRUE);
-	UpdateCondition();
-	
 	while (1) {
 		int c = 0;
 		if (ptr < end) {
@@ -452,43 +1236,26 @@ std::string kakiage::generate(const std::string &source, const std::map<std::str
 		if (c == 0) {
 			break;
 		}
-		auto END = [&](){
-			if (!condition_stack.empty()) {
-				condition_stack.pop_back();
-				UpdateCondition();
-			}
-		};
-		auto EatNL = [&](){ // 改行を読み飛ばす
-			if (ptr < end && *ptr == '\r') {
-				ptr++;
-				if (ptr < end && *ptr == '\n') {
-					ptr++;
-				}
-				return;
-			}
-			if (ptr < end && *ptr == '\n') {
-				ptr++;
-				return;
-			}
-		};
 		if (comment_depth > 0) {
 			if (c == '{' && ptr + 1 < end && ptr[1] == '{') {
 				comment_depth++;
 				ptr += 2;
-				continue;
 			} else if (c == '}' && ptr + 1 < end && ptr[1] == '}') {
 				comment_depth--;
 				ptr += 2;
-				continue;
+			} else {
+				ptr++;
 			}
+			continue;
 		}
 		if (c == '{' && ptr + 4 < end && ptr[1] == '{' && ptr[2] == '.') {
 			ptr += 3;
 			if (ptr[0] == '}' && ptr[1] == '}') {
 				// {{.}}
+				char const *left = ptr;
 				ptr += 2;
 				EatNL();
-				END();
+				Add(Segment::End, left, ptr, Directive::None);
 				continue;
 			}
 			
@@ -498,305 +1265,633 @@ std::string kakiage::generate(const std::string &source, const std::map<std::str
 				continue;
 			}
 			
-			enum class Directive {
-				None,
-				Raw,
-				URL,
-				HTML,
-				Put,
-				Define,
-				Include,
-				If,
-				Ifn,
-				Elif,
-				Elifn,
-				Else,
-				End,
-				For,
-			} directive = Directive::None;
-			
+			Directive directive = Directive::None;
 			if (*ptr == '#') {
 				size_t i = 1;
 				while (ptr + i < end && issym(ptr[i])) {
 					i++;
 				}
 				std::string s = {ptr, i};
-				if (s == "#raw") {
-					directive = Directive::Raw;
-				} else if (s == "#html") {
-					directive = Directive::HTML;
-				} else if (s == "#url") {
-					directive = Directive::URL;
-				} else if (s == "#put") {
-					directive = Directive::Put;
-				} else if (s == "#define") {
-					directive = Directive::Define;
-				} else if (s == "#include") {
-					directive = Directive::Include;
-				} else if (s == "#if") {
-					directive = Directive::If;
-				} else if (s == "#ifn") {
-					directive = Directive::Ifn;
-				} else if (s == "#elif") {
-					directive = Directive::Elif;
-				} else if (s == "#elifn") {
-					directive = Directive::Elifn;
-				} else if (s == "#else") {
-					directive = Directive::Else;
-				} else if (s == "#end") {
-					directive = Directive::End;
-				} else if (s == "#for") {
-					directive = Directive::For;
-				} else {
-					fprintf(stderr, "unknown directive '%s'\n", s.data());
-				}
+				directive = find_directive(s);
 				ptr += s.size();
 			}
 			
-			auto ParseSymbol = [&](){
-				size_t i = 0;
-				while (ptr + i < end && ((i == 0) ? issymf(ptr[i]) : issym(ptr[i]))) {
-					i++;
-				}
-				std::string s(ptr, i);
-				ptr += i;
-				return s;
-			};
-			
+			char const *left = ptr;
 			std::string key;
-			std::string value;
 			std::vector<std::string> values;
-			std::vector<std::vector<char>> vec;
-			
-			if (directive != Directive::None) {
-				if (ptr < end) {
-					bool keyflag = false;
-					if (directive == Directive::Define || directive == Directive::Put || directive == Directive::For) {
-						keyflag = true;
-						if (*ptr == '.') {
-							ptr++;
-							key = ParseSymbol();
-						}
-					}
-					if (ptr < end) {
-						if (*ptr == '(') {
-							ptr++;
-							vec = parse_string(ptr, end, ",", ")}", &map, &ptr);
-							if (ptr < end && *ptr == ')') {
-								ptr++;
-							}
-						} else if (directive == Directive::Define || directive == Directive::For) {
-							if (*ptr == '.' || *ptr == '=' || isspace((unsigned char)*ptr)) {
-								ptr++;
-								std::vector<char> v;
-								parse_string_raw(ptr, end, &ptr, &v);
-								vec.push_back(v);
-							}
-						} else if (*ptr == '.') {
-							ptr++;
-							vec = parse_string(ptr, end, nullptr, "}", &map, &ptr);
-						}
-					}
-					if (keyflag) {
-						if (key.empty() && !vec.empty()) {
-							key = to_string(vec[0]);
-							vec.erase(vec.begin());
-						}
-					}
-				}
+			std::optional<Expression> condition;
+			std::optional<Loop> loop;
+			char const *next;
+			if (directive == Directive::If || directive == Directive::Ifn || directive == Directive::Elif || directive == Directive::Elifn) {
+				condition = parse_condition(ptr, end, &next);
+			} else if (directive == Directive::For) {
+				loop = parse_loop(ptr, end, &next);
+			}
+			if (condition) { // 式は parse_string では読めないことがある（'<' や入れ子の括弧）
+				precompiled->conditions.emplace(uint32_t(left - begin), std::move(*condition));
+				ptr = next;
+			} else if (loop) { // ブロックになる
+				precompiled->loops.emplace(uint32_t(left - begin), std::move(*loop));
+				directive = Directive::Loop;
+				ptr = next;
 			} else {
-				vec = parse_string(ptr, end, nullptr, "}", &map, &ptr);
+				ptr = parse_tag(directive, ptr, end, nullptr, false, &key, &values);
 			}
-			for (auto const &vec : vec) {
-				values.emplace_back(to_string(vec));
+			if (directive == Directive::Define || directive == Directive::For || directive == Directive::Loop || directive == Directive::End) {
+				EatNL();
 			}
-			if (ptr < end && *ptr == '}') {
-				ptr++;
-				if (ptr < end && *ptr == '}') {
-					ptr++;
+			Add(Segment::Tag, left, ptr, directive);
+		} else if (c == '&' && ptr + 1 < end && strchr("&.{}", ptr[1])) { // &. or &{ or &} or &&
+			ptr++;
+			char const *p = ptr;
+			while (p < end) {
+				if (*p == ';') { // &c;
+					Add(Segment::Text, ptr, p, Directive::None);
+					ptr = p + 1;
+					c = -1;
+					break;
+				} else if (*p == '\n') {
+					break;
 				}
+				p++;
 			}
-			
+			if (c != -1) {
+				Add(Segment::Text, ptr - 1, ptr, Directive::None);
+			}
+		} else {
+			char const *p = ptr + 1;
+			while (p < end && *p != '{' && *p != '&' && *p != 0) {
+				p++;
+			}
+			Add(Segment::Text, ptr, p, Directive::None);
+			ptr = p;
+		}
+	}
+	
+	Template t;
+	t.source_ = storage->source;
+	t.segments_ = segments.data();
+	t.segment_count_ = segments.size();
+	t.precompiled_ = precompile(t.source_, t.segments_, t.segment_count_, std::move(precompiled));
+	t.storage_ = std::move(storage);
+	return t;
+}
+
+namespace {
+
+/**
+ * @brief コンパイル済みテンプレートのイメージのヘッダ
+ *
+ * 位置はすべてイメージ先頭からのオフセットで持つので、そのまま mmap して使える。
+ */
+struct ImageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t source_hash;
+	uint64_t source_offset;
+	uint64_t source_length;
+	uint64_t segments_offset;
+	uint64_t segment_count;
+};
+
+const char IMAGE_MAGIC[8] = {'K', 'A', 'K', 'I', 'A', 'G', 'E', 0};
+const uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+
+} // namespace
+
+/**
+ * @brief コンパイル済みテンプレートをイメージにする
+ * @return イメージ
+ *
+ * ヘッダ、セグメント、本文の順に並べる。
+ */
+std::string kakiage::Template::image() const
+{
+	static_assert(std::is_trivially_copyable_v<Segment>);
+	ImageHeader h = {};
+	memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+	h.version = IMAGE_VERSION;
+	h.byte_order = IMAGE_BYTE_ORDER;
+	h.source_hash = kakiage::hash(source_);
+	h.segments_offset = sizeof(ImageHeader);
+	h.segment_count = segment_count_;
+	h.source_offset = h.segments_offset + sizeof(Segment) * segment_count_;
+	h.source_length = source_.size();
+	std::string out;
+	out.reserve(h.source_offset + h.source_length);
+	out.append((char const *)&h, sizeof(h));
+	out.append((char const *)segments_, sizeof(Segment) * segment_count_);
+	out.append(source_);
+	return out;
+}
+
+/**
+ * @brief イメージからコンパイル済みテンプレートを作る
+ * @param storage イメージの実体。テンプレートが使われている間、保持される
+ * @param data イメージの先頭
+ * @param size イメージの大きさ
+ * @return コンパイル済みテンプレート。イメージが壊れているか、形式が違えば std::nullopt
+ *
+ * イメージはコピーせずに参照する。省けるのはセグメントへの分割だけで、
+ * 条件式や #for、%() の事前解析の結果は木や値を持つのでイメージに含めず、ここで作り直す。
+ */
+std::optional<kakiage::Template> kakiage::Template::from_image(std::shared_ptr<void const> storage, void const *data, size_t size)
+{
+	if (size < sizeof(ImageHeader) || (uintptr_t)data % alignof(ImageHeader) != 0) return std::nullopt;
+	ImageHeader const *h = (ImageHeader const *)data;
+	if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0) return std::nullopt;
+	if (h->version != IMAGE_VERSION || h->byte_order != IMAGE_BYTE_ORDER) return std::nullopt;
+	if (h->segments_offset % alignof(Segment) != 0) return std::nullopt;
+	if (h->segments_offset > size || h->segment_count > (size - h->segments_offset) / sizeof(Segment)) return std::nullopt;
+	if (h->source_offset > size || h->source_length > size - h->source_offset) return std::nullopt;
+
+	char const *base = (char const *)data;
+	std::string_view source(base + h->source_offset, h->source_length);
+	Segment const *segments = (Segment const *)(base + h->segments_offset);
+	for (size_t i = 0; i < h->segment_count; i++) {
+		Segment const &seg = segments[i];
+		if (seg.type > Segment::End || seg.directive > Directive::Loop) return std::nullopt;
+		if (seg.offset > source.size() || seg.length > source.size() - seg.offset) return std::nullopt;
+	}
+	if (kakiage::hash(source) != h->source_hash) return std::nullopt;
+
+	Template t;
+	t.source_ = source;
+	t.segments_ = segments;
+	t.segment_count_ = h->segment_count;
+	t.precompiled_ = precompile(t.source_, t.segments_, t.segment_count_);
+	t.storage_ = std::move(storage);
+	return t;
+}
+
+/**
+ * @brief コンパイル済みテンプレートからページを生成する
+ * @param tmpl コンパイル済みテンプレート
+ * @param map 置換マップ
+ * @return ページテキスト
+ */
+std::string kakiage::render(Template const &tmpl, Variables const &map, int include_depth)
+{
+	std::vector<char> out;
+	out.reserve(4096);
+	render_to(tmpl, map, include_depth, &out);
+	return (std::string)to_string(out);
+}
+
+/**
+ * @brief コンパイル済みテンプレートからページを生成して、出力の末尾に加える
+ * @param tmpl コンパイル済みテンプレート
+ * @param map 置換マップ
+ * @param out 出力先
+ */
+void kakiage::render_to(Template const &tmpl, Variables const &map, int include_depth, std::vector<char> *out_)
+{
+	std::map<std::string, std::string> macro;
+	if (generate_depth_++ == 0) {
+		host_defines_ = defines.size(); // これより下はホストが用意した定義
+	}
+	defines.push_back(&macro);
+	Template const *outer_template = rendering_;
+	rendering_ = &tmpl;
+	
+	std::vector<char> &out = *out_;
+	
+	char const *begin = tmpl.source_.data();
+	char const *end = begin + tmpl.source_.size();
+	
+	std::vector<unsigned char> condition_stack; // すべてtrueなら条件分岐が真として処理する。格納される値は 0 か 1 のみ。
+	unsigned char condition = 1;
+	enum {
+		COND_FALSE,
+		COND_TRUE,
+		COND_DONE,
+		COND_ELSE,
+	};
+	
+	auto UpdateCondition = [&](){
+		condition = COND_TRUE;
+		for (char c : condition_stack) {
+			if (c == COND_FALSE || c == COND_DONE) {
+				condition = c;
+				break;
+			}
+		}
+	};
+	auto outs = [&](std::string_view const &s){
+		if (condition == COND_TRUE) {
+			append(&out, s);
+		}
+	};
+	auto FindMacro = [&](std::string const &name)->std::optional<std::string>{
+		size_t i = defines.size();
+		while (i > 0) {
+			i--;
+			auto it = defines[i]->find(name);
+			if (it != defines[i]->end()) {
+				if (i < host_defines_) {
+					depend_variable(name, &it->second);
+				}
+				return it->second;
+			}
+		}
+		return std::nullopt;
+	};
+	auto END = [&](){
+		if (!condition_stack.empty()) {
+			condition_stack.pop_back();
+			UpdateCondition();
+		}
+	};
+	auto FindBlockEnd = [&](size_t index){ // index のブロックを閉じるセグメント。無ければ末尾
+		int depth = 0;
+		for (size_t i = index + 1; i < tmpl.segment_count_; i++) {
+			Segment const &seg = tmpl.segments_[i];
+			if (seg.type == Segment::End || (seg.type == Segment::Tag && seg.directive == Directive::End)) {
+				if (depth == 0) return i;
+				depth--;
+			} else if (seg.type == Segment::Tag && (seg.directive == Directive::If || seg.directive == Directive::Ifn || seg.directive == Directive::Cache || seg.directive == Directive::Loop)) {
+				depth++;
+			}
+		}
+		return tmpl.segment_count_;
+	};
+	Expression::Lookup lookup = [&](std::string const &name)->Value const *{ // 条件式の名前
+		Value const *v = find_variable(name, &map);
+		if (!v) {
+			fprintf(stderr, "undefined symbol '?%s?'\n", name.data());
+		}
+		return v;
+	};
+	auto VariableValue = [&](std::string const &name)->std::optional<std::string>{ // 依存関係の検証に使う
+		if (Value const *v = lookup_variable(map, name)) return v->signature(); // 記録したときと同じく、. で区切った名前もたどる
+		for (size_t i = host_defines_; i > 0; i--) {
+			auto it = defines[i - 1]->find(name);
+			if (it != defines[i - 1]->end()) return it->second;
+		}
+		return std::nullopt;
+	};
+	
+	// ブロックの外にある {{.#fetch}} は必ず実行されるので、先にまとめて並行に取得する
+	std::map<std::string, std::optional<std::string>> prefetched;
+	{
+		std::vector<std::string> urls;
+		int depth = 0;
+		for (size_t i = 0; i < tmpl.segment_count_; i++) {
+			Segment const &seg = tmpl.segments_[i];
+			if (seg.type == Segment::End || (seg.type == Segment::Tag && seg.directive == Directive::End)) {
+				if (depth > 0) depth--;
+			} else if (seg.type == Segment::Tag && (seg.directive == Directive::If || seg.directive == Directive::Ifn || seg.directive == Directive::Cache || seg.directive == Directive::Loop)) {
+				depth++;
+			} else if (depth == 0 && seg.type == Segment::Tag && seg.directive == Directive::Fetch && tmpl.precompiled_) {
+				// 引数を評価するとコマンドなどが二度実行されるので、コンパイル時に URL が決まるものだけを先読みする
+				auto it = tmpl.precompiled_->fetches.find(seg.offset);
+				if (it == tmpl.precompiled_->fetches.end()) continue;
+				FormatCall::Arg const &a = it->second;
+				if (!a.symbol) {
+					urls.push_back(a.value.text());
+				} else if (Value const *v = find_variable(a.name, &map)) {
+					urls.push_back(v->text());
+				}
+				if (urls.back().empty()) {
+					urls.pop_back();
+				}
+			}
+		}
+		std::sort(urls.begin(), urls.end());
+		urls.erase(std::unique(urls.begin(), urls.end()), urls.end());
+		if (urls.size() > 1) {
+			auto results = http_cache ? http_cache->fetch_all(urls) : HttpCache().fetch_all(urls);
+			for (size_t i = 0; i < urls.size(); i++) {
+				prefetched[urls[i]] = std::move(results[i]);
+			}
+		}
+	}
+	
+	condition_stack.push_back(COND_TRUE);
+	UpdateCondition();
+	
+	for (size_t index = 0; index < tmpl.segment_count_; index++) {
+		Segment const &seg = tmpl.segments_[index];
+		char const *ptr = begin + seg.offset;
+		if (seg.type == Segment::Text) {
+			outs(std::string_view(ptr, seg.length));
+			continue;
+		}
+		if (seg.type == Segment::End) {
+			END();
+			continue;
+		}
+		
+		Directive directive = seg.directive;
+		std::string key;
+		std::string value;
+		std::vector<std::string> values;
+		bool conditional = directive == Directive::If || directive == Directive::Ifn || directive == Directive::Elif || directive == Directive::Elifn;
+		bool truth = false; // #if などの条件
+		Expression const *expr = nullptr;
+		if (conditional && tmpl.precompiled_) {
+			auto it = tmpl.precompiled_->conditions.find(seg.offset);
+			if (it != tmpl.precompiled_->conditions.end()) {
+				expr = &it->second;
+			}
+		}
+		if (expr) { // 置換マップの値が覚えている数や真偽値を使う
+			truth = expr->test(lookup);
+		} else if (directive != Directive::Loop) {
+			parse_tag(directive, ptr, end, &map, true, &key, &values);
 			if (!values.empty()) {
 				value = values[0];
 			}
-			
-			switch (directive) {
-			case Directive::HTML: // {{.#html.foo}}
-				outs(html_encode(value, true)); // output html encoded value
-				break;
-			case Directive::Raw: // {{.#raw.foo}}
-				outs(value); // output raw value
-				break;
-			case Directive::URL: // {{.#url.foo}}
-				outs(url_encode(value)); // output url encoded value
-				break;
-			case Directive::Define:
-				if (!key.empty()) {
-					if (value.empty()) {
-						auto it = macro.find(key);
-						if (it != macro.end()) {
-							macro.erase(it);
-						}
-					} else {
-						macro[key] = value;
+			if (conditional) {
+				truth = Value(value).boolean();
+			}
+		}
+		
+		switch (directive) {
+		case Directive::HTML: // {{.#html.foo}}
+			outs(html_encode(value, true)); // output html encoded value
+			break;
+		case Directive::Raw: // {{.#raw.foo}}
+			outs(value); // output raw value
+			break;
+		case Directive::URL: // {{.#url.foo}}
+			outs(url_encode(value)); // output url encoded value
+			break;
+		case Directive::Define:
+			if (!key.empty()) {
+				if (value.empty()) {
+					auto it = macro.find(key);
+					if (it != macro.end()) {
+						macro.erase(it);
 					}
 				} else {
-					fprintf(stderr, "define name is empty\n");
-				}
-				EatNL();
-				break;
-			case Directive::Put:
-				{
-					auto text = FindMacro(key);
-					if (evaluator) {
-						std::vector<std::string> args;
-						for (size_t i = 0; i < values.size(); i++) {
-							args.emplace_back(values[i]);
-						}
-						auto t = evaluator(key, text ? *text : std::string(), args);
-						if (t) {
-							std::string u = generate(*t, map);
-							outs(u);
-							break;
-						}
-					}
-					if (text) {
-						outs(*text);
-						break;
-					}
+					macro[key] = value;
 				}
-				fprintf(stderr, "undefined macro '%s'\n", key.data());
-				outs(key);
-				break;
-			case Directive::For:
+			} else {
+				fprintf(stderr, "define name is empty\n");
+			}
+			break;
+		case Directive::Put:
+			{
+				auto text = FindMacro(key);
 				if (evaluator) {
 					std::vector<std::string> args;
 					for (size_t i = 0; i < values.size(); i++) {
 						args.emplace_back(values[i]);
 					}
-					auto t = evaluator(key, value, args);
+					auto t = evaluator(key, text ? *text : std::string(), args);
 					if (t) {
-						outs(*t);
+						depend_call(key, args);
+						std::string u = generate(*t, map);
+						outs(u);
+						break;
 					}
 				}
-				EatNL();
-				break;
-			case Directive::Include:
-				if (includer) {
-					if (include_depth < 10) { // limit includer depth
-						auto t = includer(value); // load template
-						if (t) {
-							std::string u = generate(*t, map); // apply template
-							outs(trimmed(u));
-						} else {
-							fprintf(stderr, "include file '%s' not found\n", value.data());
-						}
+				if (text) {
+					outs(*text);
+					break;
+				}
+			}
+			fprintf(stderr, "undefined macro '%s'\n", key.data());
+			outs(key);
+			break;
+		case Directive::For:
+			if (evaluator) {
+				std::vector<std::string> args;
+				for (size_t i = 0; i < values.size(); i++) {
+					args.emplace_back(values[i]);
+				}
+				auto t = evaluator(key, value, args);
+				if (t) {
+					depend_call(key, args);
+					outs(*t);
+				}
+			}
+			break;
+		case Directive::Include:
+			if (includer) {
+				if (include_depth < 10) { // limit includer depth
+					auto t = includer(value); // load template
+					depend_file(value, t);
+					if (t) {
+						std::string u = generate(*t, map); // apply template
+						outs(trimmed(u));
 					} else {
-						fprintf(stderr, "include depth too deep\n");
+						fprintf(stderr, "include file '%s' not found\n", value.data());
 					}
 				} else {
-					fprintf(stderr, "include function is not defined\n");
+					fprintf(stderr, "include depth too deep\n");
 				}
+			} else {
+				fprintf(stderr, "include function is not defined\n");
+			}
+			break;
+		case Directive::If: // {{.#if.foo}}
+			{
+				condition_stack.push_back(truth ? COND_TRUE : COND_FALSE);
+				UpdateCondition();
+			}
+			break;
+		case Directive::Ifn: // {{.#ifn.foo}} // if not
+			{
+				condition_stack.push_back(!truth ? COND_TRUE : COND_FALSE);
+				UpdateCondition();
+			}
+			break;
+		case Directive::Elif: // {{.#elif.foo}}
+			if (condition_stack.size() < 2) {
+				fprintf(stderr, "elif without if\n");
 				break;
-			case Directive::If: // {{.#if.foo}}
-				{
-					auto v = atoi(value.data());
-					condition_stack.push_back(v != 0 ? COND_TRUE : COND_FALSE);
-					UpdateCondition();
-				}
+			}
+			if (condition == COND_DONE) {
+				// skip
+			} else if (condition == COND_TRUE) {
+				condition_stack.back() = COND_DONE;
+			} else {
+				condition_stack.back() = (truth ? COND_TRUE : COND_FALSE);
+			}
+			UpdateCondition();
+			break;
+		case Directive::Elifn: // {{.#elifn.foo}}
+			if (condition_stack.size() < 2) {
+				fprintf(stderr, "elif without if\n");
 				break;
-			case Directive::Ifn: // {{.#ifn.foo}} // if not
-				{
-					auto v = atoi(value.data());
-					condition_stack.push_back(v == 0 ? COND_TRUE : COND_FALSE);
-					UpdateCondition();
-				}
+			}
+			if (condition == COND_DONE) {
+				// skip
+			} else if (condition == COND_TRUE) {
+				condition_stack.back() = COND_DONE;
+			} else {
+				condition_stack.back() = (!truth ? COND_TRUE : COND_FALSE);
+			}
+			UpdateCondition();
+			break;
+		case Directive::Else: // {{.#else}}
+			if (condition_stack.size() < 2) {
+				fprintf(stderr, "else without if\n");
 				break;
-			case Directive::Elif: // {{.#elif.foo}}
-				if (condition_stack.size() < 2) {
-					fprintf(stderr, "elif without if\n");
-					break;
+			}
+			if (condition_stack.back() == COND_ELSE) {
+				fprintf(stderr, "else after else\n");
+				break;
+			}
+			if (condition == COND_FALSE) {
+				condition_stack.back() = COND_ELSE;
+			} else if (condition == COND_TRUE) {
+				condition_stack.back() = COND_DONE;
+			}
+			UpdateCondition();
+			break;
+		case Directive::End: // {{.#end}}
+			END();
+			break;
+		case Directive::Fetch: // {{.#fetch(url)}}
+			if (condition == COND_TRUE) {
+				std::optional<std::string> t;
+				auto it = prefetched.find(value);
+				if (it != prefetched.end()) {
+					t = it->second;
+				} else if (http_cache) {
+					t = http_cache->fetch(value);
+				} else {
+					t = HttpCache().fetch(value);
 				}
-				if (condition == COND_DONE) {
-					// skip
-				} else if (condition == COND_TRUE) {
-					condition_stack.back() = COND_DONE;
+				depend_call("#fetch", {value});
+				if (t) {
+					outs(trimmed(*t));
 				} else {
-					auto v = atoi(value.data());
-					condition_stack.back() = (v != 0 ? COND_TRUE : COND_FALSE);
+					fprintf(stderr, "fetch '%s' failed\n", value.data());
 				}
-				UpdateCondition();
-				break;
-			case Directive::Elifn: // {{.#elifn.foo}}
-				if (condition_stack.size() < 2) {
-					fprintf(stderr, "elif without if\n");
+			}
+			break;
+		case Directive::Loop: // {{.#for.item(list)}} ... {{.#end}}
+			{
+				size_t last = FindBlockEnd(index);
+				Template body = tmpl;
+				body.segments_ = tmpl.segments_ + index + 1;
+				body.segment_count_ = last - index - 1;
+				index = last;
+				if (condition != COND_TRUE || !tmpl.precompiled_) break;
+				auto it = tmpl.precompiled_->loops.find(seg.offset);
+				if (it == tmpl.precompiled_->loops.end()) break;
+				Loop const &loop = it->second;
+
+				Value const *list = find_variable(loop.list, &map);
+				if (!list) {
+					fprintf(stderr, "undefined symbol '?%s?'\n", loop.list.data());
 					break;
 				}
-				if (condition == COND_DONE) {
-					// skip
-				} else if (condition == COND_TRUE) {
-					condition_stack.back() = COND_DONE;
-				} else {
-					auto v = atoi(value.data());
-					condition_stack.back() = (v == 0 ? COND_TRUE : COND_FALSE);
+				// リストでなければ、その値ひとつだけのリストとして扱う
+				size_t count = list->is_list() ? list->item_count() : 1;
+				Scope scope;
+				scope.outer = scope_;
+				scope.name = &loop.item;
+				scope_ = &scope;
+				for (size_t i = 0; i < count; i++) {
+					scope.value = list->is_list() ? list->item(i) : list;
+					size_t size = out.size();
+					render_to(body, map, include_depth, &out); // 本文はコンパイル済みのものをそのまま使う
+					if (i == 0) {
+						out.reserve(out.size() + (out.size() - size) * (count - 1)); // 残りも同じくらいの大きさとみなす
+					}
 				}
-				UpdateCondition();
-				break;
-			case Directive::Else: // {{.#else}}
-				if (condition_stack.size() < 2) {
-					fprintf(stderr, "else without if\n");
+				scope_ = scope.outer;
+			}
+			break;
+		case Directive::Cache: // {{.#cache("key", ttl)}} ... {{.#end}}
+			{
+				size_t last = FindBlockEnd(index);
+				if (condition != COND_TRUE) {
+					index = last;
 					break;
 				}
-				if (condition_stack.back() == COND_ELSE) {
-					fprintf(stderr, "else after else\n");
-					break;
+				if (value.empty()) {
+					fprintf(stderr, "cache key is empty\n");
 				}
-				if (condition == COND_FALSE) {
-					condition_stack.back() = COND_ELSE;
-				} else if (condition == COND_TRUE) {
-					condition_stack.back() = COND_DONE;
+				long ttl = values.size() > 1 ? atol(values[1].c_str()) : 0; // 秒。0 なら期限なし
+
+				Template body = tmpl;
+				body.segments_ = tmpl.segments_ + index + 1;
+				body.segment_count_ = last - index - 1;
+				index = last;
+
+				// ブロックの本文が変わったら別のキーになる
+				char const *left = body.segment_count_ > 0 ? begin + body.segments_[0].offset : ptr;
+				char const *right = last < tmpl.segment_count_ ? begin + tmpl.segments_[last].offset : end;
+				char tmp[32];
+				snprintf(tmp, sizeof(tmp), "\n%016llx", (unsigned long long)hash(std::string_view(left, right > left ? right - left : 0)));
+				std::string name = value + tmp;
+				if (scope_) { // ループの中なら、束縛している値ごとに別のキーになる
+					std::string bindings;
+					for (Scope const *s = scope_; s; s = s->outer) {
+						std::string sig = s->value->signature();
+						bindings += *s->name;
+						bindings += '=';
+						bindings += std::to_string(sig.size());
+						bindings += ':';
+						bindings += sig;
+					}
+					snprintf(tmp, sizeof(tmp), "\n%016llx", (unsigned long long)hash(bindings));
+					name += tmp;
 				}
-				UpdateCondition();
-				break;
-			case Directive::End: // {{.#end}}
-				EatNL();
-				END();
-				break;
-			default:
-				if (key.empty()) { // {{.foo}}
-					if (is_html_mode()) { // if html mode, output html encoded value
-						html_encode(value, true);
+
+				DependencyResolver resolver;
+				resolver.variable = VariableValue;
+				resolver.file = includer;
+
+				if (fragment_cache && !value.empty()) {
+					auto e = fragment_cache->find(name);
+					if (e && (ttl <= 0 || time(nullptr) - e->stored < ttl) && is_up_to_date(e->dependencies, name, e->output, resolver)) {
+						if (dependencies) {
+							merge_dependencies(dependencies, e->dependencies);
+						}
+						outs(e->output);
+						break;
 					}
-					outs(value);
 				}
-				break;
-			}
-		} else if (comment_depth == 0 && c == '&' && ptr + 1 < end && strchr("&.{}", ptr[1])) { // &. or &{ or &} or &&
-			ptr++;
-			char const *p = ptr;
-			while (p < end) {
-				if (*p == ';') { // &c;
-					std::string s(ptr, p);
-					outs(s);
-					ptr = p + 1;
-					c = -1;
-					break;
-				} else if (*p == '\n') {
-					break;
+
+				// 本文を生成して、参照した入力を記録する
+				auto e = std::make_shared<FragmentCache::Entry>();
+				Dependencies *outer = dependencies;
+				dependencies = &e->dependencies;
+				e->output = render(body, map, include_depth);
+				dependencies = outer;
+				if (dependencies) {
+					merge_dependencies(dependencies, e->dependencies);
 				}
-				p++;
+				if (fragment_cache && !value.empty()) {
+					e->dependencies.source = hash(name);
+					e->dependencies.output = hash(e->output);
+					e->stored = time(nullptr);
+					fragment_cache->store(name, e);
+				}
+				outs(e->output);
 			}
-			if (c != -1) {
-				outc(c);
+			break;
+		default:
+			if (key.empty()) { // {{.foo}}
+				if (is_html_mode()) { // if html mode, output html encoded value
+					html_encode(value, true);
+				}
+				outs(value);
 			}
-		} else {
-			outc(c);
-			ptr++;
+			break;
 		}
 	}
 	
 	defines.pop_back();
-	
-	return (std::string)to_string(out);
+	generate_depth_--;
+	rendering_ = outer_template;
+}
+
+/**
+ * @brief ページを生成する（テンプレートエンジン）
+ * @param source テンプレートテキスト
+ * @param map 置換マップ
+ * @return ページテキスト
+ */
+std::string kakiage::generate(const std::string &source, Variables const &map, int include_depth)
+{
+	return render(compile(source), map, include_depth);
 }
@@ -1,17 +1,232 @@
 #ifndef KAKIAGE_H
 #define KAKIAGE_H
 
+#include "strformat.h"
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+class Expression;
+class FragmentCache;
+class HttpCache;
+class JsonDocument;
+
 class kakiage {
+public:
+	/**
+	 * @brief 生成結果が依存する入力の記録
+	 *
+	 * generate が実際に参照したものだけを記録する。値そのものではなくハッシュを保持する。
+	 * 見つからなかった参照は std::nullopt として記録する。
+	 */
+	struct Dependencies {
+		uint64_t source = 0; // テンプレート本文（ホストが設定する）
+		uint64_t output = 0; // 生成結果（ホストが設定する）
+		std::map<std::string, std::optional<uint64_t>> variables; // 置換マップおよびホスト定義のマクロ
+		std::map<std::string, std::optional<uint64_t>> files; // includer で読み込んだファイル
+		std::map<std::string, std::optional<uint64_t>> environment; // 環境変数
+		std::vector<std::string> commands; // 実行したコマンド
+		std::vector<std::string> calls; // evaluator の呼び出し
+	};
+	/**
+	 * @brief 置換マップの値
+	 *
+	 * 元のテキストと、そこから読んだ整数・実数・真偽値を持つ。数値は初めて使ったときに一度だけ変換して覚えておく。
+	 * 同じ値を複数のスレッドで同時に使ってもよい。
+	 * リストなら要素を持ち、テキストは要素の数になる。要素はコピーしても共有される。
+	 * JSON の配列やオブジェクトなら文書の中のノードを指し、要素やメンバーはそこから引く。
+	 */
+	class Value {
+	public:
+		enum class Kind : uint8_t {
+			Text, // 数として読めない
+			Integer,
+			Real,
+		};
+	private:
+		enum : unsigned {
+			HasInteger = 0x01,
+			HasReal = 0x02,
+			HasKind = 0x04,
+		};
+		strformat_ns::text_arg text_; // %() に渡すときの変換結果もここに覚える
+		mutable std::atomic<unsigned> cached_{0};
+		mutable std::atomic<int64_t> integer_{0};
+		mutable std::atomic<double> real_{0};
+		mutable std::atomic<Kind> kind_{Kind::Text};
+		std::shared_ptr<std::vector<Value>> items_; // リストの要素
+		std::shared_ptr<JsonDocument const> json_; // JSON の配列やオブジェクトなら、その文書
+		uint32_t node_ = 0; // json_ の中のノード
+		friend class ::JsonDocument;
+		Value(std::string text, std::shared_ptr<JsonDocument const> json, uint32_t node)
+			: text_(std::move(text))
+			, json_(std::move(json))
+			, node_(node)
+		{
+		}
+		void assign(Value const &r)
+		{
+			text_ = r.text_;
+			items_ = r.items_;
+			json_ = r.json_;
+			node_ = r.node_;
+			unsigned bits = r.cached_.load(std::memory_order_acquire);
+			integer_.store(r.integer_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			real_.store(r.real_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			kind_.store(r.kind_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			cached_.store(bits, std::memory_order_release);
+		}
+	public:
+		Value() = default;
+		Value(std::string text)
+			: text_(std::move(text))
+		{
+		}
+		Value(char const *text)
+			: text_(text)
+		{
+		}
+		Value(Value const &r)
+		{
+			assign(r);
+		}
+		Value &operator = (Value const &r)
+		{
+			if (this != &r) assign(r);
+			return *this;
+		}
+		std::string const &text() const
+		{
+			return text_.text();
+		}
+		operator std::string const &() const
+		{
+			return text_.text();
+		}
+		bool operator == (Value const &r) const
+		{
+			return text() == r.text();
+		}
+		int64_t integer() const;
+		double real() const;
+		Kind kind() const;
+		bool boolean() const
+		{
+			return integer() != 0;
+		}
+		strformat_ns::text_arg const &format_arg() const
+		{
+			return text_;
+		}
+		bool is_scalar() const
+		{
+			return !items_ && !json_;
+		}
+		bool is_list() const;
+		std::vector<Value> const &items() const;
+		size_t item_count() const;
+		Value const *item(size_t i) const;
+		Value const *member(std::string_view name) const;
+		void push_back(Value const &item);
+		std::string signature() const;
+	};
+	using Variables = std::map<std::string, Value, std::less<>>; // 名前の一部でもコピーせずに引ける
+private:
+	enum class Directive : uint8_t {
+		None,
+		Raw,
+		URL,
+		HTML,
+		Put,
+		Define,
+		Include,
+		If,
+		Ifn,
+		Elif,
+		Elifn,
+		Else,
+		End,
+		For,
+		Cache,
+		Fetch,
+		Loop, // {{.#for.item(list)}} ... {{.#end}}
+	};
+	struct Segment {
+		enum Type : uint8_t {
+			Text, // テキスト
+			Tag, // {{.～}}
+			End, // {{.}}
+		};
+		Type type = Text;
+		Directive directive = Directive::None;
+		uint32_t offset = 0; // Tag ならディレクティブ名の直後
+		uint32_t length = 0;
+	};
+	struct FormatCall;
+	struct Loop;
+	struct Precompiled;
+	/**
+	 * @brief #for で束縛した名前。内側から順に探す
+	 */
+	struct Scope {
+		Scope const *outer = nullptr;
+		std::string const *name = nullptr;
+		Value const *value = nullptr;
+	};
+public:
+	/**
+	 * @brief コンパイル済みテンプレート
+	 *
+	 * 一度コンパイルすれば、置換マップを変えて何度でも render できる。
+	 * 本文とセグメントの実体は storage_ が保持する。コピーしても実体は共有される。
+	 */
+	class Template {
+		friend class kakiage;
+	private:
+		std::shared_ptr<void const> storage_;
+		std::string_view source_;
+		Segment const *segments_ = nullptr;
+		size_t segment_count_ = 0;
+		std::shared_ptr<Precompiled const> precompiled_; // 事前に解析した %() と条件
+	public:
+		static constexpr uint32_t IMAGE_VERSION = 5; // コンパイル結果の形式を変えたら上げる
+
+		std::string_view source() const
+		{
+			return source_;
+		}
+		std::string image() const;
+		static std::optional<Template> from_image(std::shared_ptr<void const> storage, void const *data, size_t size);
+	};
 private:
 	bool html_mode_ = true;
-	std::vector<std::vector<char>> parse_string(const char *begin, const char *end, const char *sep, const char *stop, const std::map<std::string, std::string> *map, const char **next);
+	int generate_depth_ = 0;
+	size_t host_defines_ = 0;
+	Template const *rendering_ = nullptr; // render 中のテンプレート
+	Scope const *scope_ = nullptr; // render 中の #for の変数
+	void depend_variable(std::string const &name, std::string const *value) const;
+	Value const *find_variable(std::string const &name, Variables const *map) const;
+	void depend_file(std::string const &name, std::optional<std::string> const &text) const;
+	void depend_environment(std::string const &name, char const *value) const;
+	void depend_command(std::string const &command) const;
+	void depend_call(std::string const &name, std::vector<std::string> const &args) const;
+	std::vector<std::vector<char>> parse_string(const char *begin, const char *end, const char *sep, const char *stop, Variables const *map, bool eval, const char **next) const;
 	static std::string string_literal(const char *begin, const char *end, char stop, const char **next);
+	static std::optional<FormatCall> parse_format_call(char const *begin, char const *end);
+	static std::optional<Expression> parse_condition(char const *begin, char const *end, char const **next);
+	static std::optional<Loop> parse_loop(char const *begin, char const *end, char const **next);
+	static std::optional<FormatCall> parse_fetch(char const *begin, char const *end);
+	static std::shared_ptr<Precompiled const> precompile(std::string_view const &source, Segment const *segments, size_t count, std::shared_ptr<Precompiled> out = {});
+	bool format_compiled(char const *ptr, Variables const *map, std::vector<char> *out, char const **next) const;
+	static Directive find_directive(std::string const &name);
+	char const *parse_tag(Directive directive, char const *ptr, char const *end, Variables const *map, bool eval, std::string *key, std::vector<std::string> *values) const;
+	void render_to(Template const &tmpl, Variables const &map, int include_depth, std::vector<char> *out);
 public:
 
 	bool is_html_mode() const
@@ -28,9 +243,18 @@ public:
 	std::function<std::optional<std::string> (std::string const &name, std::string const &text, std::vector<std::string> const &args)> evaluator;
 	std::function<std::optional<std::string> (std::string const &file)> includer;
 
-	std::string generate(const std::string &source, const std::map<std::string, std::string> &map, int include_depth = 0);
+	Dependencies *dependencies = nullptr; // nullptr でなければ generate が参照した入力を記録する
+	std::shared_ptr<FragmentCache> fragment_cache; // {{.#cache}} の保存先。nullptr なら毎回生成する
+	std::shared_ptr<HttpCache> http_cache; // {{.#fetch}} の応答の保存先。nullptr なら毎回取得する
+
+	Template compile(std::string const &source) const;
+	std::string render(Template const &tmpl, Variables const &map, int include_depth = 0);
+	std::string generate(const std::string &source, Variables const &map, int include_depth = 0);
 
+	static void define_variable(Variables *map, std::string const &name, std::string const &value);
+	static Value const *lookup_variable(Variables const &map, std::string const &name);
 	static std::string_view trimmed(const std::string_view &s);
+	static uint64_t hash(std::string_view const &s);
 };
 
 #endif // KAKIAGE_H
@@ -22,17 +22,34 @@ win32:msvc {
 
 SOURCES += \
         base64.cpp \
+        batchrender.cpp \
+        dependency.cpp \
+        expression.cpp \
+        fileutil.cpp \
+        fragmentcache.cpp \
         htmlencode.cpp \
+        httpcache.cpp \
+        json.cpp \
         kakiage.cpp \
         main.cpp \
+        templatecache.cpp \
         urlencode.cpp \
         webclient.cpp
 
 HEADERS += \
 	base64.h \
+	batchrender.h \
+	dependency.h \
+	expression.h \
+	fileutil.h \
+	fragmentcache.h \
 	htmlencode.h \
+	httpcache.h \
+	json.h \
 	kakiage.h \
 	strformat.h \
+	templatecache.h \
+	threadpool.h \
 	urlencode.h \
 	webclient.h
 
@@ -41,8 +58,8 @@ win32 {
 	HEADERS += Win32Process.h
 }
 !win32 {
-	SOURCES += UnixProcess.cpp
-	HEADERS += UnixProcess.h
+	SOURCES += UnixProcess.cpp fastcgi.cpp nettest.cpp renderserver.cpp socketserver.cpp
+	HEADERS += UnixProcess.h fastcgi.h nettest.h renderserver.h socketserver.h
 }
 
 DISTFILES += \
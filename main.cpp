@@ -1,11 +1,24 @@
 
+#include "batchrender.h"
+#include "dependency.h"
+#include "fileutil.h"
+#include "fragmentcache.h"
+#include "httpcache.h"
+#include "json.h"
 #include "kakiage.h"
+#include "templatecache.h"
 #include <map>
 #include <stdio.h>
 #include <cstring>
 #include <optional>
 #include "webclient.h"
 
+#ifndef _WIN32
+#include "fastcgi.h"
+#include "nettest.h"
+#include "renderserver.h"
+#endif
+
 #ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
@@ -29,39 +42,20 @@
 #define VERSION "0.0.0"
 
 std::optional<std::string> inet_checkip_cache;
-std::map<std::string, std::string> inet_resolve_cache;
-
 /**
  * @brief inet_resolve
  * @param name
- * @return
+ * @return 最初の IPv4 アドレス
  */
 std::string inet_resolve(std::string const &name)
 {
-	auto it = inet_resolve_cache.find(name);
-	if (it == inet_resolve_cache.end()) {
-#if defined(_WIN32) || defined(__APPLE__)
-		struct hostent *he = nullptr;
-		he = ::gethostbyname(name.c_str());
-		if (!he) return {};
-		auto a = inet_ntoa(*(in_addr *)he->h_addr_list[0]);
-#elif 0
-		gethostbyname_r(name, &tmp, buf, sizeof(buf), &he, &err);
-#else
-		struct addrinfo hints, *res;
-		struct in_addr addr;
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_family = AF_INET;
-		auto err = getaddrinfo(name.c_str(), nullptr, &hints, &res);
-		if (err) return {};
-		addr.s_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
-		freeaddrinfo(res);
-		auto a = inet_ntoa(addr);
-#endif
-		it = inet_resolve_cache.insert(inet_resolve_cache.end(), std::make_pair(name, a));
+	HostNameResolver::Addresses addrs = HostNameResolver::lookup(name);
+	for (HostNameResolver::Address const &a : *addrs) {
+		if (a.family == AF_INET) {
+			return a.to_string();
+		}
 	}
-	return it->second;
+	return {};
 }
 
 #if 0
@@ -124,30 +118,9 @@ void finalize_curl()
 	}
 }
 
-/**
- * @brief ファイルを読み込む
- * @param[in] path ファイルパス
- * @return ファイルの内容
- */
-std::optional<std::string> readfile(char const *path)
+void parseConfigFile(char const *path, kakiage::Variables *map)
 {
-	std::vector<char> vec;
-	int fd = open(path, O_RDONLY | O_BINARY);
-	if (fd < 0) return std::nullopt;
-	vec.clear();
-	while (true) {
-		char buf[65536];
-		int r = read(fd, buf, sizeof(buf));
-		if (r <= 0) break;
-		vec.insert(vec.end(), buf, buf + r);
-	}
-	close(fd);
-	return std::string(vec.begin(), vec.end());
-}
-
-void parseConfigFile(char const *path, std::map<std::string, std::string> *map)
-{
-	auto rules = readfile(path);
+	auto rules = read_file(path);
 	if (!rules) {
 		fprintf(stderr, "Failed to open definition file: %s\n", path);
 	}
@@ -173,7 +146,7 @@ void parseConfigFile(char const *path, std::map<std::string, std::string> *map)
 					if (eq) {
 						std::string name(left, eq);
 						std::string value(eq + 1, right);
-						(*map)[name] = value;
+						kakiage::define_variable(map, name, value);
 					} else {
 						std::string s(line, endl);
 						fprintf(stderr, "Syntax error (%d): %s\n", linenum + 1, s.c_str());
@@ -201,6 +174,32 @@ void parseConfigFile(char const *path, std::map<std::string, std::string> *map)
 	}
 }
 
+/**
+ * @brief JSON 文書を読み、根のオブジェクトのメンバーを置換マップに定義する
+ * @param path JSON ファイル
+ * @param map 置換マップ
+ * @return 読めなければ false
+ */
+bool parseJsonFile(char const *path, kakiage::Variables *map)
+{
+	auto text = read_file(path);
+	if (!text) {
+		fprintf(stderr, "Failed to open JSON file: %s\n", path);
+		return false;
+	}
+	std::string error;
+	auto doc = JsonDocument::parse(std::move(*text), &error);
+	if (!doc) {
+		fprintf(stderr, "JSON syntax error: %s: %s\n", path, error.c_str());
+		return false;
+	}
+	if (!JsonDocument::define_variables(doc, map)) {
+		fprintf(stderr, "JSON document is not an object: %s\n", path);
+		return false;
+	}
+	return true;
+}
+
 struct TestCase {
 	char const *source;
 	char const *expected;
@@ -389,7 +388,47 @@ TestCase testcases[] = {
 	// 44
 	{ "ab{{.;cd{{ef}}gh{{.ij}}kl}}mn"
 	 , "abmn" },
+
+	// 45
+	{ "({{.#cache('name', 60)}}{{.name}}{{.#end}})"
+	 , "(Taro)" },
+
+	// 46
+	{ "({{.#cache('name', 60)}}{{.name}}{{.#end}}{{.#cache('name', 60)}}{{.name}}{{.#end}})" // 2つ目は保存されたものを使う
+	 , "(TaroTaro)" },
+
+	// 47
+	{ "({{.#cache('if')}}{{.#if.0}}a{{.#else}}b{{.}}c{{.}}d)"
+	 , "(bcd)" },
+
+	// 48
+	{ "({{.#if.0}}{{.#cache('x')}}a{{.}}{{.#else}}b{{.}})"
+	 , "(b)" },
 	
+	// 49
+	{ "({{.%(\"%05d|%-4s|%x and a format string longer than the inline one\", -42, \"ab\", 255)}})"
+	 , "(-0042|ab  |ff and a format string longer than the inline one)" },
+
+	// 50
+	{ "({{.#if.age}}{{.#if( age )}}a{{.}}{{.#ifn.age}}b{{.#elifn.name}}c{{.}}{{.}}{{.#if.age}}d{{.}})" // 名前ひとつだけの条件は事前に解析される
+	 , "(acd)" },
+
+	// 51
+	{ "({{.#if(age > 20 && name == \"Taro\")}}a{{.}}{{.#if((age + 1) * 2 < 50 || !name)}}b{{.}}{{.#ifn(age % 2)}}c{{.#else}}d{{.}}{{.#if(name < 'Tom' && 1.5 * 2 == 3)}}e{{.}})"
+	 , "(abce)" },
+
+	// 52
+	{ "({{.#for.f(fruits)}}[{{.f}}{{.#if(f == 'banana')}}!{{.}}]{{.}}{{.fruits}})"
+	 , "([apple][banana!][cherry]3)" },
+
+	// 53
+	{ "({{.#for.u(users)}}{{.u.name}}:{{.u.tags.0}}{{.#if(u.admin && u.age > 20)}}*{{.}};{{.}}{{.users.1.name}}/{{.users}})"
+	 , "(Taro:a*;Hanako\xe3\x81\x82:c;Hanako\xe3\x81\x82/2)" },
+
+	// 54
+	{ "({{.#for.f(fruits)}}[{{.#cache(\"loop\")}}{{.f}}{{.#end}}]{{.#end}})"
+	 , "([apple][banana][cherry])" },
+
 #endif
 };
 static const int testcase_count = sizeof(testcases) / sizeof(testcases[0]);
@@ -400,10 +439,11 @@ int testmain()
 {
 	char const *in_file = "../test.in";
 	char const *ka_file = "../test.ka";
+	char const *json_file = "../test.json";
 
 	std::string input_text;
-	std::map<std::string, std::string> map;
-	auto file = readfile(in_file);
+	kakiage::Variables map;
+	auto file = read_file(in_file);
 	if (!file) {
 		fprintf(stderr, "Failed to open input file: test.in\n");
 		return 1;
@@ -412,6 +452,7 @@ int testmain()
 	input_text = *file;
 	map.clear();
 	parseConfigFile(ka_file, &map);
+	parseJsonFile(json_file, &map);
 
 	int passed = 0;
 	int failed = 0;
@@ -428,12 +469,98 @@ int testmain()
 			failed++;
 		}
 	}
+	{ // . で区切った名前を読む #cache は、次の生成でも再利用される
+		kakiage engine = st;
+		int count = 0;
+		engine.evaluator = [&](std::string const &name, std::string const &, std::vector<std::string> const &)->std::optional<std::string>{
+			if (name == "count") return std::to_string(++count);
+			return std::nullopt;
+		};
+		char const *source = "({{.#cache(\"dotted\")}}{{.users.0.name}}:{{.#put.count}}{{.#end}})";
+		fprintf(stderr, "[cache] %s\n", source);
+		std::string first = engine.generate(source, map);
+		std::string second = engine.generate(source, map);
+		if (first == "(Taro:1)" && second == first) {
+			passed++;
+		} else {
+			fprintf(stderr, "Test failed: %s\n", source);
+			fprintf(stderr, "  expected: (Taro:1) twice\n");
+			fprintf(stderr, "    result: %s %s\n", first.c_str(), second.c_str());
+			failed++;
+		}
+	}
+#ifndef _WIN32
+	run_network_tests(st, &passed, &failed);
+#endif
 	fprintf(stderr, "Passed: %d\n", passed);
 	fprintf(stderr, "Failed: %d\n", failed);
 
 	return 0;
 }
 
+#ifndef _WIN32
+/**
+ * @brief レンダリングサーバーに処理を依頼する
+ * @param socket_path ソケットのパス
+ * @param source_path テンプレートファイル
+ * @param input_text テンプレートテキスト（source_path が空のとき）
+ * @param map 置換マップ
+ * @param output_path 出力ファイル（空なら標準出力）
+ * @return 終了コード。サーバーに接続できなければ std::nullopt
+ */
+std::optional<int> render_remote(std::string const &socket_path, std::string const &source_path, std::string const &input_text, kakiage::Variables const &map, std::string const &output_path)
+{
+	RenderRequest req;
+	if (!source_path.empty()) {
+		char *path = realpath(source_path.c_str(), nullptr); // サーバーのカレントディレクトリに依存しないように
+		req.path = path ? path : source_path;
+		free(path);
+	} else {
+		req.source = input_text;
+	}
+	req.variables = map;
+	req.html = st.is_html_mode();
+
+	FILE *fp = nullptr;
+	bool failed = false;
+	auto Open = [&](){
+		if (!fp && !failed) {
+			if (output_path.empty()) {
+				fp = stdout;
+			} else {
+				fp = fopen(output_path.c_str(), "w");
+				if (!fp) {
+					fprintf(stderr, "Failed to open output file: %s\n", output_path.c_str());
+					failed = true;
+				}
+			}
+		}
+	};
+	std::string error;
+	auto r = RenderClient::render(socket_path, req, [&](char const *ptr, size_t len){
+		Open();
+		if (fp) {
+			fwrite(ptr, 1, len, fp);
+		}
+	}, &error);
+	if (r == RenderClient::ConnectionFailed) {
+		fprintf(stderr, "Failed to connect to %s: %s\n", socket_path.c_str(), error.c_str());
+		return std::nullopt;
+	}
+	if (r == RenderClient::Success) {
+		Open();
+	}
+	if (fp && fp != stdout) {
+		fclose(fp);
+	}
+	if (r != RenderClient::Success) {
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	return failed ? 1 : 0;
+}
+#endif
+
 //
 int main(int argc, char **argv)
 {
@@ -441,9 +568,21 @@ int main(int argc, char **argv)
 
 	std::string source_path;
 	std::string output_path;
+	std::string deps_path;
+	std::string cache_dir;
+	std::string serve_path;
+	std::string client_path;
+	std::string fastcgi_address;
+	std::string document_root;
+	std::string each_path;
+	std::string output_dir;
+	std::string name_template;
+	bool client_explicit = false;
+	bool json_loaded = false;
+	int threads = 0;
 	std::string input_text;
 
-	std::map<std::string, std::string> map;
+	kakiage::Variables map;
 
 	bool help = false;
 	bool test = false;
@@ -463,6 +602,14 @@ int main(int argc, char **argv)
 				} else {
 					fprintf(stderr, "Too few arguments\n");
 				}
+			} else if (IsArg("-j")) {
+				if (i < argc) {
+					if (parseJsonFile(argv[i++], &map)) {
+						json_loaded = true;
+					}
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
 			} else if (strncmp(arg, "-D", 2) == 0) {
 				if (arg[2] == 0) {
 					if (i < argc) {
@@ -471,7 +618,7 @@ int main(int argc, char **argv)
 						if (p != std::string::npos) {
 							std::string name = a.substr(0, p);
 							std::string value = a.substr(p + 1);
-							map[name] = value;
+							kakiage::define_variable(&map, name, value);
 						} else {
 							fprintf(stderr, "Syntax error: %s\n", a.c_str());
 						}
@@ -484,7 +631,7 @@ int main(int argc, char **argv)
 					if (p != std::string::npos) {
 						std::string name = a.substr(0, p);
 						std::string value = a.substr(p + 1);
-						map[name] = value;
+						kakiage::define_variable(&map, name, value);
 					} else {
 						fprintf(stderr, "Syntax error: %s\n", a.c_str());
 					}
@@ -505,6 +652,67 @@ int main(int argc, char **argv)
 				} else {
 					fprintf(stderr, "Too few arguments\n");
 				}
+			} else if (IsArg("--deps")) {
+				if (i < argc) {
+					deps_path = argv[i++];
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--cache-dir")) {
+				if (i < argc) {
+					cache_dir = argv[i++];
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--serve")) {
+				if (i < argc) {
+					serve_path = argv[i++];
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--client")) {
+				if (i < argc) {
+					client_path = argv[i++];
+					client_explicit = true;
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--fastcgi")) {
+				if (i < argc) {
+					fastcgi_address = argv[i++];
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--root")) {
+				if (i < argc) {
+					document_root = argv[i++];
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--each")) {
+				if (i < argc) {
+					each_path = argv[i++];
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--outdir")) {
+				if (i < argc) {
+					output_dir = argv[i++];
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--name")) {
+				if (i < argc) {
+					name_template = argv[i++];
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
+			} else if (IsArg("--threads")) {
+				if (i < argc) {
+					threads = atoi(argv[i++]);
+				} else {
+					fprintf(stderr, "Too few arguments\n");
+				}
 			} else if (IsArg("--html")) {
 				st.set_html_mode(true);
 			} else if (IsArg("--test")) {
@@ -539,22 +747,45 @@ int main(int argc, char **argv)
 		return std::nullopt;
 	};
 
+	if (cache_dir.empty()) {
+		char const *env = getenv("KAKIAGE_CACHE_DIR");
+		if (env) {
+			cache_dir = env;
+		}
+	}
+	st.fragment_cache = std::make_shared<FragmentCache>(cache_dir);
+	st.http_cache = std::make_shared<HttpCache>(cache_dir);
+
 	if (test) {
 		return testmain();
 	}
 
+#ifndef _WIN32
+	if (!serve_path.empty()) {
+		RenderServer server(st, map);
+		return server.run(serve_path, threads);
+	}
+	if (!fastcgi_address.empty()) {
+		FastCGIServer server(st, map);
+		server.set_document_root(document_root);
+		return server.run(fastcgi_address, threads);
+	}
+	if (client_path.empty()) {
+		char const *env = getenv("KAKIAGE_SOCKET");
+		if (env) {
+			client_path = env;
+		}
+	}
+#endif
+
 	if (source_path.empty()) {
 		if (input_text.empty()) {
 			help = true;
 		}
-	} else if (input_text.empty()) {
-		auto file = readfile(source_path.c_str());
-		if (file) {
-			input_text = *file;
-		} else {
-			fprintf(stderr, "Failed to open input file: %s\n", source_path.c_str());
-		}
-	} else {
+	} else if (!input_text.empty()) {
+		help = true;
+	}
+	if (!each_path.empty() && source_path.empty()) {
 		help = true;
 	}
 
@@ -563,14 +794,82 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Usage: %s [options] (<input file> | -s <input text>)\n", PROGRAM_NAME);
 		fprintf(stderr, "Options:\n");
 		fprintf(stderr, "  -d <definision file>\n");
+		fprintf(stderr, "  -j <JSON file>\n");
 		fprintf(stderr, "  -D <name>=<value>\n");
 		fprintf(stderr, "  -o <output file>\n");
 		fprintf(stderr, "  -s <input text>\n");
+		fprintf(stderr, "  --deps <dependency file>\n");
+		fprintf(stderr, "  --cache-dir <compiled template cache directory>\n");
 		fprintf(stderr, "  --html\n");
+		fprintf(stderr, "  --serve <socket>\n");
+		fprintf(stderr, "  --client <socket>\n");
+		fprintf(stderr, "  --fastcgi (<socket> | [<host>]:<port>)\n");
+		fprintf(stderr, "  --root <document root>\n");
+		fprintf(stderr, "  --threads <number of worker threads>\n");
+		fprintf(stderr, "  --each <JSON Lines or CSV file>\n");
+		fprintf(stderr, "  --outdir <output directory for --each>\n");
+		fprintf(stderr, "  --name <output file name template for --each>\n");
 		return 0;
 	}
 
-	std::string result = st.generate(input_text, map);
+	if (!each_path.empty()) {
+		BatchRenderer batch(st, map);
+		if (!output_dir.empty()) {
+			batch.set_output_dir(output_dir);
+		}
+		if (!name_template.empty()) {
+			batch.set_name_template(name_template);
+		}
+		return batch.run(each_path, source_path, threads);
+	}
+
+#ifndef _WIN32
+	if (!client_path.empty() && deps_path.empty() && !json_loaded) { // JSON の値は送れないので自分で処理する
+		auto r = render_remote(client_path, source_path, input_text, map, output_path);
+		if (r) {
+			return *r;
+		}
+		if (client_explicit) {
+			return 1;
+		}
+		// サーバーが動いていなければ自分で処理する
+	}
+#endif
+
+	if (!source_path.empty()) {
+		auto file = read_file(source_path.c_str());
+		if (file) {
+			input_text = *file;
+		} else {
+			fprintf(stderr, "Failed to open input file: %s\n", source_path.c_str());
+		}
+	}
+
+	kakiage::Dependencies deps;
+	if (!deps_path.empty()) {
+		if (!output_path.empty()) {
+			DependencyResolver resolver;
+			resolver.variable = [&](std::string const &name)->std::optional<std::string>{
+				kakiage::Value const *value = kakiage::lookup_variable(map, name);
+				if (value) return value->signature();
+				return std::nullopt;
+			};
+			resolver.file = st.includer;
+			auto prev = load_dependencies(deps_path.c_str());
+			if (prev && is_up_to_date(*prev, input_text, read_file(output_path.c_str()), resolver)) {
+				return 0; // 入力が変わっていないので出力をそのまま使う
+			}
+		}
+		st.dependencies = &deps;
+	}
+
+	std::string result;
+	if (cache_dir.empty()) {
+		result = st.generate(input_text, map);
+	} else {
+		TemplateDiskCache cache(&st, cache_dir);
+		result = st.render(*cache.compile(input_text), map);
+	}
 
 	FILE *fp;
 	if (!output_path.empty()) {
@@ -585,6 +884,15 @@ int main(int argc, char **argv)
 		fwrite(result.data(), 1, result.size(), stdout);
 	}
 
+	if (!deps_path.empty()) {
+		st.dependencies = nullptr;
+		deps.source = kakiage::hash(input_text);
+		deps.output = kakiage::hash(result);
+		if (!save_dependencies(deps_path.c_str(), deps)) {
+			fprintf(stderr, "Failed to write dependency file: %s\n", deps_path.c_str());
+		}
+	}
+
 	finalize_curl();
 
 	return 0;
@@ -0,0 +1,534 @@
+#include "nettest.h"
+#include "fastcgi.h"
+#include "fileutil.h"
+#include "httpcache.h"
+#include "renderserver.h"
+#include "socketserver.h"
+#include "webclient.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <functional>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// ループバックで待ち受けるサーバーを相手にした試験
+//
+// HTTP はこのプロセスのスレッドで応答する。レンダリングサーバーと FastCGI は
+// シグナルを受けるまで戻らないので、子プロセスで動かして SIGTERM で止める。
+// TLS のセッション再開は証明書を持つサーバーが要るので、ここでは試験しない。
+
+namespace {
+
+std::string header_value(std::string const &head, char const *name)
+{
+	size_t n = strlen(name);
+	size_t i = head.find("\r\n");
+	while (i != std::string::npos && i + 2 < head.size()) {
+		i += 2;
+		size_t j = head.find("\r\n", i);
+		if (j == std::string::npos) break;
+		if (j - i > n && head[i + n] == ':' && strncasecmp(head.data() + i, name, n) == 0) {
+			size_t k = i + n + 1;
+			while (k < j && head[k] == ' ') {
+				k++;
+			}
+			return head.substr(k, j - k);
+		}
+		i = j;
+	}
+	return {};
+}
+
+/**
+ * @brief 応答を組み立てる
+ * @param headers 状態行を除いたヘッダ。各行は \r\n で終える
+ */
+std::string http_response(char const *status, std::string const &headers, std::string const &body)
+{
+	std::string s = "HTTP/1.1 ";
+	s += status;
+	s += "\r\n";
+	s += headers;
+	s += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+	s += body;
+	return s;
+}
+
+/**
+ * @brief 試験用の HTTP サーバー
+ *
+ * 127.0.0.1 の空いているポートで待ち受け、接続ごとにスレッドを作る。
+ * 要求ごとに handler が返したテキストをそのまま応答として送る。空なら応答せずに相手が閉じるのを待つ。
+ * 応答に Connection: close があれば、送った後で切断する。
+ */
+class TestServer {
+public:
+	struct Request {
+		std::string path;
+		std::string head;
+		std::string body;
+	};
+	using Handler = std::function<std::string (Request const &req)>;
+private:
+	Handler handler_;
+	size_t piece_; // 0 でなければ応答をこの大きさずつ区切って送る
+	int sock_ = -1;
+	int port_ = 0;
+	std::thread thread_;
+	std::mutex mutex_;
+	std::vector<int> fds_;
+	std::vector<std::thread> workers_;
+	std::vector<Request> requests_;
+	void serve(int fd)
+	{
+		std::string buf;
+		auto Receive = [&](){
+			char tmp[4096];
+			ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+			if (n <= 0) return false;
+			buf.append(tmp, n);
+			return true;
+		};
+		while (1) {
+			size_t end;
+			while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+				if (!Receive()) return;
+			}
+			Request req;
+			req.head = buf.substr(0, end + 4);
+			buf.erase(0, end + 4);
+			size_t i = req.head.find(' ');
+			req.path = req.head.substr(i + 1, req.head.find(' ', i + 1) - i - 1);
+			size_t len = strtoul(header_value(req.head, "Content-Length").c_str(), nullptr, 10);
+			while (buf.size() < len) {
+				if (!Receive()) return;
+			}
+			req.body = buf.substr(0, len);
+			buf.erase(0, len);
+			{
+				std::lock_guard lock(mutex_);
+				requests_.push_back(req);
+			}
+			std::string res = handler_(req);
+			if (res.empty()) {
+				while (Receive());
+				return;
+			}
+			size_t step = piece_ ? piece_ : res.size();
+			for (size_t pos = 0; pos < res.size(); pos += step) {
+				if (pos > 0) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+				if (!SocketServer::write_all(fd, res.data() + pos, std::min(step, res.size() - pos))) return;
+			}
+			if (strcasecmp(header_value(req.head, "Connection").c_str(), "close") == 0 || strcasecmp(header_value(res, "Connection").c_str(), "close") == 0) {
+				shutdown(fd, SHUT_WR); // 応答の途中でも切断する
+				return;
+			}
+		}
+	}
+public:
+	TestServer(Handler handler, size_t piece = 0)
+		: handler_(handler)
+		, piece_(piece)
+	{
+		sock_ = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if (sock_ < 0 || bind(sock_, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock_, SOMAXCONN) != 0 || getsockname(sock_, (sockaddr *)&addr, &len) != 0) {
+			fprintf(stderr, "test server: %s\n", strerror(errno));
+			return;
+		}
+		port_ = ntohs(addr.sin_port);
+		thread_ = std::thread([this](){
+			while (1) {
+				int fd = accept(sock_, nullptr, nullptr);
+				if (fd < 0) break;
+				int one = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				std::lock_guard lock(mutex_);
+				fds_.push_back(fd);
+				workers_.emplace_back([this, fd](){
+					serve(fd);
+				});
+			}
+		});
+	}
+	~TestServer()
+	{
+		if (sock_ >= 0) {
+			shutdown(sock_, SHUT_RDWR); // accept を戻す
+		}
+		if (thread_.joinable()) {
+			thread_.join();
+		}
+		for (int fd : fds_) {
+			shutdown(fd, SHUT_RDWR);
+		}
+		for (std::thread &t : workers_) {
+			t.join();
+		}
+		for (int fd : fds_) {
+			close(fd);
+		}
+		if (sock_ >= 0) {
+			close(sock_);
+		}
+	}
+	TestServer(TestServer const &) = delete;
+	void operator = (TestServer const &) = delete;
+	std::string url(std::string const &path) const
+	{
+		return "http://127.0.0.1:" + std::to_string(port_) + path;
+	}
+	size_t connections()
+	{
+		std::lock_guard lock(mutex_);
+		return fds_.size();
+	}
+	std::vector<Request> requests(std::string const &path)
+	{
+		std::lock_guard lock(mutex_);
+		std::vector<Request> v;
+		for (Request const &r : requests_) {
+			if (r.path == path) {
+				v.push_back(r);
+			}
+		}
+		return v;
+	}
+};
+
+std::string make_temp_dir()
+{
+	char tmp[] = "/tmp/kakiage-test-XXXXXX";
+	return mkdtemp(tmp) ? tmp : std::string();
+}
+
+void remove_directory(std::string const &dir)
+{
+	if (DIR *d = opendir(dir.c_str())) {
+		while (dirent *e = readdir(d)) {
+			if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+				unlink((dir + '/' + e->d_name).c_str());
+			}
+		}
+		closedir(d);
+	}
+	rmdir(dir.c_str());
+}
+
+/**
+ * @brief 子プロセスでサーバーを動かす
+ * @return 子プロセスの ID
+ */
+pid_t start_child(std::function<int ()> const &run)
+{
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid == 0) {
+		_exit(run());
+	}
+	return pid;
+}
+
+void stop_child(pid_t pid)
+{
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, nullptr, 0);
+	}
+}
+
+int connect_unix(std::string const &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	for (int i = 0; i < 200; i++) { // 子プロセスが待ち受けるまで待つ
+		int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == 0) return sock;
+		close(sock);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return -1;
+}
+
+std::string fcgi_record(int type, int id, std::string const &content)
+{
+	std::string s(8, '\0');
+	s[0] = 1;
+	s[1] = (char)type;
+	s[2] = char(id >> 8);
+	s[3] = char(id);
+	s[4] = char(content.size() >> 8);
+	s[5] = char(content.size());
+	return s + content;
+}
+
+std::string fcgi_params(std::vector<std::pair<std::string, std::string>> const &params)
+{
+	std::string s;
+	for (auto const &[name, value] : params) {
+		s += (char)name.size(); // 127 バイトまで
+		s += (char)value.size();
+		s += name;
+		s += value;
+	}
+	return s;
+}
+
+} // namespace
+
+/**
+ * @brief ループバックのサーバーを相手に通信の試験をする
+ * @param engine レンダリングサーバーと FastCGI が使うエンジン
+ * @param passed 成功した数に加える
+ * @param failed 失敗した数に加える
+ */
+void run_network_tests(kakiage const &engine, int *passed, int *failed)
+{
+	auto Check = [&](char const *name, bool ok){
+		fprintf(stderr, "[net] %s\n", name);
+		if (ok) {
+			(*passed)++;
+		} else {
+			fprintf(stderr, "Test failed: %s\n", name);
+			(*failed)++;
+		}
+	};
+
+	std::string dir = make_temp_dir();
+	if (dir.empty()) {
+		Check("temporary directory", false);
+		return;
+	}
+
+	// サーバーは子プロセスで動かすので、スレッドを作る前に試験する
+	{
+		std::string path = dir + "/render.sock";
+		pid_t pid = start_child([&](){
+			RenderServer server(engine, {});
+			return server.run(path, 1);
+		});
+		RenderRequest req;
+		req.source = "({{.name}}{{.#for.x(xs)}}[{{.x}}]{{.#end}})";
+		req.variables["name"] = "a&b";
+		kakiage::Value xs;
+		xs.push_back(std::string("1"));
+		xs.push_back(std::string("2"));
+		req.variables["xs"] = xs;
+		std::string out;
+		std::string error;
+		close(connect_unix(path)); // 待ち受けるまで待つ
+		auto r = RenderClient::render(path, req, [&](char const *ptr, size_t len){
+			out.append(ptr, len);
+		}, &error);
+		Check("render server", r == RenderClient::Success && out == "(a&b[1][2])");
+		out.clear();
+		req.source = "{{.name}}";
+		r = RenderClient::render(path, req, [&](char const *ptr, size_t len){
+			out.append(ptr, len);
+		}, &error);
+		Check("render server (second request)", r == RenderClient::Success && out == "a&b");
+		stop_child(pid);
+	}
+	{
+		std::string path = dir + "/fcgi.sock";
+		write_file(dir + "/page.txt", "[{{.q}}|{{.REQUEST_METHOD}}]");
+		pid_t pid = start_child([&](){
+			FastCGIServer server(engine, {});
+			server.set_document_root(dir);
+			return server.run(path, 1);
+		});
+		int sock = connect_unix(path);
+		std::string req;
+		req += fcgi_record(1, 1, std::string("\0\1\1\0\0\0\0\0", 8)); // FCGI_BEGIN_REQUEST, FCGI_RESPONDER, FCGI_KEEP_CONN
+		req += fcgi_record(4, 1, fcgi_params({{"DOCUMENT_URI", "/page.txt"}, {"QUERY_STRING", "q=a%20b"}, {"REQUEST_METHOD", "GET"}}));
+		req += fcgi_record(4, 1, {});
+		req += fcgi_record(5, 1, {});
+		std::string out;
+		auto Receive = [&](){
+			out.clear();
+			unsigned char hdr[8];
+			while (SocketServer::read_all(sock, hdr, 8)) {
+				std::vector<char> content(((hdr[4] << 8) | hdr[5]) + hdr[6]);
+				if (!SocketServer::read_all(sock, content.data(), content.size())) break;
+				if (hdr[1] == 6) { // FCGI_STDOUT
+					out.append(content.data(), (hdr[4] << 8) | hdr[5]);
+				} else if (hdr[1] == 3) { // FCGI_END_REQUEST
+					return true;
+				}
+			}
+			return false;
+		};
+		bool ok = sock >= 0 && SocketServer::write_all(sock, req.data(), req.size()) && Receive();
+		Check("fastcgi", ok && out.find("Content-Length: 9\r\n") != std::string::npos && out.size() > 13 && out.compare(out.size() - 13, 13, "\r\n\r\n[a b|GET]") == 0);
+		req.replace(req.find("/page.txt"), 9, "/none.txt");
+		ok = sock >= 0 && SocketServer::write_all(sock, req.data(), req.size()) && Receive();
+		Check("fastcgi (keep connection, not found)", ok && out.compare(0, 12, "Status: 404 ") == 0);
+		req = fcgi_record(1, 1, std::string("\0\1\1\0\0\0\0\0", 8));
+		req += fcgi_record(4, 1, fcgi_params({{"DOCUMENT_URI", "/page.txt"}, {"REQUEST_METHOD", "POST"}, {"CONTENT_TYPE", "application/x-www-form-urlencoded"}}));
+		req += fcgi_record(4, 1, {});
+		std::string chunk = "q=" + std::string(65000, 'x');
+		for (int i = 0; i < 17; i++) { // 1 MB を超える本文
+			req += fcgi_record(5, 1, chunk);
+			chunk.assign(65000, 'x');
+		}
+		req += fcgi_record(5, 1, {});
+		ok = sock >= 0 && SocketServer::write_all(sock, req.data(), req.size()) && Receive();
+		Check("fastcgi (body too large)", ok && out.compare(0, 12, "Status: 413 ") == 0);
+		if (sock >= 0) {
+			close(sock);
+		}
+		stop_child(pid);
+	}
+
+	{
+		TestServer server([](TestServer::Request const &req){
+			if (req.path == "/upper") {
+				return std::string("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nA\r\n0123456789\r\n0\r\n\r\n");
+			}
+			return std::string("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5;ext=1\r\nhello\r\n6\r\n world\r\n0\r\nX-Trailer: a\r\n\r\n");
+		}, 3); // チャンクの区切りの途中で届くようにする
+		WebContext cx(WebClient::HTTP_1_1);
+		cx.set_keep_alive_enabled(true);
+		WebClient http(&cx);
+		int code = http.get(WebClient::Request(server.url("/chunked")));
+		Check("chunked", code == 200 && std::string(http.content_data(), http.content_length()) == "hello world");
+		code = http.get(WebClient::Request(server.url("/upper")));
+		Check("chunked (upper case size)", code == 200 && std::string(http.content_data(), http.content_length()) == "0123456789");
+		Check("keep-alive after trailer", server.connections() == 1);
+
+		std::string body;
+		WebClient::BodySink sink = [&](char const *ptr, size_t len){
+			body.append(ptr, len);
+		};
+		code = http.download(WebClient::Request(server.url("/sink")), sink);
+		Check("body sink", code == 200 && body == "hello world" && http.response().content.empty());
+	}
+	{
+		TestServer server([](TestServer::Request const &req){
+			return http_response("200 OK", {}, req.path + ':' + req.body);
+		});
+		WebContext cx(WebClient::HTTP_1_1);
+		cx.set_keep_alive_enabled(true);
+		WebClient http(&cx);
+		std::string ref = "XYZ";
+		WebClient::Post post;
+		post.content_type = "text/plain";
+		post.data = {'a', 'b'};
+		post.references.push_back({1, ref.data(), ref.size()});
+		int code = http.post(WebClient::Request(server.url("/post")), &post);
+		Check("scatter-gather post", code == 200 && std::string(http.content_data(), http.content_length()) == "/post:aXYZb");
+
+		std::vector<WebClient::Request> requests;
+		for (char const *path : {"/a", "/b", "/c", "/d"}) {
+			requests.emplace_back(server.url(path));
+		}
+		auto results = WebClient::fetch_all(&cx, requests, {}, 2);
+		bool ok = results.size() == 4;
+		for (size_t i = 0; ok && i < results.size(); i++) {
+			auto const &c = results[i].response.content;
+			ok = results[i].ok && std::string(c.begin(), c.end()) == std::string("/") + char('a' + i) + ':';
+		}
+		Check("fetch_all", ok);
+		Check("connection pool", server.connections() <= 3); // 最初の接続と、同時に張る 2 本まで
+	}
+	{
+		TestServer server([](TestServer::Request const &){
+			return std::string(); // 応答しない
+		});
+		WebContext cx(WebClient::HTTP_1_1);
+		WebClient::Timeouts t;
+		t.connect_ms = 1000;
+		t.read_ms = 200;
+		t.total_ms = 1000;
+		cx.set_timeouts(t);
+		WebClient http(&cx);
+		auto t0 = std::chrono::steady_clock::now();
+		int code = http.get(WebClient::Request(server.url("/hang")));
+		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+		Check("read timeout", code != 200 && ms < 2000);
+	}
+
+	{
+		std::atomic<int> drop{0};
+		TestServer server([&](TestServer::Request const &req){
+			if (req.path == "/fresh") {
+				return http_response("200 OK", "Cache-Control: max-age=100\r\n", "fresh");
+			}
+			if (req.path == "/aged") {
+				return http_response("200 OK", "Cache-Control: max-age=10\r\nAge: 10\r\n", "aged");
+			}
+			if (req.path == "/expired") {
+				return http_response("200 OK", "Date: Mon, 01 Jan 2024 00:00:10 GMT\r\nExpires: Mon, 01 Jan 2024 00:00:00 GMT\r\nETag: \"x\"\r\n", "expired");
+			}
+			if (req.path == "/short") {
+				return std::string("HTTP/1.1 200 OK\r\nCache-Control: max-age=100\r\nConnection: close\r\nContent-Length: 100\r\n\r\npartial");
+			}
+			if (req.path == "/etag") {
+				if (header_value(req.head, "If-None-Match") == "\"v1\"") {
+					return http_response("304 Not Modified", {}, {});
+				}
+				return http_response("200 OK", "Cache-Control: no-cache\r\nETag: \"v1\"\r\n", "etag");
+			}
+			if (req.path == "/drop") {
+				if (drop++ == 0) {
+					return http_response("200 OK", "Cache-Control: no-cache\r\nETag: \"v1\"\r\n", "drop");
+				}
+				return http_response("200 OK", "Cache-Control: no-store\r\n", "drop");
+			}
+			return http_response("404 Not Found", {}, {});
+		});
+		HttpCache cache;
+		auto Fetch = [&](char const *path){
+			return cache.fetch(server.url(path)).value_or("(failed)");
+		};
+		Fetch("/fresh");
+		Check("cache: max-age", Fetch("/fresh") == "fresh" && server.requests("/fresh").size() == 1);
+		Fetch("/aged");
+		Check("cache: age", Fetch("/aged") == "aged" && server.requests("/aged").size() == 2);
+		Fetch("/expired");
+		Check("cache: expires", Fetch("/expired") == "expired" && server.requests("/expired").size() == 2);
+		Fetch("/etag");
+		bool ok = Fetch("/etag") == "etag";
+		auto etag = server.requests("/etag");
+		Check("cache: if-none-match", ok && etag.size() == 2 && header_value(etag[0].head, "If-None-Match").empty() && header_value(etag[1].head, "If-None-Match") == "\"v1\"");
+		Fetch("/drop");
+		Fetch("/drop");
+		Fetch("/drop");
+		auto dropped = server.requests("/drop");
+		Check("cache: no-store drops entry", dropped.size() == 3 && header_value(dropped[1].head, "If-None-Match") == "\"v1\"" && header_value(dropped[2].head, "If-None-Match").empty());
+		Check("cache: error", !cache.fetch(server.url("/none")));
+		bool truncated = !cache.fetch(server.url("/short")) && !cache.fetch(server.url("/short"));
+		Check("cache: truncated body", truncated && server.requests("/short").size() == 2); // 保存しない
+		auto results = WebClient::fetch_all(WebContext::shared(), {WebClient::Request(server.url("/short"))});
+		Check("fetch_all: truncated body", results.size() == 1 && !results[0].ok);
+
+		std::string cache_dir = dir + "/http";
+		HttpCache(cache_dir).fetch(server.url("/fresh"));
+		HttpCache disk(cache_dir);
+		ok = disk.fetch(server.url("/fresh")) == std::optional<std::string>("fresh");
+		Check("cache: directory", ok && server.requests("/fresh").size() == 2);
+		remove_directory(cache_dir);
+	}
+
+	remove_directory(dir);
+}
@@ -0,0 +1,8 @@
+#ifndef NETTEST_H
+#define NETTEST_H
+
+#include "kakiage.h"
+
+void run_network_tests(kakiage const &engine, int *passed, int *failed);
+
+#endif // NETTEST_H
@@ -0,0 +1,229 @@
+#include "renderserver.h"
+#include "socketserver.h"
+#include "templatecache.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_FRAME_SIZE (256 * 1024 * 1024)
+#define OUTPUT_CHUNK_SIZE 65536
+
+namespace {
+
+bool read_all(int fd, char *ptr, size_t len)
+{
+	return SocketServer::read_all(fd, ptr, len);
+}
+
+bool write_all(int fd, char const *ptr, size_t len)
+{
+	return SocketServer::write_all(fd, ptr, len);
+}
+
+bool read_frame(int fd, std::string *out)
+{
+	unsigned char hdr[4];
+	if (!read_all(fd, (char *)hdr, 4)) return false;
+	uint32_t len = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+	if (len > MAX_FRAME_SIZE) return false;
+	out->resize(len);
+	return len == 0 || read_all(fd, out->data(), len);
+}
+
+bool write_frame(int fd, char type, char const *ptr, size_t len)
+{
+	uint32_t n = (uint32_t)len + 1;
+	char hdr[5];
+	hdr[0] = char(n >> 24);
+	hdr[1] = char(n >> 16);
+	hdr[2] = char(n >> 8);
+	hdr[3] = char(n);
+	hdr[4] = type;
+	return write_all(fd, hdr, 5) && write_all(fd, ptr, len);
+}
+
+bool write_frame(int fd, char type, std::string const &s)
+{
+	return write_frame(fd, type, s.data(), s.size());
+}
+
+bool write_end(int fd)
+{
+	char hdr[4] = {};
+	return write_all(fd, hdr, 4);
+}
+
+} // namespace
+
+struct RenderServer::Private {
+	kakiage engine;
+	kakiage::Variables defines;
+	TemplateCache cache;
+	Private(kakiage const &engine, kakiage::Variables const &defines)
+		: engine(engine)
+		, defines(defines)
+		, cache(&this->engine)
+	{
+	}
+};
+
+RenderServer::RenderServer(kakiage const &engine, kakiage::Variables const &defines)
+	: m(new Private(engine, defines))
+{
+	m->engine.dependencies = nullptr;
+}
+
+RenderServer::~RenderServer()
+{
+	delete m;
+}
+
+/**
+ * @brief 要求を1つ処理する
+ * @param fd ソケット
+ * @return 接続を続けるなら true
+ */
+bool RenderServer::serve(int fd)
+{
+	RenderRequest req;
+	std::string frame;
+	while (1) {
+		if (!read_frame(fd, &frame)) return false;
+		if (frame.empty()) break;
+		char type = frame[0];
+		std::string_view data(frame.data() + 1, frame.size() - 1);
+		if (type == 'F') {
+			req.path = data;
+		} else if (type == 'S') {
+			req.source = data;
+		} else if (type == 'D') {
+			size_t i = data.find('=');
+			if (i != std::string_view::npos) {
+				kakiage::define_variable(&req.variables, std::string(data.substr(0, i)), std::string(data.substr(i + 1)));
+			}
+		} else if (type == 'H') {
+			req.html = true;
+		}
+	}
+
+	TemplateCache::TemplatePtr tmpl;
+	if (!req.path.empty()) {
+		tmpl = m->cache.load(req.path);
+		if (!tmpl) {
+			return write_frame(fd, 'E', "Failed to open input file: " + req.path) && write_end(fd);
+		}
+	} else {
+		tmpl = m->cache.compile(req.source);
+	}
+
+	kakiage engine = m->engine; // ワーカーごとに状態を持つので複製する
+	engine.set_html_mode(req.html);
+	std::string result;
+	if (req.variables.empty()) {
+		result = engine.render(*tmpl, m->defines);
+	} else {
+		kakiage::Variables map = m->defines; // 数値への変換結果も引き継ぐ
+		for (auto const &[name, value] : req.variables) {
+			map[name] = value;
+		}
+		result = engine.render(*tmpl, map);
+	}
+
+	for (size_t i = 0; i < result.size(); i += OUTPUT_CHUNK_SIZE) {
+		size_t n = std::min(result.size() - i, (size_t)OUTPUT_CHUNK_SIZE);
+		if (!write_frame(fd, 'O', result.data() + i, n)) return false;
+	}
+	return write_frame(fd, 'E', std::string()) && write_end(fd);
+}
+
+/**
+ * @brief ソケットで待ち受けて要求を処理する
+ * @param socket_path ソケットのパス
+ * @param threads ワーカースレッド数（0 ならハードウェアのスレッド数）
+ * @return 終了コード
+ *
+ * SIGINT または SIGTERM を受け取ると、処理中の要求を終えてから戻る。
+ */
+int RenderServer::run(std::string const &socket_path, int threads)
+{
+	int sock = SocketServer::listen(socket_path);
+	if (sock < 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", socket_path.c_str(), strerror(errno));
+		return 1;
+	}
+	int r = SocketServer::run(sock, threads, [this](int fd){
+		return serve(fd);
+	});
+	unlink(socket_path.c_str());
+	return r;
+}
+
+/**
+ * @brief サーバーにレンダリングを依頼する
+ * @param socket_path ソケットのパス
+ * @param req 要求
+ * @param out 出力を受け取る関数。受信したものから順に呼ばれる
+ * @param error エラーメッセージ
+ * @return 接続できなければ ConnectionFailed
+ */
+RenderClient::Result RenderClient::render(std::string const &socket_path, RenderRequest const &req, std::function<void (char const *ptr, size_t len)> const &out, std::string *error)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		*error = "socket path too long";
+		return ConnectionFailed;
+	}
+	strcpy(addr.sun_path, socket_path.c_str());
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		*error = strerror(errno);
+		return ConnectionFailed;
+	}
+	if (connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0) {
+		*error = strerror(errno);
+		::close(sock);
+		return ConnectionFailed;
+	}
+
+	Result result = Failed;
+	bool ok = true;
+	if (!req.path.empty()) {
+		ok = ok && write_frame(sock, 'F', req.path);
+	} else {
+		ok = ok && write_frame(sock, 'S', req.source);
+	}
+	for (auto const &[name, value] : req.variables) {
+		if (value.is_list()) {
+			for (size_t i = 0; i < value.item_count(); i++) {
+				ok = ok && write_frame(sock, 'D', name + "[]=" + value.item(i)->text());
+			}
+		} else {
+			ok = ok && write_frame(sock, 'D', name + '=' + value.text());
+		}
+	}
+	if (req.html) {
+		ok = ok && write_frame(sock, 'H', std::string());
+	}
+	ok = ok && write_end(sock);
+
+	std::string frame;
+	while (ok && read_frame(sock, &frame)) {
+		if (frame.empty()) break;
+		if (frame[0] == 'O') {
+			out(frame.data() + 1, frame.size() - 1);
+		} else if (frame[0] == 'E') {
+			*error = frame.substr(1);
+			result = error->empty() ? Success : Failed;
+		}
+	}
+	if (result == Failed && error->empty()) {
+		*error = "connection closed";
+	}
+	::close(sock);
+	return result;
+}
@@ -0,0 +1,58 @@
+#ifndef RENDERSERVER_H
+#define RENDERSERVER_H
+
+#include "kakiage.h"
+#include <functional>
+#include <map>
+#include <string>
+
+// Unix ドメインソケットで待ち受けるレンダリングサーバー
+//
+// 1つの接続で複数の要求を順に送ることができる。
+//
+// フレームは 4 バイトのビッグエンディアンの長さと、その長さのデータからなる。
+// データの先頭 1 バイトが種類を表す。
+//
+// 要求（長さ 0 のフレームで終わる）:
+//   'F' <テンプレートファイルのパス>
+//   'S' <テンプレートテキスト>
+//   'D' <name>=<value>     定義の上書き。リストは要素ごとに <name>[]=<value>
+//   'H'                    HTML モード
+// 応答:
+//   'O' <出力>             0 個以上
+//   'E' <エラーメッセージ> 最後に 1 個。成功なら空
+
+/**
+ * @brief レンダリング要求
+ */
+struct RenderRequest {
+	std::string path; // テンプレートファイル
+	std::string source; // path が空ならこちらを使う
+	kakiage::Variables variables; // 上書きする定義
+	bool html = false;
+};
+
+class RenderServer {
+private:
+	struct Private;
+	Private *m;
+	bool serve(int fd);
+public:
+	RenderServer(kakiage const &engine, kakiage::Variables const &defines);
+	~RenderServer();
+	RenderServer(RenderServer const &) = delete;
+	void operator = (RenderServer const &) = delete;
+	int run(std::string const &socket_path, int threads);
+};
+
+class RenderClient {
+public:
+	enum Result {
+		ConnectionFailed = -1,
+		Success = 0,
+		Failed = 1,
+	};
+	static Result render(std::string const &socket_path, RenderRequest const &req, std::function<void (char const *ptr, size_t len)> const &out, std::string *error);
+};
+
+#endif // RENDERSERVER_H
@@ -0,0 +1,215 @@
+#include "socketserver.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+std::atomic<bool> stop_requested = false;
+
+void on_signal(int)
+{
+	stop_requested = true;
+}
+
+} // namespace
+
+/**
+ * @brief 待ち受けソケットを作る
+ * @param address Unix ドメインソケットのパス（'/' を含む）、または [host]:port
+ * @return ソケット。失敗したら -1
+ */
+int SocketServer::listen(std::string const &address)
+{
+	if (address.find('/') != std::string::npos) {
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(addr.sun_path, address.c_str());
+		int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0) return -1;
+		struct stat st;
+		if (lstat(address.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+			unlink(address.c_str()); // 前回のソケットが残っている
+		}
+		if (bind(sock, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(sock, SOMAXCONN) != 0) {
+			int e = errno;
+			::close(sock);
+			errno = e;
+			return -1;
+		}
+		return sock;
+	}
+
+	std::string host;
+	std::string port = address;
+	size_t i = address.rfind(':');
+	if (i != std::string::npos) {
+		host = address.substr(0, i);
+		port = address.substr(i + 1);
+	}
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+		host = host.substr(1, host.size() - 2);
+	}
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	addrinfo *res = nullptr;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	int sock = -1;
+	for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0) continue;
+		int on = 1;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(sock, SOMAXCONN) == 0) {
+			break;
+		}
+		::close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+/**
+ * @brief 接続を受け付けて処理する
+ * @param sock 待ち受けソケット
+ * @param threads ワーカースレッド数（0 ならハードウェアのスレッド数）
+ * @param handler 要求を1つ処理する関数
+ * @return 終了コード
+ *
+ * SIGINT または SIGTERM を受け取ると、処理中の要求を終えてから戻る。
+ */
+int SocketServer::run(int sock, int threads, Handler const &handler)
+{
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction sa = {};
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0; // poll を中断させるため SA_RESTART は付けない
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	int wake[2]; // ワーカーから戻された接続を知らせる
+	if (pipe(wake) != 0) {
+		return 1;
+	}
+	fcntl(wake[0], F_SETFL, O_NONBLOCK);
+
+	std::mutex mutex;
+	std::vector<int> returned;
+	std::vector<int> idle;
+	int status = 0;
+	{
+		ThreadPool pool(threads);
+		std::vector<pollfd> fds;
+		while (!stop_requested) {
+			fds.clear();
+			fds.push_back({sock, POLLIN, 0});
+			fds.push_back({wake[0], POLLIN, 0});
+			for (int fd : idle) {
+				fds.push_back({fd, POLLIN, 0});
+			}
+			int n = poll(fds.data(), fds.size(), -1);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				fprintf(stderr, "poll failed: %s\n", strerror(errno));
+				status = 1;
+				break;
+			}
+			std::vector<int> ready;
+			if (fds[0].revents & POLLIN) {
+				int fd = accept(sock, nullptr, nullptr);
+				if (fd >= 0) {
+					ready.push_back(fd);
+				} else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+					fprintf(stderr, "accept failed: %s\n", strerror(errno));
+				}
+			}
+			if (fds[1].revents & POLLIN) {
+				char buf[256];
+				while (read(wake[0], buf, sizeof(buf)) > 0);
+				std::lock_guard lock(mutex);
+				idle.insert(idle.end(), returned.begin(), returned.end());
+				returned.clear();
+			}
+			for (size_t i = 2; i < fds.size(); i++) {
+				if (fds[i].revents) {
+					ready.push_back(fds[i].fd);
+					idle.erase(std::find(idle.begin(), idle.end(), fds[i].fd));
+				}
+			}
+			for (int fd : ready) {
+				pool.post([&, fd](){
+					if (handler(fd)) {
+						std::lock_guard lock(mutex);
+						returned.push_back(fd);
+						char c = 0;
+						(void)!write(wake[1], &c, 1);
+					} else {
+						::close(fd);
+					}
+				});
+			}
+		}
+		pool.wait();
+	}
+	for (int fd : idle) {
+		::close(fd);
+	}
+	for (int fd : returned) {
+		::close(fd);
+	}
+	::close(wake[0]);
+	::close(wake[1]);
+	::close(sock);
+	return status;
+}
+
+bool SocketServer::read_all(int fd, void *ptr, size_t len)
+{
+	char *p = (char *)ptr;
+	while (len > 0) {
+		ssize_t n = ::read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 1) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool SocketServer::write_all(int fd, void const *ptr, size_t len)
+{
+	char const *p = (char const *)ptr;
+	while (len > 0) {
+		ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 1) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
@@ -0,0 +1,26 @@
+#ifndef SOCKETSERVER_H
+#define SOCKETSERVER_H
+
+#include <functional>
+#include <string>
+
+/**
+ * @brief ソケットで待ち受けて、接続をワーカースレッドで処理する
+ *
+ * 要求を待っている接続はワーカーを占有せず、poll で監視する。
+ */
+class SocketServer {
+public:
+	/**
+	 * @brief 要求を1つ処理する関数
+	 * @return 接続を続けるなら true。false なら接続を閉じる
+	 */
+	using Handler = std::function<bool (int fd)>;
+
+	static int listen(std::string const &address);
+	static int run(int sock, int threads, Handler const &handler);
+	static bool read_all(int fd, void *ptr, size_t len);
+	static bool write_all(int fd, void const *ptr, size_t len);
+};
+
+#endif // SOCKETSERVER_H
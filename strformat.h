@@ -9,13 +9,18 @@
 // #define STRFORMAT_NO_FP
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <functional>
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <string_view>
 
@@ -197,7 +202,7 @@ struct NumberParser {
 	}
 };
 
-template <typename T> static inline T parse_number(char const *ptr, std::function<T(char const *p, int radix)> conv)
+template <typename T, typename Conv> static inline T parse_number(char const *ptr, Conv conv)
 {
 	NumberParser t(ptr);
 	T v = conv(t.p, t.radix);
@@ -267,81 +272,235 @@ template <typename T> static inline T num(std::string const &value, Option_ cons
 	return num<T>(value.data(), opt);
 }
 
-class string_formatter {
-public:
-	enum Flags {
-		Locale = 0x0001,
-	};
+/**
+ * @brief Text argument whose numeric conversions are parsed only once.
+ *
+ * Formats exactly like the same text passed as a string, but the number a
+ * conversion such as %d, %lx or %f reads from it is cached.  The cache may
+ * be filled from several threads at once; prepare() fills it up front.
+ */
+class text_arg {
 private:
-	struct Part {
-		Part *next;
-		int size;
-		char data[1];
-	};
-	struct PartList {
-		Part *head = nullptr;
-		Part *last = nullptr;
-	};
-	static Part *alloc_part(const char *data, int size)
+	std::string text_;
+	mutable std::atomic<unsigned> cached_{0};
+	mutable std::atomic<char> c_{0};
+	mutable std::atomic<int32_t> i32_{0};
+	mutable std::atomic<uint32_t> u32_{0};
+	mutable std::atomic<int64_t> i64_{0};
+	mutable std::atomic<uint64_t> u64_{0};
+#ifndef STRFORMAT_NO_FP
+	mutable std::atomic<double> f_{0};
+#endif
+	// a racing computation just stores the same result again
+	template <typename T> T cached(std::atomic<T> *slot, unsigned bit, Option_ const &opt) const
+	{
+		if (cached_.load(std::memory_order_acquire) & bit) {
+			return slot->load(std::memory_order_relaxed);
+		}
+		T v = num<T>(text_.c_str(), opt);
+		slot->store(v, std::memory_order_relaxed);
+		cached_.fetch_or(bit, std::memory_order_release);
+		return v;
+	}
+	void assign(text_arg const &r)
+	{
+		text_ = r.text_;
+		unsigned bits = r.cached_.load(std::memory_order_acquire);
+		c_.store(r.c_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		i32_.store(r.i32_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		u32_.store(r.u32_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		i64_.store(r.i64_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		u64_.store(r.u64_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+#ifndef STRFORMAT_NO_FP
+		f_.store(r.f_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+#endif
+		cached_.store(bits, std::memory_order_release);
+	}
+public:
+	text_arg() = default;
+	explicit text_arg(std::string text)
+		: text_(std::move(text))
 	{
-		Part *p = (Part *)new char[sizeof(Part) + size];
-		p->next = nullptr;
-		p->size = size;
-		memcpy(p->data, data, size);
-		p->data[size] = 0;
-		return p;
 	}
-	static Part *alloc_part(const char *begin, const char *end)
+	text_arg(text_arg const &r)
 	{
-		return alloc_part(begin, end - begin);
+		assign(r);
 	}
-	static Part *alloc_part(const char *str)
+	text_arg &operator = (text_arg const &r)
 	{
-		return alloc_part(str, strlen(str));
+		if (this != &r) assign(r);
+		return *this;
 	}
-	static Part *alloc_part(const std::string_view &str)
+	std::string const &text() const
 	{
-		return alloc_part(str.data(), (int)str.size());
+		return text_;
 	}
-	static void free_part(Part **p)
+	template <typename T> T number(Option_ const &opt) const
 	{
-		if (p && *p) {
-			delete[] *p;
-			*p = nullptr;
+		if constexpr (std::is_same_v<T, char>) return cached(&c_, 0x01, opt);
+		if constexpr (std::is_same_v<T, int32_t>) return cached(&i32_, 0x02, opt);
+		if constexpr (std::is_same_v<T, uint32_t>) return cached(&u32_, 0x04, opt);
+		if constexpr (std::is_same_v<T, int64_t>) return cached(&i64_, 0x08, opt);
+		if constexpr (std::is_same_v<T, uint64_t>) return cached(&u64_, 0x10, opt);
+#ifndef STRFORMAT_NO_FP
+		if constexpr (std::is_same_v<T, double>) {
+			if (opt.lc) return num<double>(text_.c_str(), opt); // locale-dependent: not cached
+			return cached(&f_, 0x20, opt);
 		}
+#endif
 	}
-	static void add_part(PartList *list, Part *part)
+	void prepare() const
 	{
-		if (part) {
-			if (!list->head) {
-				list->head = part;
+		Option_ opt;
+		number<char>(opt);
+		number<int32_t>(opt);
+		number<uint32_t>(opt);
+		number<int64_t>(opt);
+		number<uint64_t>(opt);
+#ifndef STRFORMAT_NO_FP
+		number<double>(opt);
+#endif
+	}
+};
+
+struct format_spec;
+template <size_t N> struct compiled_format;
+
+class string_formatter {
+	template <size_t N> friend struct compiled_format;
+public:
+	enum Flags {
+		Locale = 0x0001,
+	};
+private:
+	/**
+	 * @brief Contiguous output buffer.
+	 *
+	 * Formatted text is written straight into one buffer: a small inline
+	 * array that spills to the heap when it overflows, or the tail of a
+	 * caller-provided vector.  No allocation is made per argument.
+	 */
+	class Buffer {
+	private:
+		static constexpr size_t LOCAL_SIZE = 256;
+		char local_[LOCAL_SIZE];
+		std::unique_ptr<char[]> heap_;
+		char *data_ = local_;
+		size_t size_ = 0;
+		size_t capacity_ = LOCAL_SIZE;
+		std::vector<char> *target_ = nullptr;
+		size_t base_ = 0;
+		void grow(size_t need)
+		{
+			size_t cap = std::max(capacity_ * 2, need);
+			std::unique_ptr<char[]> p(new char[cap]);
+			memcpy(p.get(), data_, size_);
+			heap_ = std::move(p);
+			data_ = heap_.get();
+			capacity_ = cap;
+		}
+	public:
+		Buffer() = default;
+		Buffer(Buffer const &) = delete;
+		void operator = (Buffer const &) = delete;
+		void move_from(Buffer &r)
+		{
+			if (r.data_ == r.local_) {
+				memcpy(local_, r.local_, r.size_);
+				heap_.reset();
+				data_ = local_;
+				capacity_ = LOCAL_SIZE;
+			} else {
+				heap_ = std::move(r.heap_);
+				data_ = heap_.get();
+				capacity_ = r.capacity_;
 			}
-			if (list->last) {
-				list->last->next = part;
+			size_ = r.size_;
+			target_ = r.target_;
+			base_ = r.base_;
+			r.data_ = r.local_;
+			r.size_ = 0;
+			r.capacity_ = LOCAL_SIZE;
+			r.target_ = nullptr;
+			r.base_ = 0;
+		}
+		void set_target(std::vector<char> *target)
+		{
+			target_ = target;
+			base_ = target ? target->size() : 0;
+		}
+		void clear()
+		{
+			if (target_) {
+				target_->resize(base_);
 			}
-			list->last = part;
+			size_ = 0;
 		}
-	}
-	static void free_list(PartList *list)
-	{
-		Part *p = list->head;
-		while (p) {
-			Part *next = p->next;
-			free_part(&p);
-			p = next;
+		char *data()
+		{
+			return target_ ? target_->data() + base_ : data_;
 		}
-		list->head = nullptr;
-		list->last = nullptr;
-	}
-	static void add_chars(PartList *list, char c, int n)
-	{
-		Part *p = (Part *)new char[sizeof(Part) + n];
-		p->next = nullptr;
-		p->size = n;
-		memset(p->data, c, n);
-		p->data[n] = 0;
-		add_part(list, p);
-	}
+		size_t size() const
+		{
+			return target_ ? target_->size() - base_ : size_;
+		}
+		char *extend(size_t n)
+		{
+			if (target_) {
+				size_t pos = target_->size();
+				target_->resize(pos + n);
+				return target_->data() + pos;
+			}
+			if (size_ + n > capacity_) {
+				grow(size_ + n);
+			}
+			char *p = data_ + size_;
+			size_ += n;
+			return p;
+		}
+		void write(char const *ptr, size_t len)
+		{
+			if (len > 0) {
+				memcpy(extend(len), ptr, len);
+			}
+		}
+		void write(char const *begin, char const *end)
+		{
+			write(begin, end - begin);
+		}
+		void write(char const *str)
+		{
+			write(str, strlen(str));
+		}
+		/**
+		 * @brief Shrink to `n` bytes.
+		 */
+		void truncate(size_t n)
+		{
+			if (target_) {
+				target_->resize(base_ + n);
+			} else {
+				size_ = n;
+			}
+		}
+		void fill(char c, size_t n)
+		{
+			if (n > 0) {
+				memset(extend(n), c, n);
+			}
+		}
+		/**
+		 * @brief Insert `n` copies of `c` at offset `pos`, shifting the tail.
+		 */
+		void insert_fill(size_t pos, char c, size_t n)
+		{
+			size_t len = size() - pos;
+			extend(n);
+			char *p = data() + pos;
+			memmove(p + n, p, len);
+			memset(p, c, n);
+		}
+	};
 	//
 	static char const *digits_lower()
 	{
@@ -353,332 +512,303 @@ private:
 	}
 	//
 #ifndef STRFORMAT_NO_FP
-	Part *format_double(double val, int precision, bool trim_zeros, bool plus)
+	/**
+	 * @brief Write `val` in fixed notation with `precision` fractional digits.
+	 *
+	 * Rounded correctly from the exact binary value, like printf("%.*f").
+	 * The decimal point is always '.'.
+	 *
+	 * @return End of the written text, or nullptr if it does not fit.
+	 */
+	static char *fixed_chars(char *first, char *last, double val, int precision)
 	{
-		if (std::isnan(val)) return alloc_part("#NAN");
-		if (std::isinf(val)) return alloc_part("#INF");
-
-		char *ptr, *end;
-
-		char *dot = nullptr;
-
-		bool sign = val < 0;
-		if (sign) {
-			val = -val;
+#ifdef __cpp_lib_to_chars
+		auto r = std::to_chars(first, last, val, std::chars_format::fixed, precision);
+		return r.ec == std::errc() ? r.ptr : nullptr;
+#else
+		int n = snprintf(first, last - first, "%.*f", precision, val);
+		if (n < 0 || n >= last - first) return nullptr;
+		return normalize_point(first, first + n);
+#endif
+	}
+	/**
+	 * @brief Write the shortest fixed-notation text that reads back as `val`.
+	 *
+	 * @return End of the written text, or nullptr if it does not fit.
+	 */
+	static char *shortest_chars(char *first, char *last, double val)
+	{
+#ifdef __cpp_lib_to_chars
+		auto r = std::to_chars(first, last, val, std::chars_format::fixed);
+		return r.ec == std::errc() ? r.ptr : nullptr;
+#else
+		// Find the fewest significant digits that round-trip, then lay
+		// them out without an exponent.
+		char tmp[40];
+		for (int p = 1; p <= 17; p++) {
+			snprintf(tmp, sizeof tmp, "%.*e", p - 1, val);
+			if (p == 17 || strtod(tmp, nullptr) == val) break;
 		}
-
-		double intval = floor(val);
-		val -= intval;
-
-		int intlen = 0;
-		if (intval == 0) {
-			ptr = end = (char *)alloca(precision + 10) + 5;
-		} else {
-			double t = intval;
-			do {
-				t = floor(t / 10);
-				intlen++;
-			} while (t != 0);
-			ptr = end = (char *)alloca(intlen + precision + 10) + intlen + 5;
-		}
-
-		if (precision > 0) {
-			dot = end;
-			*end++ = decimal_point();
-			double v = val;
-			int e = 0;
-			while (v > 0 && v < 1) {
-				v *= 10;
-				e++;
-			}
-			while (v >= 1) {
-				v /= 10;
-				e--;
-			}
-			double add = 0.5;
-			for (int i = 0; i < precision - e; i++) {
-				add /= 10;
-			}
-			v += add;
-			double t = floor(v);
-			intval += t;
-			v -= t;
-			int i = 0;
-			int n = intlen;
-			int r = std::min(e, precision);
-			while (i < r) {
-				*end++ = '0';
-				if (n != 0) {
-					n++;
-				}
-				i++;
-			}
-			while (i < precision) {
-				if (n < 16) {
-					v *= 10;
-					double m = floor(v);
-					v -= m;
-					*end++ = (char)m + '0';
-				} else {
-					*end++ = '0';
-				}
-				n++;
-				i++;
-			}
-		} else {
-			intval += floor(val + 0.5);
+		char digits[20];
+		int ndigits = 0;
+		bool sign = false;
+		char const *s = tmp;
+		if (*s == '-') {
+			sign = true;
+			s++;
 		}
-
-		intlen = 0;
-		double t = intval;
-		do {
-			t = floor(t / 10);
-			intlen++;
-		} while (t != 0);
-
-		if (intval == 0) {
-			*--ptr = '0';
-		} else {
-			double t = intval;
-			for (int i = 0; i < intlen; i++) {
-				t /= 10;
-				double u = floor(t);
-				*--ptr = (char)((t - u) * 10 + 0.49) + '0';
-				t = u;
+		for (; *s && *s != 'e'; s++) {
+			if (isdigit((unsigned char)*s)) {
+				digits[ndigits++] = *s;
 			}
 		}
-
-		if (sign) {
-			*--ptr = '-';
-		} else if (plus) {
-			*--ptr = '+';
+		int exp = *s == 'e' ? atoi(s + 1) : 0;
+		while (ndigits > 1 && digits[ndigits - 1] == '0') {
+			ndigits--;
 		}
-
-		if (trim_zeros && dot) {
-			while (dot < end) {
-				char c = end[-1];
-				if (c == '.') {
-					end--;
-					break;
-				}
-				if (c != '0') {
-					break;
-				}
-				end--;
+		size_t need = 4 + ndigits + (exp < 0 ? -exp : exp);
+		if ((size_t)(last - first) < need) return nullptr;
+		char *d = first;
+		if (sign) *d++ = '-';
+		if (exp < 0) {
+			*d++ = '0';
+			*d++ = '.';
+			for (int i = -1; i > exp; i--) *d++ = '0';
+			for (int i = 0; i < ndigits; i++) *d++ = digits[i];
+		} else {
+			for (int i = 0; i <= exp; i++) *d++ = i < ndigits ? digits[i] : '0';
+			if (ndigits > exp + 1) {
+				*d++ = '.';
+				for (int i = exp + 1; i < ndigits; i++) *d++ = digits[i];
 			}
 		}
-
-		return alloc_part(ptr, end);
-	}
+		return d;
 #endif
-	static Part *format_int32(int32_t val, bool force_sign)
-	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
-		if (val == 0) {
-			*--ptr = '0';
-		} else {
-			bool sign = (val < 0);
-			uint32_t v;
-			if (sign) {
-				v = (uint32_t)-val;
-			} else {
-				v = (uint32_t)val;;
-			}
-			while (v != 0) {
-				int c = v % 10 + '0';
-				v /= 10;
-				*--ptr = c;
-			}
-			if (sign) {
-				*--ptr = '-';
-			} else if (force_sign) {
-				*--ptr = '+';
-			}
+	}
+#ifndef __cpp_lib_to_chars
+	/**
+	 * @brief Replace the locale's decimal point that printf() wrote with '.'.
+	 */
+	static char *normalize_point(char *begin, char *end)
+	{
+		char *p = begin;
+		if (*p == '-') p++;
+		while (p < end && isdigit((unsigned char)*p)) p++;
+		if (p < end) {
+			char *q = p + 1;
+			while (q < end && !isdigit((unsigned char)*q)) q++;
+			*p++ = '.';
+			memmove(p, q, end - q);
+			end -= q - p;
 		}
-
-		return alloc_part(ptr, end);
+		return end;
 	}
-	static Part *format_uint32(uint32_t val)
+#endif
+	/**
+	 * @brief Format a double.
+	 *
+	 * @param precision Number of fractional digits, or negative for the
+	 *                  shortest text that reads back as the same value.
+	 * @param trim_zeros Drop trailing zeros (and a bare decimal point).
+	 * @param plus Prefix non-negative values with '+'.
+	 */
+	void format_double(double val, int precision, bool trim_zeros, bool plus)
 	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
+		if (std::isnan(val)) return buf.write("#NAN");
+		if (std::isinf(val)) return buf.write("#INF");
 
 		if (val == 0) {
-			*--ptr = '0';
-		} else {
-			while (val != 0) {
-				int c = val % 10 + '0';
-				val /= 10;
-				*--ptr = c;
-			}
+			val = 0; // no sign on negative zero
+		}
+		if (plus && !(val < 0)) {
+			buf.write("+", 1);
 		}
 
-		return alloc_part(ptr, end);
-	}
-	static Part *format_int64(int64_t val, bool force_sign)
-	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
-		if (val == 0) {
-			*--ptr = '0';
+		size_t start = buf.size();
+		char tmp[64];
+		char *end = precision < 0 ? shortest_chars(tmp, tmp + sizeof tmp, val) : fixed_chars(tmp, tmp + sizeof tmp, val, precision);
+		if (end) {
+			buf.write(tmp, end);
 		} else {
-			if (val == (int64_t)1 << 63) {
-				*--ptr = '8';
-				val /= 10;
-			}
-			bool sign = (val < 0);
-			if (sign) val = -val;
+			// large magnitude or precision: format in place
+			size_t n = 352 + (precision < 0 ? 0 : precision);
+			char *p = buf.extend(n);
+			end = precision < 0 ? shortest_chars(p, p + n, val) : fixed_chars(p, p + n, val, precision);
+			buf.truncate(start + (end ? end - p : 0));
+		}
 
-			while (val != 0) {
-				int c = val % 10 + '0';
-				val /= 10;
-				*--ptr = c;
+		char *begin = buf.data() + start;
+		end = buf.data() + buf.size();
+		char *dot = (char *)memchr(begin, '.', end - begin);
+		if (dot) {
+			if (trim_zeros) {
+				while (end[-1] == '0') end--;
+				if (end[-1] == '.') end--;
+				buf.truncate(end - buf.data());
 			}
-			if (sign) {
-				*--ptr = '-';
-			} else if (force_sign) {
-				*--ptr = '+';
+			if (dot < end) {
+				*dot = decimal_point();
 			}
 		}
-
-		return alloc_part(ptr, end);
 	}
-	static Part *format_uint64(uint64_t val)
-	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
-		if (val == 0) {
-			*--ptr = '0';
-		} else {
-			while (val != 0) {
-				int c = val % 10 + '0';
-				val /= 10;
-				*--ptr = c;
-			}
+#endif
+	/**
+	 * @brief "00" "01" ... "99": two decimal digits per lookup.
+	 */
+	static char const *digit_pairs()
+	{
+		return
+			"00010203040506070809"
+			"10111213141516171819"
+			"20212223242526272829"
+			"30313233343536373839"
+			"40414243444546474849"
+			"50515253545556575859"
+			"60616263646566676869"
+			"70717273747576777879"
+			"80818283848586878889"
+			"90919293949596979899";
+	}
+	template <typename T> static int count_digits(T v)
+	{
+		int n = 1;
+		while (1) {
+			if (v < 10) return n;
+			if (v < 100) return n + 1;
+			if (v < 1000) return n + 2;
+			if (v < 10000) return n + 3;
+			v /= 10000;
+			n += 4;
 		}
-
-		return alloc_part(ptr, end);
 	}
-	static Part *format_oct32(uint32_t val)
+	static int bit_width(uint64_t v)
 	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
-		char const *digits = digits_lower();
-
-		if (val == 0) {
-			*--ptr = '0';
+#if defined(__GNUC__) || defined(__clang__)
+		return v ? 64 - __builtin_clzll(v) : 0;
+#else
+		int n = 0;
+		while (v) {
+			v >>= 1;
+			n++;
+		}
+		return n;
+#endif
+	}
+	/**
+	 * @brief Write the decimal digits of `v` so that they end at `end`.
+	 */
+	template <typename T> static void write_decimal(char *end, T v)
+	{
+		char const *pairs = digit_pairs();
+		while (v >= 100) {
+			unsigned i = (unsigned)(v % 100) * 2;
+			v /= 100;
+			end -= 2;
+			memcpy(end, pairs + i, 2);
+		}
+		if (v >= 10) {
+			end -= 2;
+			memcpy(end, pairs + (unsigned)v * 2, 2);
 		} else {
-			while (val != 0) {
-				char c = digits[val & 7];
-				val >>= 3;
-				*--ptr = c;
-			}
+			*--end = (char)('0' + v);
 		}
-
-		return alloc_part(ptr, end);
 	}
-	static Part *format_oct64(uint64_t val)
-	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
-		char const *digits = digits_lower();
-
-		if (val == 0) {
-			*--ptr = '0';
+	/**
+	 * @brief Reserve room for a `len`-character number and its right-aligned padding.
+	 *
+	 * The padding and `sign` (0 for none) are written at once; the returned
+	 * pointer is where the digits go.  Left-aligned padding is left to pad().
+	 */
+	char *number_field(int len, char sign)
+	{
+		int total = len + (sign ? 1 : 0);
+		int padlen = q.align_left ? 0 : std::max(q.width - total, 0);
+		char *p = buf.extend(padlen + total);
+		if (q.zero_padding) {
+			if (sign) *p++ = sign;
+			memset(p, '0', padlen);
+			p += padlen;
 		} else {
-			while (val != 0) {
-				char c = digits[val & 7];
-				val >>= 3;
-				*--ptr = c;
-			}
+			memset(p, ' ', padlen);
+			p += padlen;
+			if (sign) *p++ = sign;
 		}
-
-		return alloc_part(ptr, end);
+		return p;
 	}
-	static Part *format_hex32(uint32_t val, bool upper)
+	template <typename T> void format_decimal(T v, char sign)
+	{
+		int n = count_digits(v);
+		write_decimal(number_field(n, sign) + n, v);
+	}
+	template <typename T> void format_radix(T v, int shift, bool upper)
 	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
 		char const *digits = upper ? digits_upper() : digits_lower();
-
-		if (val == 0) {
-			*--ptr = '0';
+		unsigned mask = (1u << shift) - 1;
+		int n = std::max((bit_width(v) + shift - 1) / shift, 1);
+		char *end = number_field(n, 0) + n;
+		do {
+			*--end = digits[v & mask];
+			v >>= shift;
+		} while (v != 0);
+	}
+	void format_int32(int32_t val, bool force_sign)
+	{
+		if (val < 0) {
+			format_decimal(0 - (uint32_t)val, '-');
 		} else {
-			while (val != 0) {
-				char c = digits[val & 15];
-				val >>= 4;
-				*--ptr = c;
-			}
+			format_decimal((uint32_t)val, force_sign && val != 0 ? '+' : 0);
 		}
-
-		return alloc_part(ptr, end);
 	}
-	static Part *format_hex64(uint64_t val, bool upper)
+	void format_uint32(uint32_t val)
 	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
-		char const *digits = upper ? digits_upper() : digits_lower();
-
-		if (val == 0) {
-			*--ptr = '0';
+		format_decimal(val, 0);
+	}
+	void format_int64(int64_t val, bool force_sign)
+	{
+		if (val < 0) {
+			format_decimal(0 - (uint64_t)val, '-');
 		} else {
-			while (val != 0) {
-				char c = digits[val & 15];
-				val >>= 4;
-				*--ptr = c;
-			}
+			format_decimal((uint64_t)val, force_sign && val != 0 ? '+' : 0);
 		}
-
-		return alloc_part(ptr, end);
 	}
-	static Part *format_pointer(void *val)
+	void format_uint64(uint64_t val)
+	{
+		format_decimal(val, 0);
+	}
+	void format_oct32(uint32_t val)
+	{
+		format_radix(val, 3, false);
+	}
+	void format_oct64(uint64_t val)
 	{
-		int n = sizeof(uintptr_t) * 2 + 1;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
+		format_radix(val, 3, false);
+	}
+	void format_hex32(uint32_t val, bool upper)
+	{
+		format_radix(val, 4, upper);
+	}
+	void format_hex64(uint64_t val, bool upper)
+	{
+		format_radix(val, 4, upper);
+	}
+	void format_pointer(void *val)
+	{
+		char *ptr = buf.extend(sizeof(uintptr_t) * 2);
+		char *end = ptr + sizeof(uintptr_t) * 2;
 
 		char const *digits = digits_upper();
 
 		uintptr_t v = (uintptr_t)val;
-		for (int i = 0; i < (int)sizeof(uintptr_t) * 2; i++) {
-			char c = digits[v & 15];
+		while (ptr < end) {
+			*--end = digits[v & 15];
 			v >>= 4;
-			*--ptr = c;
 		}
-
-		return alloc_part(ptr, end);
 	}
 private:
 	struct Private {
 		std::string text;
 		char const *head;
 		char const *next;
-		PartList list;
 		bool upper : 1;
 		bool zero_padding : 1;
 		bool align_left : 1;
@@ -688,23 +818,26 @@ private:
 		int lflag;
 		Option_ opt;
 	} q;
+	Buffer buf;
 
-	void _init()
+	void clear()
 	{
-		q.list = {};
+		buf.clear();
 	}
-
-	void clear()
+	/**
+	 * @brief Re-point the parse cursors after `q.text` has been replaced or grown.
+	 */
+	void rebase(size_t head, size_t next)
 	{
-		free_list(&q.list);
+		q.head = q.text.data() + head;
+		q.next = q.text.data() + next;
 	}
 	bool advance(bool complete)
 	{
 		bool r = false;
 		auto Flush = [&](){
 			if (q.head < q.next) {
-				Part *p = alloc_part(q.head, q.next);
-				add_part(&q.list, p);
+				buf.write(q.head, q.next);
 				q.head = q.next;
 			}
 		};
@@ -729,17 +862,20 @@ private:
 		return r;
 	}
 #ifndef STRFORMAT_NO_FP
-	Part *format_f(double value, bool trim_zeros)
+	void format_f(double value, bool trim_zeros)
 	{
-		int pr = q.precision < 0 ? 6 : q.precision;
-		return format_double(value, pr, trim_zeros, q.plus);
+		int pr = q.precision;
+		if (pr < 0 && !trim_zeros) {
+			pr = 6; // %f
+		}
+		format_double(value, pr, trim_zeros, q.plus); // %s without precision: shortest
 	}
 #endif
-	Part *format_c(char c)
+	void format_c(char c)
 	{
-		return alloc_part(&c, &c + 1);
+		buf.write(&c, 1);
 	}
-	Part *format_o32(uint32_t value, int hint)
+	void format_o32(uint32_t value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -752,9 +888,9 @@ private:
 #endif
 			}
 		}
-		return format_oct32(value);
+		format_oct32(value);
 	}
-	Part *format_o64(uint64_t value, int hint)
+	void format_o64(uint64_t value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -767,9 +903,9 @@ private:
 #endif
 			}
 		}
-		return format_oct64(value);
+		format_oct64(value);
 	}
-	Part *format_x32(uint32_t value, int hint)
+	void format_x32(uint32_t value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -782,9 +918,9 @@ private:
 #endif
 			}
 		}
-		return format_hex32(value, q.upper);
+		format_hex32(value, q.upper);
 	}
-	Part *format_x64(uint64_t value, int hint)
+	void format_x64(uint64_t value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -797,14 +933,14 @@ private:
 #endif
 			}
 		}
-		return format_hex64(value, q.upper);
+		format_hex64(value, q.upper);
 	}
-	Part *format(char c, int hint)
+	void format(char c, int hint)
 	{
-		return format((int32_t)c, hint);
+		format((int32_t)c, hint);
 	}
 #ifndef STRFORMAT_NO_FP
-	Part *format(double value, int hint)
+	void format(double value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -816,10 +952,10 @@ private:
 			case 's': return format_f(value, true);
 			}
 		}
-		return format_f(value, false);
+		format_f(value, false);
 	}
 #endif
-	Part *format(int32_t value, int hint)
+	void format(int32_t value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -832,9 +968,9 @@ private:
 #endif
 			}
 		}
-		return format_int32(value, q.plus);
+		format_int32(value, q.plus);
 	}
-	Part *format(uint32_t value, int hint)
+	void format(uint32_t value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -847,9 +983,9 @@ private:
 #endif
 			}
 		}
-		return format_uint32(value);
+		format_uint32(value);
 	}
-	Part *format(int64_t value, int hint)
+	void format(int64_t value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -862,9 +998,9 @@ private:
 #endif
 			}
 		}
-		return format_int64(value, q.plus);
+		format_int64(value, q.plus);
 	}
-	Part *format(uint64_t value, int hint)
+	void format(uint64_t value, int hint)
 	{
 		if (hint) {
 			switch (hint) {
@@ -877,12 +1013,12 @@ private:
 #endif
 			}
 		}
-		return format_uint64(value);
+		format_uint64(value);
 	}
-	Part *format(char const *value, int hint)
+	void format(char const *value, int hint)
 	{
 		if (!value) {
-			return alloc_part("(null)");
+			return buf.write("(null)");
 		}
 		if (hint) {
 			switch (hint) {
@@ -906,26 +1042,50 @@ private:
 #endif
 			}
 		}
-		return alloc_part(value, value + strlen(value));
+		buf.write(value);
 	}
-	Part *format(std::string_view const &value, int hint)
+	void format(std::string_view const &value, int hint)
 	{
 		if (hint == 's') {
-			return alloc_part(value);
+			return buf.write(value.data(), value.size());
+		}
+		format(value.data(), hint);
+	}
+	void format(text_arg const &value, int hint)
+	{
+		switch (hint) {
+		case 'c':
+			return format_c(value.number<char>(q.opt));
+		case 'd':
+			if (q.lflag == 0) {
+				return format(value.number<int32_t>(q.opt), 0);
+			} else {
+				return format(value.number<int64_t>(q.opt), 0);
+			}
+		case 'u': case 'o': case 'x':
+			if (q.lflag == 0) {
+				return format(value.number<uint32_t>(q.opt), hint);
+			} else {
+				return format(value.number<uint64_t>(q.opt), hint);
+			}
+#ifndef STRFORMAT_NO_FP
+		case 'f':
+			return format(value.number<double>(q.opt), hint);
+#endif
 		}
-		return format(value.data(), hint);
+		buf.write(value.text().data(), value.text().size());
 	}
-	Part *format(std::vector<char> const &value, int hint)
+	void format(std::vector<char> const &value, int hint)
 	{
 		std::string_view sv(value.data(), value.size());
 		if (hint == 's') {
-			return alloc_part(sv);
+			return buf.write(sv.data(), sv.size());
 		}
-		return format(sv, hint);
+		format(sv, hint);
 	}
-	Part *format_p(void *val)
+	void format_p(void *val)
 	{
-		return format_pointer(val);
+		format_pointer(val);
 	}
 	void reset_format_params()
 	{
@@ -937,7 +1097,32 @@ private:
 		q.precision = -1;
 		q.lflag = 0;
 	}
-	void format(std::function<Part *(int)> const &callback, int width, int precision)
+	/**
+	 * @brief Pad the argument written since `start` out to the field width.
+	 *
+	 * Right-aligned padding is inserted in front of the argument in place;
+	 * with zero padding a leading sign is moved ahead of the zeros.
+	 */
+	void pad(size_t start)
+	{
+		int len = (int)(buf.size() - start);
+		int padlen = q.width - len;
+		if (padlen <= 0) return;
+		if (q.align_left) {
+			buf.fill(' ', padlen);
+		} else if (q.zero_padding) {
+			char c = len > 0 ? buf.data()[start] : 0;
+			buf.insert_fill(start, '0', padlen);
+			if (c == '+' || c == '-') {
+				char *p = buf.data() + start;
+				p[0] = c;
+				p[padlen] = '0';
+			}
+		} else {
+			buf.insert_fill(start, ' ', padlen);
+		}
+	}
+	template <typename F> void format(F const &callback, int width, int precision)
 	{
 		if (advance(false)) {
 			if (*q.next == '%') {
@@ -996,51 +1181,22 @@ private:
 				q.next++;
 			}
 
-			Part *p = nullptr;
-
 			int c = (unsigned char)*q.next;
 			if (isupper(c)) {
 				q.upper = true;
 				c = tolower(c);
 			}
 			if (isalpha(c)) {
-				p = callback(c);
+				size_t start = buf.size();
+				callback(c);
 				q.next++;
-			}
-			if (p) {
-				int padlen = q.width - p->size;
-				if (padlen > 0 && !q.align_left) {
-					if (q.zero_padding) {
-						char c = p->data[0];
-						add_chars(&q.list, '0', padlen);
-						if (c == '+' || c == '-') {
-							q.list.last->data[0] = c;
-							p->data[0] = '0';
-						}
-					} else {
-						add_chars(&q.list, ' ', padlen);
-					}
-				}
-
-				add_part(&q.list, p);
-
-				if (padlen > 0 && q.align_left) {
-					add_chars(&q.list, ' ', padlen);
-				}
+				pad(start);
 			}
 
 			q.head = q.next;
 		}
 	}
-	int length()
-	{
-		advance(true);
-		int len = 0;
-		for (Part *p = q.list.head; p; p = p->next) {
-			len += p->size;
-		}
-		return len;
-	}
+	template <typename T> void format(format_spec const &spec, T const &value);
 #ifndef STRFORMAT_NO_LOCALE
 	void use_locale(bool use)
 	{
@@ -1057,20 +1213,25 @@ private:
 		use_locale(flags & Locale);
 #endif
 	}
+	void move_from(string_formatter &r)
+	{
+		size_t head = r.q.head - r.q.text.data();
+		size_t next = r.q.next - r.q.text.data();
+		q = r.q;
+		rebase(head, next);
+		buf.move_from(r.buf);
+	}
 public:
 	string_formatter(string_formatter const &) = delete;
 	void operator = (string_formatter const &) = delete;
 
 	string_formatter(string_formatter &&r)
 	{
-		q = r.q;
-		r._init();
+		move_from(r);
 	}
 	void operator = (string_formatter &&r)
 	{
-		clear();
-		q = r.q;
-		r._init();
+		move_from(r);
 	}
 
 	string_formatter(int flags = 0, std::string const &text = {})
@@ -1082,9 +1243,17 @@ public:
 	{
 		reset(0, text);
 	}
-	~string_formatter()
+
+	/**
+	 * @brief Format directly onto the end of `out`.
+	 *
+	 * Text already in `out` is left untouched; `str()` and friends return
+	 * only what this formatter appended.
+	 */
+	string_formatter(std::vector<char> *out, int flags = 0, std::string const &text = {})
 	{
-		clear();
+		buf.set_target(out);
+		reset(flags, text);
 	}
 
 	char decimal_point() const
@@ -1101,8 +1270,7 @@ public:
 	{
 		clear();
 		q.text = text;
-		q.head = q.text.data();
-		q.next = q.head;
+		rebase(0, 0);
 
 #ifndef STRFORMAT_NO_LOCALE
 		use_locale(flags & Locale);
@@ -1113,18 +1281,24 @@ public:
 
 	string_formatter &append(std::string const &s)
 	{
+		size_t head = q.head - q.text.data();
+		size_t next = q.next - q.text.data();
 		q.text += s;
+		rebase(head, next);
 		return *this;
 	}
 	string_formatter &append(char const *s)
 	{
+		size_t head = q.head - q.text.data();
+		size_t next = q.next - q.text.data();
 		q.text += s;
+		rebase(head, next);
 		return *this;
 	}
 
 	template <typename T> string_formatter &arg(T const &value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format(value, hint); }, width, precision);
+		format([&](int hint){ format(value, hint); }, width, precision);
 		return *this;
 	}
 #ifndef STRFORMAT_NO_FP
@@ -1155,22 +1329,22 @@ public:
 	}
 	string_formatter &o(int32_t value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format_o32(value, hint); }, width, precision);
+		format([&](int hint){ format_o32(value, hint); }, width, precision);
 		return *this;
 	}
 	string_formatter &lo(int64_t value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format_o64(value, hint); }, width, precision);
+		format([&](int hint){ format_o64(value, hint); }, width, precision);
 		return *this;
 	}
 	string_formatter &x(int32_t value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format_x32(value, hint); }, width, precision);
+		format([&](int hint){ format_x32(value, hint); }, width, precision);
 		return *this;
 	}
 	string_formatter &lx(int64_t value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format_x64(value, hint); }, width, precision);
+		format([&](int hint){ format_x64(value, hint); }, width, precision);
 		return *this;
 	}
 	string_formatter &s(char const *value, int width = -1, int precision = -1)
@@ -1183,7 +1357,7 @@ public:
 	}
 	string_formatter &p(void *value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ (void)hint; return format_p(value); }, width, precision);
+		format([&](int hint){ (void)hint; format_p(value); }, width, precision);
 		return *this;
 	}
 
@@ -1191,16 +1365,31 @@ public:
 	{
 		return arg(value, width, precision);
 	}
-	void render(std::function<void (char const *ptr, int len)> const &to)
+	/**
+	 * @brief Emit the text after the last argument.
+	 */
+	string_formatter &flush()
 	{
 		advance(true);
-		for (Part *p = q.list.head; p; p = p->next) {
-			to(p->data, p->size);
-		}
+		return *this;
+	}
+	int length()
+	{
+		advance(true);
+		return (int)buf.size();
+	}
+	char const *data()
+	{
+		advance(true);
+		return buf.data();
+	}
+	template <typename F> void render(F const &to)
+	{
+		advance(true);
+		to((char const *)buf.data(), (int)buf.size());
 	}
 	void vec(std::vector<char> *vec)
 	{
-		vec->reserve(vec->size() + length());
 		render([&](char const *ptr, int len){
 			vec->insert(vec->end(), ptr, ptr + len);
 		});
@@ -1227,21 +1416,8 @@ public:
 	}
 	std::string str()
 	{
-		int n = length();
-		char *p;
-		std::vector<char> tmp;
-		if (n < 4096) { // if smaller, use stack
-			p = (char *)alloca(n);
-		} else {
-			tmp.reserve(n); // if larger, use heap
-			p = tmp.data();
-		}
-		char *d = p;
-		render([&](char const *ptr, int len){
-			memcpy(d, ptr, len);
-			d += len;
-		});
-		return std::string(p, n);
+		advance(true);
+		return std::string(buf.data(), buf.size());
 	}
 	operator std::string ()
 	{
@@ -1249,9 +1425,279 @@ public:
 	}
 };
 
+/**
+ * @brief One conversion of a format string, parsed in advance.
+ */
+struct format_spec {
+	bool upper = false;
+	bool zero_padding = false;
+	bool align_left = false;
+	bool plus = false;
+	int width = -1;
+	int precision = -1;
+	int lflag = 0;
+	char conv = 0; // lower case: c d u o x f s p
+};
+
+template <typename T> void string_formatter::format(format_spec const &spec, T const &value)
+{
+	q.upper = spec.upper;
+	q.zero_padding = spec.zero_padding;
+	q.align_left = spec.align_left;
+	q.plus = spec.plus;
+	q.width = spec.width;
+	q.precision = spec.precision;
+	q.lflag = spec.lflag;
+	size_t start = buf.size();
+	if constexpr (std::is_pointer_v<T>) {
+		if (spec.conv == 'p') {
+			format_p((void *)value);
+			pad(start);
+			return;
+		}
+	}
+	if constexpr (!std::is_pointer_v<T> || std::is_same_v<T, char const *>) {
+		format(value, spec.conv);
+	}
+	pad(start);
+}
+
+/**
+ * @brief A format string split at compile time into literal runs and conversions.
+ *
+ * Build one with compile() from a string literal and use it through
+ * format<F>() / format_to<F>(), STRF_CT() or, with C++20, strf_ct<"...">().
+ * The argument count and kinds are checked when the call is compiled, and
+ * formatting is just literal copies plus conversions.
+ */
+template <size_t N> struct compiled_format {
+	struct Segment {
+		size_t offset = 0; // literal text in `text`
+		size_t size = 0;
+		bool has_arg = false; // followed by `spec`
+		format_spec spec;
+	};
+	char text[N] = {};
+	Segment segments[N] = {};
+	size_t count = 0;
+	size_t args = 0;
+	bool valid = true; // false if a '%' is not followed by a known conversion, or uses '*'
+
+	constexpr format_spec const &arg_spec(size_t index) const
+	{
+		size_t i = 0;
+		while (!segments[i].has_arg || index-- > 0) {
+			i++;
+		}
+		return segments[i].spec;
+	}
+
+	template <typename T> static constexpr bool accepts(char conv)
+	{
+		using U = std::decay_t<T>;
+		constexpr bool text = std::is_same_v<U, char const *> || std::is_same_v<U, char *> || std::is_same_v<U, std::string> || std::is_same_v<U, std::string_view> || std::is_same_v<U, std::vector<char>>;
+		constexpr bool number = std::is_arithmetic_v<U>;
+		if (conv == 'p') return std::is_pointer_v<U>;
+		return text || number;
+	}
+	template <typename... Args> constexpr bool accepts_all() const
+	{
+		size_t i = 0;
+		bool ok = true;
+		((ok = ok && accepts<Args>(arg_spec(i++).conv)), ...);
+		return ok;
+	}
+
+	template <typename T> static auto normalize(T const &value)
+	{
+		using U = std::decay_t<T>;
+		if constexpr (std::is_same_v<U, char> || std::is_same_v<U, double>) {
+			return value;
+		} else if constexpr (std::is_floating_point_v<U>) {
+			return (double)value;
+		} else if constexpr (std::is_integral_v<U>) {
+			if constexpr (std::is_signed_v<U> || std::is_same_v<U, bool>) {
+				if constexpr (sizeof(U) <= 4) return (int32_t)value; else return (int64_t)value;
+			} else {
+				if constexpr (sizeof(U) <= 4) return (uint32_t)value; else return (uint64_t)value;
+			}
+		} else if constexpr (std::is_same_v<U, std::string>) {
+			return std::string_view(value);
+		} else if constexpr (std::is_same_v<U, char *>) {
+			return (char const *)value;
+		} else {
+			return value;
+		}
+	}
+	void emit_literals(string_formatter &f, size_t &i) const
+	{
+		while (i < count) {
+			f.buf.write(text + segments[i].offset, segments[i].size);
+			if (segments[i].has_arg) break;
+			i++;
+		}
+	}
+	void emit(string_formatter &f, size_t i) const
+	{
+		emit_literals(f, i);
+	}
+	template <typename T, typename... Rest> void emit(string_formatter &f, size_t i, T const &value, Rest const &...rest) const
+	{
+		emit_literals(f, i);
+		f.format(segments[i].spec, normalize(value));
+		emit(f, i + 1, rest...);
+	}
+};
+
+/**
+ * @brief Parse a format string literal (same syntax as strf) at compile time.
+ */
+template <size_t N> constexpr compiled_format<N> compile(char const (&fmt)[N])
+{
+	compiled_format<N> r;
+	for (size_t i = 0; i < N; i++) {
+		r.text[i] = fmt[i];
+	}
+	auto IsDigit = [](char c){ return c >= '0' && c <= '9'; };
+	size_t len = N - 1;
+	size_t head = 0;
+	size_t next = 0;
+	while (next < len) {
+		if (fmt[next] != '%') {
+			next++;
+			continue;
+		}
+		auto &seg = r.segments[r.count++];
+		seg.offset = head;
+		if (next + 1 < len && fmt[next + 1] == '%') { // "%%": keep one '%' as literal
+			seg.size = next + 1 - head;
+			next += 2;
+			head = next;
+			continue;
+		}
+		seg.size = next - head;
+		next++;
+		format_spec &spec = seg.spec;
+		while (next < len && (fmt[next] == '0' || fmt[next] == '+' || fmt[next] == '-')) {
+			if (fmt[next] == '0') spec.zero_padding = true;
+			if (fmt[next] == '+') spec.plus = true;
+			if (fmt[next] == '-') spec.align_left = true;
+			next++;
+		}
+		auto GetNumber = [&](){
+			int value = -1;
+			if (next < len && fmt[next] == '*') {
+				r.valid = false; // the value would come from an argument, which compile() cannot pass
+				next++;
+			} else {
+				while (next < len && IsDigit(fmt[next])) {
+					value = (value < 0 ? 0 : value * 10) + (fmt[next] - '0');
+					next++;
+				}
+			}
+			return value;
+		};
+		spec.width = GetNumber();
+		if (next < len && fmt[next] == '.') {
+			next++;
+		}
+		spec.precision = GetNumber();
+		while (next < len && fmt[next] == 'l') {
+			spec.lflag++;
+			next++;
+		}
+		char c = next < len ? fmt[next] : 0;
+		if (c >= 'A' && c <= 'Z') {
+			spec.upper = true;
+			c = c - 'A' + 'a';
+		}
+		switch (c) {
+		case 'c': case 'd': case 'u': case 'o': case 'x': case 'f': case 's': case 'p':
+			spec.conv = c;
+			break;
+		default:
+			r.valid = false;
+			break;
+		}
+		seg.has_arg = true;
+		r.args++;
+		next++;
+		head = next;
+	}
+	if (head < len) {
+		auto &seg = r.segments[r.count++];
+		seg.offset = head;
+		seg.size = len - head;
+	}
+	return r;
+}
+
+template <auto const &F, typename... Args> void format_to(string_formatter *f, Args const &...args)
+{
+	static_assert(F.valid, "strf: '%' must be followed by one of c d u o x f s p, without '*' width or precision");
+	static_assert(F.args == sizeof...(Args), "strf: argument count does not match the format string");
+	static_assert(F.template accepts_all<Args...>(), "strf: argument kind does not match its conversion");
+	F.emit(*f, 0, args...);
+}
+
+/**
+ * @brief Format with a compile()d format string.
+ *
+ *   static constexpr auto fmt = strformat_ns::compile("%s: %5d");
+ *   std::string s = strformat_ns::format<fmt>(name, count);
+ */
+template <auto const &F, typename... Args> std::string format(Args const &...args)
+{
+	string_formatter f;
+	format_to<F>(&f, args...);
+	return f.str();
+}
+
+/**
+ * @brief Append to `out` with a compile()d format string.
+ */
+template <auto const &F, typename... Args> void format_to(std::vector<char> *out, Args const &...args)
+{
+	string_formatter f(out);
+	format_to<F>(&f, args...);
+}
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+template <size_t N> struct fixed_string {
+	char data[N] = {};
+	constexpr fixed_string(char const (&s)[N])
+	{
+		for (size_t i = 0; i < N; i++) {
+			data[i] = s[i];
+		}
+	}
+};
+template <fixed_string S> inline constexpr auto compiled_literal = compile(S.data);
+#endif
+
 } // namespace strformat_ns
 
 // using strformat = strformat_ns::string_formatter;
 using strf = strformat_ns::string_formatter;
 
+/**
+ * @brief strf with a literal format string parsed at compile time.
+ *
+ *   std::string s = STRF_CT("%s: %5d", name, count);
+ */
+#define STRF_CT(FMT, ...) ([&](){ \
+	static constexpr auto strf_ct_format_ = ::strformat_ns::compile(FMT); \
+	return ::strformat_ns::format<strf_ct_format_>(__VA_ARGS__); \
+}())
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+/**
+ * @brief C++20: strf_ct<"%s: %5d">(name, count)
+ */
+template <strformat_ns::fixed_string S, typename... Args> std::string strf_ct(Args const &...args)
+{
+	return strformat_ns::format<strformat_ns::compiled_literal<S>>(args...);
+}
+#endif
+
 #endif // STRFORMAT_H
@@ -0,0 +1,117 @@
+// strformat micro-benchmark
+//   make bench
+
+#include "strformat.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace {
+
+std::vector<double> make_values()
+{
+	std::mt19937_64 rng(12345);
+	std::uniform_real_distribution<double> metric(0, 100000);
+	std::uniform_real_distribution<double> ratio(0, 1);
+	std::vector<double> v;
+	for (int i = 0; i < 4096; i++) {
+		v.push_back(i % 2 ? metric(rng) : ratio(rng)); // 応答時間や比率のような値
+	}
+	return v;
+}
+
+std::vector<int64_t> make_integers()
+{
+	std::mt19937_64 rng(12345);
+	std::vector<int64_t> v;
+	for (int i = 0; i < 4096; i++) {
+		v.push_back((int64_t)(rng() >> (rng() % 64)) * (i % 3 ? 1 : -1)); // 桁数をばらつかせる
+	}
+	return v;
+}
+
+template <typename T, typename F> void run(char const *name, std::vector<T> const &values, F fn)
+{
+	size_t const rounds = 200;
+	size_t sum = 0;
+	auto t0 = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < rounds; r++) {
+		for (T const &d : values) {
+			sum += fn(d);
+		}
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / (rounds * values.size());
+	printf("%-28s %8.1f ns/op  (%zu)\n", name, ns, sum);
+}
+
+} // namespace
+
+int main()
+{
+	std::vector<double> values = make_values();
+
+	run("strf %f", values, [](double d){
+		return strf("%f")(d).str().size();
+	});
+	run("snprintf %f", values, [](double d){
+		char tmp[64];
+		return (size_t)snprintf(tmp, sizeof tmp, "%f", d);
+	});
+	run("strf %.2f", values, [](double d){
+		return strf("%.2f")(d).str().size();
+	});
+	run("snprintf %.2f", values, [](double d){
+		char tmp[64];
+		return (size_t)snprintf(tmp, sizeof tmp, "%.2f", d);
+	});
+	run("strf %s (shortest)", values, [](double d){
+		return strf("%s")(d).str().size();
+	});
+	run("snprintf %.17g", values, [](double d){
+		char tmp[64];
+		return (size_t)snprintf(tmp, sizeof tmp, "%.17g", d);
+	});
+
+	std::vector<int64_t> integers = make_integers();
+
+	run("strf %d", integers, [](int64_t v){
+		return strf("%d")(v).str().size();
+	});
+	run("snprintf %lld", integers, [](int64_t v){
+		char tmp[64];
+		return (size_t)snprintf(tmp, sizeof tmp, "%lld", (long long)v);
+	});
+	run("strf %08x", integers, [](int64_t v){
+		return strf("%08x")((uint32_t)v).str().size();
+	});
+	run("strf 8 x %d", integers, [](int64_t v){
+		return strf("%d %d %d %d %d %d %d %d")(v)(v + 1)(v + 2)(v + 3)(v + 4)(v + 5)(v + 6)(v + 7).length();
+	});
+	run("STRF_CT 8 x %d", integers, [](int64_t v){
+		return STRF_CT("%d %d %d %d %d %d %d %d", v, v + 1, v + 2, v + 3, v + 4, v + 5, v + 6, v + 7).size();
+	});
+	run("snprintf 8 x %lld", integers, [](int64_t v){
+		char tmp[256];
+		long long x = v;
+		return (size_t)snprintf(tmp, sizeof tmp, "%lld %lld %lld %lld %lld %lld %lld %lld", x, x + 1, x + 2, x + 3, x + 4, x + 5, x + 6, x + 7);
+	});
+	run("STRF_CT %s: %5d", integers, [](int64_t v){
+		return STRF_CT("%s: %5d", "count", v).size();
+	});
+	run("strf %s: %5d", integers, [](int64_t v){
+		return strf("%s: %5d")("count")(v).str().size();
+	});
+	run("snprintf %08x", integers, [](int64_t v){
+		char tmp[64];
+		return (size_t)snprintf(tmp, sizeof tmp, "%08x", (uint32_t)v);
+	});
+	run("strf %d (into vector)", integers, [](int64_t v){
+		static std::vector<char> out;
+		out.clear();
+		strf(&out, 0, "id=%d")(v).flush();
+		return out.size();
+	});
+	return 0;
+}
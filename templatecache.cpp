@@ -0,0 +1,129 @@
+#include "templatecache.h"
+#include "fileutil.h"
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @brief テンプレートファイルを読み込んでコンパイルする
+ * @param path ファイルパス
+ * @return コンパイル済みテンプレート。読み込めなければ nullptr
+ */
+TemplateCache::TemplatePtr TemplateCache::load(std::string const &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		return {};
+	}
+#ifdef __linux__
+	int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	int64_t mtime = (int64_t)st.st_mtime;
+#endif
+	int64_t size = (int64_t)st.st_size;
+	{
+		std::lock_guard lock(mutex_);
+		auto it = map_.find(path);
+		if (it != map_.end() && it->second.mtime == mtime && it->second.size == size) {
+			return it->second.tmpl;
+		}
+	}
+	auto text = read_file(path);
+	if (!text) {
+		return {};
+	}
+	Entry e;
+	e.mtime = mtime;
+	e.size = size;
+	e.tmpl = compile(*text);
+	std::lock_guard lock(mutex_);
+	map_[path] = e;
+	return e.tmpl;
+}
+
+/**
+ * @brief テンプレートテキストをコンパイルする（キャッシュしない）
+ */
+TemplateCache::TemplatePtr TemplateCache::compile(std::string const &source) const
+{
+	return std::make_shared<kakiage::Template>(engine_->compile(source));
+}
+
+TemplateDiskCache::TemplateDiskCache(kakiage const *engine, std::string const &dir)
+	: engine_(engine)
+	, dir_(dir)
+{
+	while (dir_.size() > 1 && dir_.back() == '/') {
+		dir_.pop_back();
+	}
+}
+
+std::string TemplateDiskCache::path_of(std::string const &source) const
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/%016llx-%u.kt", (unsigned long long)kakiage::hash(source), (unsigned)kakiage::Template::IMAGE_VERSION);
+	return dir_ + name;
+}
+
+/**
+ * @brief テンプレートテキストをコンパイルする
+ * @param source テンプレートテキスト
+ * @return コンパイル済みテンプレート
+ *
+ * 保存されたイメージがあればそれを使う。なければコンパイルして保存する。
+ * 保存に失敗してもコンパイル結果は返す。
+ */
+TemplateDiskCache::TemplatePtr TemplateDiskCache::compile(std::string const &source) const
+{
+	std::string path = path_of(source);
+
+	auto Valid = [&](std::optional<kakiage::Template> const &t){
+		return t && t->source() == source; // ハッシュの衝突に備えて本文も比べる
+	};
+
+#ifdef _WIN32
+	if (auto image = read_file(path)) {
+		auto storage = std::make_shared<std::string>(std::move(*image));
+		auto t = kakiage::Template::from_image(storage, storage->data(), storage->size());
+		if (Valid(t)) {
+			return std::make_shared<kakiage::Template>(std::move(*t));
+		}
+	}
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd != -1) {
+		struct stat st;
+		void *addr = MAP_FAILED;
+		size_t size = 0;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			size = (size_t)st.st_size;
+			addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if (addr != MAP_FAILED) {
+			std::shared_ptr<void const> storage(addr, [size](void const *p){
+				munmap(const_cast<void *>(p), size);
+			});
+			auto t = kakiage::Template::from_image(storage, addr, size);
+			if (Valid(t)) {
+				return std::make_shared<kakiage::Template>(std::move(*t));
+			}
+		}
+	}
+#endif
+
+	auto tmpl = std::make_shared<kakiage::Template>(engine_->compile(source));
+
+	// 一時ファイルに書いてから置き換えるので、読み込み中のプロセスが壊れたイメージを見ることはない
+	make_directory(dir_);
+	write_file(path, tmpl->image());
+	return tmpl;
+}
@@ -0,0 +1,55 @@
+#ifndef TEMPLATECACHE_H
+#define TEMPLATECACHE_H
+
+#include "kakiage.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief コンパイル済みテンプレートのキャッシュ
+ *
+ * ファイルの更新日時と大きさが変わらない限り、コンパイル結果を使い回す。スレッドセーフ。
+ */
+class TemplateCache {
+public:
+	using TemplatePtr = std::shared_ptr<kakiage::Template const>;
+private:
+	struct Entry {
+		int64_t mtime = 0;
+		int64_t size = 0;
+		TemplatePtr tmpl;
+	};
+	kakiage const *engine_;
+	std::mutex mutex_;
+	std::map<std::string, Entry> map_;
+public:
+	TemplateCache(kakiage const *engine)
+		: engine_(engine)
+	{
+	}
+	TemplatePtr load(std::string const &path);
+	TemplatePtr compile(std::string const &source) const;
+};
+
+/**
+ * @brief コンパイル済みテンプレートをディレクトリに保存して、プロセス間で共有する
+ *
+ * 本文のハッシュとイメージの形式の版をファイル名にする。
+ * 本文が変わっていなければ、セグメントへの分割をせずにイメージをマップして使う。
+ * 条件式や #for などの事前解析の結果はイメージに含まないので、読み込むたびに作り直す。
+ */
+class TemplateDiskCache {
+public:
+	using TemplatePtr = TemplateCache::TemplatePtr;
+private:
+	kakiage const *engine_;
+	std::string dir_;
+	std::string path_of(std::string const &source) const;
+public:
+	TemplateDiskCache(kakiage const *engine, std::string const &dir);
+	TemplatePtr compile(std::string const &source) const;
+};
+
+#endif // TEMPLATECACHE_H
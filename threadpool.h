@@ -0,0 +1,97 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief 固定数のワーカースレッドでジョブを処理する
+ */
+class ThreadPool {
+private:
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::condition_variable space_;
+	std::deque<std::function<void ()>> queue_;
+	std::vector<std::thread> threads_;
+	size_t max_queue_ = 0;
+	bool stop_ = false;
+public:
+	/**
+	 * @param threads スレッド数（0 ならハードウェアのスレッド数）
+	 * @param max_queue 待ち行列の上限（0 なら無制限）。上限に達すると post が待つ
+	 */
+	ThreadPool(int threads = 0, size_t max_queue = 0)
+		: max_queue_(max_queue)
+	{
+		if (threads < 1) {
+			threads = (int)std::thread::hardware_concurrency();
+			if (threads < 1) {
+				threads = 1;
+			}
+		}
+		for (int i = 0; i < threads; i++) {
+			threads_.emplace_back([this](){
+				while (1) {
+					std::function<void ()> job;
+					{
+						std::unique_lock lock(mutex_);
+						cond_.wait(lock, [this](){ return stop_ || !queue_.empty(); });
+						if (queue_.empty()) break;
+						job = std::move(queue_.front());
+						queue_.pop_front();
+					}
+					space_.notify_one();
+					job();
+				}
+			});
+		}
+	}
+	~ThreadPool()
+	{
+		wait();
+	}
+	ThreadPool(ThreadPool const &) = delete;
+	void operator = (ThreadPool const &) = delete;
+
+	size_t size() const
+	{
+		return threads_.size();
+	}
+
+	void post(std::function<void ()> job)
+	{
+		{
+			std::unique_lock lock(mutex_);
+			if (max_queue_ > 0) {
+				space_.wait(lock, [this](){ return queue_.size() < max_queue_; });
+			}
+			queue_.push_back(std::move(job));
+		}
+		cond_.notify_one();
+	}
+
+	/**
+	 * @brief 残りのジョブをすべて処理してからスレッドを終了する
+	 */
+	void wait()
+	{
+		{
+			std::lock_guard lock(mutex_);
+			stop_ = true;
+		}
+		cond_.notify_all();
+		for (std::thread &t : threads_) {
+			if (t.joinable()) {
+				t.join();
+			}
+		}
+		threads_.clear();
+	}
+};
+
+#endif // THREADPOOL_H
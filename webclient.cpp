@@ -1,11 +1,23 @@
 
 #include "webclient.h"
+#include <cerrno>
+#include <climits>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <thread>
 
 #ifdef _WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
+#include <io.h>
 #pragma comment(lib, "ws2_32.lib")
 typedef SOCKET socket_t;
 #pragma warning(disable:4996)
@@ -17,6 +29,10 @@ typedef SOCKET socket_t;
 #include <netinet/in.h>
 #include <net/if.h>
 #include <netdb.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 #define closesocket(S) ::close(S)
 using socket_t = int;
 #define INVALID_SOCKET (-1)
@@ -77,52 +93,705 @@ std::string_view trimmed(const std::string_view &s)
 	return s.substr(i, j - i);
 }
 
-int x_stricmp(char const *s1, char const *s2)
+int x_strnicmp(char const *s1, char const *s2, size_t n)
 {
 #ifdef _WIN32
-	return ::stricmp(s1, s2);
+	return ::strnicmp(s1, s2, n);
 #else
-	return ::strcasecmp(s1, s2);
+	return ::strncasecmp(s1, s2, n);
 #endif
 }
 
-int x_strnicmp(char const *s1, char const *s2, size_t n)
+} // namespace
+
+namespace {
+
+/**
+ * @brief HostNameResolver が共有するキャッシュ
+ */
+struct ResolverCache {
+	using Clock = std::chrono::steady_clock;
+	struct Entry {
+		std::promise<HostNameResolver::Addresses> promise; // 問い合わせたスレッドが結果を設定する
+		std::shared_future<HostNameResolver::Addresses> result;
+		Clock::time_point expires = Clock::time_point::max(); // 問い合わせ中は期限なし
+		bool ready = false;
+	};
+	std::mutex mutex;
+	std::map<std::string, std::shared_ptr<Entry>> map;
+	std::chrono::seconds ttl{60};
+	std::chrono::seconds negative_ttl{5};
+	size_t max_entries = 256;
+
+	static ResolverCache &instance()
+	{
+		static ResolverCache *cache = new ResolverCache; // 終了時に他のスレッドが使っているかもしれないので破棄しない
+		return *cache;
+	}
+
+	/**
+	 * @brief キャッシュか問い合わせ中の結果を探す。無ければ問い合わせを登録する
+	 * @param owner 登録した場合は、問い合わせるべきエントリ
+	 */
+	std::shared_future<HostNameResolver::Addresses> find(std::string const &name, std::shared_ptr<Entry> *owner)
+	{
+		std::lock_guard lock(mutex);
+		auto now = Clock::now();
+		auto it = map.find(name);
+		if (it != map.end() && (!it->second->ready || now < it->second->expires)) {
+			return it->second->result;
+		}
+		auto e = std::make_shared<Entry>();
+		e->result = e->promise.get_future().share();
+		map[name] = e;
+		while (map.size() > max_entries) { // 期限が最も近いものから捨てる
+			auto oldest = map.end();
+			for (auto i = map.begin(); i != map.end(); i++) {
+				if (i->second->ready && (oldest == map.end() || i->second->expires < oldest->second->expires)) {
+					oldest = i;
+				}
+			}
+			if (oldest == map.end()) break;
+			map.erase(oldest);
+		}
+		*owner = e;
+		return e->result;
+	}
+
+	/**
+	 * @brief 問い合わせて、結果を待っている全員に渡す
+	 */
+	void resolve(std::string const &name, std::shared_ptr<Entry> const &e)
+	{
+		auto list = std::make_shared<std::vector<HostNameResolver::Address>>();
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo *res = nullptr;
+		if (getaddrinfo(name.c_str(), nullptr, &hints, &res) == 0) {
+			for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+				HostNameResolver::Address a;
+				if (ai->ai_family == AF_INET) {
+					memcpy(a.addr, &((sockaddr_in const *)ai->ai_addr)->sin_addr, 4);
+				} else if (ai->ai_family == AF_INET6) {
+					memcpy(a.addr, &((sockaddr_in6 const *)ai->ai_addr)->sin6_addr, 16);
+					a.scope_id = ((sockaddr_in6 const *)ai->ai_addr)->sin6_scope_id;
+				} else {
+					continue;
+				}
+				a.family = ai->ai_family;
+				list->push_back(a);
+			}
+			freeaddrinfo(res);
+		}
+		{
+			std::lock_guard lock(mutex);
+			e->expires = Clock::now() + (list->empty() ? negative_ttl : ttl);
+			e->ready = true;
+		}
+		e->promise.set_value(list);
+	}
+};
+
+} // namespace
+
+std::string HostNameResolver::Address::to_string() const
+{
+	char tmp[64] = {};
+	if (!inet_ntop(family, (void *)addr, tmp, sizeof(tmp))) return {};
+	return tmp;
+}
+
+/**
+ * @brief 名前を解決する。キャッシュになければ問い合わせる
+ * @return IPv4 と IPv6 のアドレス。getaddrinfo が返した順
+ */
+HostNameResolver::Addresses HostNameResolver::lookup(std::string const &name)
+{
+	ResolverCache &cache = ResolverCache::instance();
+	std::shared_ptr<ResolverCache::Entry> owner;
+	auto result = cache.find(name, &owner);
+	if (owner) {
+		cache.resolve(name, owner);
+	}
+	return result.get();
+}
+
+/**
+ * @brief 名前の解決を別のスレッドで始める
+ */
+std::shared_future<HostNameResolver::Addresses> HostNameResolver::lookup_async(std::string const &name)
+{
+	ResolverCache &cache = ResolverCache::instance();
+	std::shared_ptr<ResolverCache::Entry> owner;
+	auto result = cache.find(name, &owner);
+	if (owner) {
+		std::thread([name, owner](){
+			ResolverCache::instance().resolve(name, owner);
+		}).detach();
+	}
+	return result;
+}
+
+void HostNameResolver::set_ttl(int seconds, int negative_seconds)
+{
+	ResolverCache &cache = ResolverCache::instance();
+	std::lock_guard lock(cache.mutex);
+	cache.ttl = std::chrono::seconds(seconds);
+	cache.negative_ttl = std::chrono::seconds(negative_seconds);
+}
+
+void HostNameResolver::set_max_entries(size_t n)
+{
+	ResolverCache &cache = ResolverCache::instance();
+	std::lock_guard lock(cache.mutex);
+	cache.max_entries = std::max<size_t>(n, 1);
+}
+
+void HostNameResolver::clear()
+{
+	ResolverCache &cache = ResolverCache::instance();
+	std::lock_guard lock(cache.mutex);
+	cache.map.clear();
+}
+
+/**
+ * @brief 最初の IPv4 アドレスを求める
+ */
+bool HostNameResolver::resolve(const char *name, _in_addr *out)
+{
+	Addresses addrs = lookup(name);
+	for (Address const &a : *addrs) {
+		if (a.family == AF_INET) {
+			memcpy(out, a.addr, 4);
+			return true;
+		}
+	}
+	return false;
+}
+
+namespace {
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+int poll_sockets(pollfd *fds, size_t count, int timeout)
 {
 #ifdef _WIN32
-	return ::strnicmp(s1, s2, n);
+	return WSAPoll(fds, (ULONG)count, timeout);
 #else
-	return ::strncasecmp(s1, s2, n);
+	return poll(fds, (nfds_t)count, timeout);
 #endif
 }
 
-} // namespace
+void close_connection(socket_t sock, SSL *ssl)
+{
+#if USE_OPENSSL
+	if (ssl) {
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+	}
+#endif
+	if (sock != INVALID_SOCKET) {
+		shutdown(sock, 2); // SD_BOTH or SHUT_RDWR
+		closesocket(sock);
+	}
+}
 
-bool HostNameResolver::resolve(const char *name, _in_addr *out)
+/**
+ * @brief 待機中の接続がまだ使えるか調べる
+ *
+ * 待機中に読み込めるものがあれば、切断されたか余計なデータが届いている。
+ */
+bool is_idle_connection_usable(socket_t sock, SSL *ssl)
 {
-	struct hostent *he = nullptr;
-#if defined(_WIN32) || defined(__APPLE__)
-	he = ::gethostbyname(name);
+#if USE_OPENSSL
+	if (ssl && SSL_pending(ssl) > 0) return false;
 #else
-	int err = 0;
-	char buf[2048];
-	struct hostent tmp;
-	gethostbyname_r(name, &tmp, buf, sizeof(buf), &he, &err);
+	(void)ssl;
 #endif
-	if (!he) return false;
+	pollfd pfd = {};
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	return poll_sockets(&pfd, 1, 0) == 0;
+}
 
-	memcpy(out, he->h_addr, he->h_length);
-	return true;
+void set_nonblocking(socket_t sock, bool nonblocking)
+{
+#ifdef _WIN32
+	u_long mode = nonblocking ? 1 : 0;
+	ioctlsocket(sock, FIONBIO, &mode);
+#else
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+#endif
 }
 
+/**
+ * @brief ノンブロッキングのソケット操作が、完了を待つ必要があって失敗したか
+ */
+bool would_block()
+{
+#ifdef _WIN32
+	int e = WSAGetLastError();
+	return e == WSAEWOULDBLOCK || e == WSAEINPROGRESS || e == WSAEINTR;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS || errno == EINTR;
+#endif
+}
+
+/**
+ * @brief 期限。ミリ秒を指定しなければ（0 以下なら）無期限
+ */
+class Deadline {
+public:
+	using Clock = std::chrono::steady_clock;
+private:
+	Clock::time_point at_ = Clock::time_point::max();
+public:
+	Deadline() = default;
+	explicit Deadline(int ms)
+	{
+		if (ms > 0) {
+			at_ = Clock::now() + std::chrono::milliseconds(ms);
+		}
+	}
+	bool infinite() const
+	{
+		return at_ == Clock::time_point::max();
+	}
+	bool expired() const
+	{
+		return !infinite() && Clock::now() >= at_;
+	}
+	/**
+	 * @brief poll に渡す待ち時間。無期限なら -1
+	 */
+	int remaining_ms() const
+	{
+		if (infinite()) return -1;
+		auto ms = std::chrono::ceil<std::chrono::milliseconds>(at_ - Clock::now()).count();
+		return (int)std::clamp<long long>(ms, 0, INT_MAX);
+	}
+	Deadline earlier(Deadline const &other) const
+	{
+		return at_ <= other.at_ ? *this : other;
+	}
+};
+
+/**
+ * @brief poll の待ち時間のうち短い方。-1 は無期限
+ */
+int shorter_timeout(int a, int b)
+{
+	if (a < 0) return b;
+	if (b < 0) return a;
+	return std::min(a, b);
+}
+
+/**
+ * @brief 名前解決したすべてのアドレスに、Happy Eyeballs (RFC 8305) の要領で接続を試みる
+ *
+ * IPv6 と IPv4 のアドレスを交互に並べ、前の試行が ATTEMPT_DELAY 以内に終わらなければ次の試行も始める。
+ * 最初に繋がったものを使い、残りは閉じる。ソケットはノンブロッキングのまま返す。
+ */
+class Connector {
+public:
+	using Clock = std::chrono::steady_clock;
+	static constexpr std::chrono::milliseconds ATTEMPT_DELAY{250};
+private:
+	struct Address {
+		sockaddr_storage addr;
+		socklen_t len;
+	};
+	std::vector<Address> addresses_;
+	size_t next_ = 0;
+	std::vector<socket_t> attempts_;
+	Clock::time_point next_attempt_;
+	socket_t connected_ = INVALID_SOCKET;
+
+	void close_attempts()
+	{
+		for (socket_t s : attempts_) {
+			closesocket(s);
+		}
+		attempts_.clear();
+	}
+public:
+	Connector() = default;
+	Connector(Connector const &) = delete;
+	void operator = (Connector const &) = delete;
+	~Connector()
+	{
+		close_attempts();
+		if (connected_ != INVALID_SOCKET) {
+			closesocket(connected_);
+		}
+	}
+
+	bool resolve(std::string const &hostname, int port)
+	{
+		HostNameResolver::Addresses addrs = HostNameResolver::lookup(hostname);
+		std::vector<Address> first; // 最初に返ってきたアドレスファミリを優先する
+		std::vector<Address> second;
+		for (HostNameResolver::Address const &r : *addrs) {
+			Address a = {};
+			if (r.family == AF_INET) {
+				sockaddr_in *sin = (sockaddr_in *)&a.addr;
+				sin->sin_family = AF_INET;
+				sin->sin_port = htons(port);
+				memcpy(&sin->sin_addr, r.addr, 4);
+				a.len = sizeof(sockaddr_in);
+			} else {
+				sockaddr_in6 *sin6 = (sockaddr_in6 *)&a.addr;
+				sin6->sin6_family = AF_INET6;
+				sin6->sin6_port = htons(port);
+				memcpy(&sin6->sin6_addr, r.addr, 16);
+				sin6->sin6_scope_id = r.scope_id;
+				a.len = sizeof(sockaddr_in6);
+			}
+			(r.family == addrs->front().family ? first : second).push_back(a);
+		}
+		addresses_.clear();
+		for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+			if (i < first.size()) addresses_.push_back(first[i]);
+			if (i < second.size()) addresses_.push_back(second[i]);
+		}
+		return !addresses_.empty();
+	}
+
+	std::vector<socket_t> const &attempts() const
+	{
+		return attempts_;
+	}
+
+	bool connected() const
+	{
+		return connected_ != INVALID_SOCKET;
+	}
+
+	bool failed() const
+	{
+		return !connected() && attempts_.empty() && next_ >= addresses_.size();
+	}
+
+	socket_t take()
+	{
+		socket_t s = connected_;
+		connected_ = INVALID_SOCKET;
+		return s;
+	}
+
+	/**
+	 * @brief 次の試行を始めるまでの待ち時間。-1 ならもう始めるものはない
+	 */
+	int wait_ms(Clock::time_point now) const
+	{
+		if (next_ >= addresses_.size() || attempts_.empty()) return -1;
+		auto ms = std::chrono::ceil<std::chrono::milliseconds>(next_attempt_ - now).count();
+		return (int)std::max<long long>(ms, 0);
+	}
+
+	/**
+	 * @brief 試行の結果を調べて、必要なら次の試行を始める
+	 * @param fds attempts() と同じ順に並んだ poll の結果。無ければ nullptr
+	 */
+	void update(pollfd const *fds, Clock::time_point now)
+	{
+		if (fds) {
+			for (size_t i = attempts_.size(); i > 0; i--) {
+				if (!fds[i - 1].revents) continue;
+				socket_t s = attempts_[i - 1];
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(s, SOL_SOCKET, SO_ERROR, (char *)&err, &len);
+				if (err == 0 && connected_ == INVALID_SOCKET) {
+					connected_ = s;
+				} else {
+					closesocket(s);
+				}
+				attempts_.erase(attempts_.begin() + (i - 1));
+			}
+		}
+		// 前の試行が失敗したか、待ち時間を過ぎたら次のアドレスへ
+		while (connected_ == INVALID_SOCKET && next_ < addresses_.size() && (attempts_.empty() || now >= next_attempt_)) {
+			Address const &a = addresses_[next_++];
+			socket_t s = socket(a.addr.ss_family, SOCK_STREAM, 0);
+			if (s == INVALID_SOCKET) continue;
+			set_nonblocking(s, true);
+			if (connect(s, (sockaddr const *)&a.addr, a.len) == 0) {
+				connected_ = s;
+			} else if (would_block()) {
+				attempts_.push_back(s);
+				next_attempt_ = now + ATTEMPT_DELAY;
+			} else {
+				closesocket(s);
+			}
+		}
+		if (connected_ != INVALID_SOCKET) {
+			close_attempts();
+		}
+	}
+};
+
+/**
+ * @brief ソケットが読み書きできるようになるまで待つ
+ * @return 期限を過ぎたら false
+ */
+bool wait_socket(socket_t sock, short events, Deadline const &deadline)
+{
+	while (1) {
+		pollfd pfd = {};
+		pfd.fd = sock;
+		pfd.events = events;
+		int n = poll_sockets(&pfd, 1, deadline.remaining_ms());
+		if (n > 0) return true;
+		if (n == 0) return false;
+		if (!would_block()) return true; // エラーは続く読み書きで分かる
+	}
+}
+
+} // namespace
+
 struct WebContext::Private {
 	WebClient::HttpVersion http_version = WebClient::HTTP_1_0;
 	SSL_CTX *ctx = nullptr;
 	bool use_keep_alive = false;
 	WebProxy http_proxy;
 	WebProxy https_proxy;
-	bool broken_pipe = false;
+	WebClient::Timeouts timeouts; // 要求が指定しなかったときのタイムアウト
+	std::atomic<bool> broken_pipe = false;
+
+	/**
+	 * @brief 待機中の接続
+	 *
+	 * key は "http://host:port" または "https://host:port"（プロキシ経由なら " via proxy" を付ける）
+	 */
+	struct Connection {
+		std::string key;
+		socket_t sock = INVALID_SOCKET;
+		SSL *ssl = nullptr;
+		std::chrono::steady_clock::time_point idle_since;
+	};
+	std::mutex pool_mutex;
+	std::list<Connection> pool; // 新しいものが先頭
+	size_t max_idle_connections = 8;
+	std::chrono::seconds idle_timeout{30};
+
+	bool take_connection(std::string const &key, socket_t *sock, SSL **ssl);
+	void put_connection(std::string const &key, socket_t sock, SSL *ssl);
+	void clear_connections();
+
+#if USE_OPENSSL
+	std::mutex session_mutex;
+	std::map<std::string, SSL_SESSION *> sessions; // 接続先ごとの再開用セッション
+	std::atomic<uint64_t> full_handshakes = 0;
+	std::atomic<uint64_t> resumed_handshakes = 0;
+
+	SSL *new_ssl(std::string const &key, std::string const &hostname, socket_t sock);
+	void count_handshake(SSL *ssl);
+	void resume_session(std::string const &key, SSL *ssl);
+	void save_session(std::string const &key, SSL *ssl);
+	void clear_sessions();
+#endif
 };
 
+#if USE_OPENSSL
+static SSL_CTX *new_ssl_ctx()
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	SSL_CTX_set_default_verify_paths(ctx);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE); // セッションは WebContext が接続先ごとに持つ
+	return ctx;
+}
+
+/**
+ * @brief プロセス全体で共有する SSL_CTX
+ *
+ * 証明書ストアの読み込みは一度だけ行う。
+ */
+static SSL_CTX *shared_ssl_ctx()
+{
+	static SSL_CTX *ctx = [](){
+		SSL_load_error_strings();
+		SSL_library_init();
+		return new_ssl_ctx();
+	}();
+	return ctx;
+}
+
+static std::string ssl_error_string()
+{
+	char tmp[1000];
+	unsigned long e = ERR_get_error();
+	ERR_error_string_n(e, tmp, sizeof(tmp));
+	return tmp;
+}
+
+/**
+ * @brief 接続済みのソケットに TLS を設定する（ハンドシェイクはまだ行わない）
+ */
+SSL *WebContext::Private::new_ssl(std::string const &key, std::string const &hostname, socket_t sock)
+{
+	SSL *ssl = SSL_new(ctx);
+	if (!ssl) {
+		throw WebClient::Error(ssl_error_string());
+	}
+
+	SSL_set_options(ssl, SSL_OP_NO_SSLv2);
+	SSL_set_options(ssl, SSL_OP_NO_SSLv3);
+	SSL_set_hostflags(ssl, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+	if (!SSL_set1_host(ssl, hostname.c_str()) || !SSL_set_fd(ssl, sock)) {
+		std::string e = ssl_error_string();
+		SSL_free(ssl);
+		throw WebClient::Error(e);
+	}
+	SSL_set_tlsext_host_name(ssl, hostname.c_str());
+
+	RAND_poll();
+	while (RAND_status() == 0) {
+		unsigned short rand_ret = rand() % 65536;
+		RAND_seed(&rand_ret, sizeof(rand_ret));
+	}
+
+	resume_session(key, ssl);
+	return ssl;
+}
+
+void WebContext::Private::count_handshake(SSL *ssl)
+{
+	if (SSL_session_reused(ssl)) {
+		resumed_handshakes++;
+	} else {
+		full_handshakes++;
+	}
+}
+
+/**
+ * @brief 前回のセッションがあれば、再開するように設定する
+ */
+void WebContext::Private::resume_session(std::string const &key, SSL *ssl)
+{
+	SSL_SESSION *sess = nullptr;
+	{
+		std::lock_guard lock(session_mutex);
+		auto it = sessions.find(key);
+		if (it != sessions.end()) {
+			sess = it->second;
+			SSL_SESSION_up_ref(sess);
+		}
+	}
+	if (sess) {
+		SSL_set_session(ssl, sess);
+		SSL_SESSION_free(sess);
+	}
+}
+
+/**
+ * @brief 次の接続で再開できるように、セッションを保存する
+ *
+ * TLS 1.3 ではセッションチケットはハンドシェイクの後に届くので、応答を読み終えてから呼ぶ。
+ */
+void WebContext::Private::save_session(std::string const &key, SSL *ssl)
+{
+	SSL_SESSION *sess = SSL_get1_session(ssl);
+	if (!sess) return;
+	if (!SSL_SESSION_is_resumable(sess)) {
+		SSL_SESSION_free(sess);
+		return;
+	}
+	std::lock_guard lock(session_mutex);
+	SSL_SESSION *&slot = sessions[key];
+	if (slot) {
+		SSL_SESSION_free(slot);
+	}
+	slot = sess;
+}
+
+void WebContext::Private::clear_sessions()
+{
+	std::lock_guard lock(session_mutex);
+	for (auto &pair : sessions) {
+		SSL_SESSION_free(pair.second);
+	}
+	sessions.clear();
+}
+#endif
+
+/**
+ * @brief 待機中の接続を取り出す
+ * @return 使える接続があれば true
+ */
+bool WebContext::Private::take_connection(std::string const &key, socket_t *sock, SSL **ssl)
+{
+	std::list<Connection> expired;
+	bool found = false;
+	{
+		std::lock_guard lock(pool_mutex);
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = pool.begin(); it != pool.end();) {
+			auto next = std::next(it);
+			if (now - it->idle_since >= idle_timeout) {
+				expired.splice(expired.end(), pool, it);
+			} else if (!found && it->key == key) {
+				*sock = it->sock;
+				*ssl = it->ssl;
+				pool.erase(it);
+				found = true;
+			}
+			it = next;
+		}
+	}
+	for (Connection const &c : expired) {
+		close_connection(c.sock, c.ssl);
+	}
+	if (found && !is_idle_connection_usable(*sock, *ssl)) {
+		close_connection(*sock, *ssl);
+		*sock = INVALID_SOCKET;
+		*ssl = nullptr;
+		found = false;
+	}
+	return found;
+}
+
+/**
+ * @brief 接続を待機させる
+ *
+ * 上限を超えたら古いものから閉じる。
+ */
+void WebContext::Private::put_connection(std::string const &key, socket_t sock, SSL *ssl)
+{
+	std::list<Connection> evicted;
+	{
+		std::lock_guard lock(pool_mutex);
+		Connection c;
+		c.key = key;
+		c.sock = sock;
+		c.ssl = ssl;
+		c.idle_since = std::chrono::steady_clock::now();
+		pool.push_front(c);
+		while (pool.size() > max_idle_connections) {
+			evicted.splice(evicted.end(), pool, std::prev(pool.end()));
+		}
+	}
+	for (Connection const &c : evicted) {
+		close_connection(c.sock, c.ssl);
+	}
+}
+
+void WebContext::Private::clear_connections()
+{
+	std::list<Connection> list;
+	{
+		std::lock_guard lock(pool_mutex);
+		list.swap(pool);
+	}
+	for (Connection const &c : list) {
+		close_connection(c.sock, c.ssl);
+	}
+}
+
 WebClient::URL::URL(std::string const &addr)
 {
 	data.full_request = addr;
@@ -180,15 +849,20 @@ void WebClientHandler::abort(std::string const &message)
 
 struct WebClient::Private {
 	std::vector<std::string> request_header;
+	std::string request_buffer; // 要求行とヘッダ。要求ごとに使い回す
+	std::vector<std::pair<char const *, size_t>> send_slices;
+	std::string send_buffer;
+#ifndef _WIN32
+	std::vector<iovec> send_iov;
+#endif
 	WebClient::Error error;
 	WebClient::Response response;
 	WebContext *webcx;
 	WebClient::HttpVersion http_version = WebClient::HTTP_1_0;
-	int crlf_state = 0;
-	size_t content_offset = 0;
-	std::string last_host_name;
-	int last_port = 0;
-	bool keep_alive = false;
+	uint64_t max_body_size = 0;
+	WebClient::Timeouts timeouts; // 処理中の要求のタイムアウト
+	Deadline deadline; // 処理中の要求全体の期限
+	bool keep_alive = false; // 応答を読み終えた後も接続を使える
 	socket_t sock = INVALID_SOCKET;
 	SSL *ssl = nullptr;
 };
@@ -212,6 +886,14 @@ void WebClient::set_http_version(HttpVersion httpver)
 	m->http_version = httpver;
 }
 
+/**
+ * @brief 受け取る本文の上限を設定する。超えたら要求は失敗する（0 なら無制限）
+ */
+void WebClient::set_max_body_size(uint64_t n)
+{
+	m->max_body_size = n;
+}
+
 void WebClient::initialize()
 {
 #ifdef _WIN32
@@ -241,8 +923,6 @@ void WebClient::reset()
 //	m->request_header.clear();
 	m->error = Error();
 	m->response = Response();
-	m->crlf_state = 0;
-	m->content_offset = 0;
 }
 
 void WebClient::output_debug_string(char const *str)
@@ -294,66 +974,67 @@ int WebClient::get_port(URL const *url, char const *scheme, char const *protocol
 	return port;
 }
 
-static inline std::string to_s(size_t n)
-{
-	char tmp[100];
-	sprintf(tmp, "%u", (int)n);
-	return tmp;
-}
-
 void WebClient::set_default_header(Request const &url, Post const *post, RequestOption const &opt)
 {
-	std::vector<std::string> header;
-	std::set<std::string> names;
-	auto AddHeader = [&](std::string const &s){
-		size_t i = s.find(':');
-		if (i != std::string::npos) {
-			std::string name = s.substr(0, i);
-			if (names.find(name) == names.end()) {
-				names.insert(names.end(), name);
-				header.push_back(s);
-			}
+	// 前の要求の文字列を使い回す
+	std::vector<std::string> &header = m->request_header;
+	size_t count = 0;
+	auto AddHeader = [&](std::initializer_list<std::string_view> pieces){
+		std::string_view first = *pieces.begin();
+		size_t i = first.find(':');
+		if (i == std::string_view::npos) return;
+		std::string_view name = first.substr(0, i + 1);
+		for (size_t j = 0; j < count; j++) {
+			if (header[j].compare(0, name.size(), name) == 0) return; // 同じ名前なら最初のものを使う
+		}
+		if (count == header.size()) {
+			header.emplace_back();
+		}
+		std::string &h = header[count++];
+		h.clear();
+		for (std::string_view const &piece : pieces) {
+			h.append(piece);
 		}
 	};
-	AddHeader("Host: " + url.url.host());
-	AddHeader("User-Agent: " USER_AGENT);
-	AddHeader("Accept: */*");
+	AddHeader({"Host: ", url.url.host()});
+	AddHeader({"User-Agent: " USER_AGENT});
+	AddHeader({"Accept: */*"});
 	if (opt.keep_alive) {
-		AddHeader("Connection: keep-alive");
+		AddHeader({"Connection: keep-alive"});
 	} else {
-		AddHeader("Connection: close");
+		AddHeader({"Connection: close"});
 	}
 	if (post) {
-		AddHeader("Content-Length: " + to_s(post->data.size()));
-		std::string ct = "Content-Type: ";
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "%llu", (unsigned long long)post->size());
+		AddHeader({"Content-Length: ", tmp});
 		if (post->content_type.empty()) {
-			ct += ContentType::APPLICATION_OCTET_STREAM;
-		} else if (post->content_type == ContentType::MULTIPART_FORM_DATA) {
-			ct += post->content_type;
-			if (!post->boundary.empty()) {
-				ct += "; boundary=";
-				ct += post->boundary;
-			}
+			AddHeader({"Content-Type: ", ContentType::APPLICATION_OCTET_STREAM});
+		} else if (post->content_type == ContentType::MULTIPART_FORM_DATA && !post->boundary.empty()) {
+			AddHeader({"Content-Type: ", post->content_type, "; boundary=", post->boundary});
 		} else {
-			ct += post->content_type;
+			AddHeader({"Content-Type: ", post->content_type});
 		}
-		AddHeader(ct);
 	}
 	if (url.auth.type == Authorization::Basic) {
 		std::string s = url.auth.uid + ':' + url.auth.pwd;
-		AddHeader("Authorization: Basic " + base64_encode(s));
+		AddHeader({"Authorization: Basic ", base64_encode(s)});
 	}
 	for (std::string const &h : url.headers) {
-		AddHeader(h);
+		AddHeader({h});
 	}
-	m->request_header = std::move(header);
+	header.resize(count);
 }
 
-std::string WebClient::make_http_request(Request const &url, Post const *post, WebProxy const *proxy, bool https)
+/**
+ * @brief 要求行とヘッダを、使い回すバッファに書き出す
+ */
+std::string const &WebClient::make_http_request(Request const &url, Post const *post, WebProxy const *proxy, bool https)
 {
-	std::string str;
+	std::string &str = m->request_buffer;
+	str.clear();
 
-	str = post ? "POST " : "GET ";
+	str += post ? "POST " : "GET ";
 
 	char const *httpver = "1.0";
 	switch (m->http_version) {
@@ -364,15 +1045,12 @@ std::string WebClient::make_http_request(Request const &url, Post const *post, W
 
 	if (proxy && !https) {
 		str += url.url.data.full_request;
-		str += " HTTP/";
-		str += httpver;
-		str += "\r\n";
 	} else {
 		str += url.url.path();
-		str += " HTTP/";
-		str += httpver;
-		str += "\r\n";
 	}
+	str += " HTTP/";
+	str += httpver;
+	str += "\r\n";
 
 	for (std::string const &s: m->request_header) {
 		str += s;
@@ -383,258 +1061,524 @@ std::string WebClient::make_http_request(Request const &url, Post const *post, W
 	return str;
 }
 
-void WebClient::parse_http_header(char const *begin, char const *end, std::vector<std::string> *header)
+/**
+ * @brief 要求のヘッダと本文を送る
+ *
+ * 平文なら sendmsg でまとめて送り、本文の参照先（Post::references）もコピーしない。
+ * TLS なら小さな断片を一つのレコードにまとめて SSL_write する。
+ */
+void WebClient::send_request_(std::string const &head, Post const *post)
 {
-	if (begin < end) {
-		char const *left = begin;
-		char const *right = left;
-		while (1) {
-			if (right >= end) {
-				break;
+	auto &slices = m->send_slices;
+	slices.clear();
+	auto Add = [&](char const *ptr, size_t len){
+		if (len > 0) {
+			slices.emplace_back(ptr, len);
+		}
+	};
+	Add(head.data(), head.size());
+	if (post) {
+		size_t pos = 0;
+		for (Post::Reference const &r : post->references) {
+			Add(post->data.data() + pos, r.offset - pos);
+			Add(r.data, r.size);
+			pos = r.offset;
+		}
+		Add(post->data.data() + pos, post->data.size() - pos);
+	}
+
+#if USE_OPENSSL
+	if (m->ssl) {
+		static constexpr size_t RECORD_SIZE = 16384;
+		std::string &batch = m->send_buffer;
+		batch.clear();
+		for (auto const &slice : slices) {
+			if (batch.size() + slice.second > RECORD_SIZE && !batch.empty()) {
+				send_(batch.data(), batch.size());
+				batch.clear();
 			}
-			if (*right == '\r' || *right == '\n') {
-				if (left < right) {
-					header->push_back(std::string(left, right));
-				}
-				if (right + 1 < end && *right == '\r' && right[1] == '\n') {
-					right++;
-				}
-				right++;
-				if (*right == '\r' || *right == '\n') {
-					if (right + 1 < end && *right == '\r' && right[1] == '\n') {
-						right++;
-					}
-					right++;
-					break;
-				}
-				left = right;
+			if (slice.second < RECORD_SIZE) {
+				batch.append(slice.first, slice.second);
 			} else {
-				right++;
+				send_(slice.first, slice.second);
 			}
 		}
+		if (!batch.empty()) {
+			send_(batch.data(), batch.size());
+		}
+		return;
 	}
+#endif
+#ifdef _WIN32
+	for (auto const &slice : slices) {
+		send_(slice.first, slice.second);
+	}
+#else
+	auto &iov = m->send_iov;
+	iov.clear();
+	for (auto const &slice : slices) {
+		iovec v;
+		v.iov_base = (void *)slice.first;
+		v.iov_len = slice.second;
+		iov.push_back(v);
+	}
+	size_t i = 0;
+	while (i < iov.size()) {
+		wait_io_(POLLOUT);
+		msghdr msg = {};
+		msg.msg_iov = &iov[i];
+		msg.msg_iovlen = std::min<size_t>(iov.size() - i, IOV_MAX);
+		ssize_t n = sendmsg(m->sock, &msg, MSG_NOSIGNAL);
+		if (n < 1) {
+			throw Error("send request failed.");
+		}
+		while (n > 0) { // 送れたところまで進める
+			if ((size_t)n >= iov[i].iov_len) {
+				n -= iov[i].iov_len;
+				i++;
+			} else {
+				iov[i].iov_base = (char *)iov[i].iov_base + n;
+				iov[i].iov_len -= n;
+				n = 0;
+			}
+		}
+	}
+#endif
 }
 
-void WebClient::parse_http_header(char const *begin, char const *end, WebClient::Response *out)
-{
-	*out = Response();
-	parse_http_header(begin, end, &out->header);
-	parse_header(&out->header, out);
-}
-
-static void send_(socket_t s, char const *ptr, int len)
+/**
+ * @brief 要求を送る。TLS で接続していれば暗号化して送る
+ */
+void WebClient::send_(char const *ptr, size_t len)
 {
 	while (len > 0) {
-		int n = std::min(len, 65536);
-		n = send(s, ptr, n, 0);
-		if (n < 1 || n > len) {
-			throw WebClient::Error("send request failed.");
+		int n = (int)std::min<size_t>(len, 65536);
+		wait_io_(POLLOUT);
+#if USE_OPENSSL
+		if (m->ssl) {
+			n = SSL_write(m->ssl, ptr, n);
+			if (n < 1 || (size_t)n > len) {
+				throw WebClient::Error(ssl_error_string());
+			}
+		} else
+#endif
+		{
+			n = send(m->sock, ptr, n, MSG_NOSIGNAL);
+			if (n < 1 || (size_t)n > len) {
+				throw WebClient::Error("send request failed.");
+			}
 		}
 		ptr += n;
 		len -= n;
 	}
 }
 
-void WebClient::on_end_header(std::vector<char> const *vec, WebClientHandler *handler)
+/**
+ * @brief ソケットが読み書きできるようになるまで、読み込みと全体のタイムアウトの範囲で待つ
+ */
+void WebClient::wait_io_(short events)
 {
-	if (vec->empty()) return;
-	char const *begin = &vec->at(0);
-	char const *end = begin + vec->size();
-	parse_http_header(begin, end, &m->response);
-	if (handler) {
-		handler->checkHeader(this);
+#if USE_OPENSSL
+	if (events == POLLIN && m->ssl && SSL_pending(m->ssl) > 0) return;
+#endif
+	Deadline deadline = Deadline(m->timeouts.read_ms).earlier(m->deadline);
+	if (!wait_socket(m->sock, events, deadline)) {
+		if (m->deadline.expired()) {
+			throw Error("request timed out.");
+		}
+		throw Error(events == POLLIN ? "read timed out." : "send timed out.");
 	}
 }
 
-void WebClient::append(char const *ptr, size_t len, std::vector<char> *out, WebClientHandler *handler)
+namespace {
+
+bool iequals(std::string_view a, std::string_view b)
 {
-	size_t offset = out->size();
-	out->insert(out->end(), ptr, ptr + len);
+	return a.size() == b.size() && x_strnicmp(a.data(), b.data(), a.size()) == 0;
+}
 
-	if (m->crlf_state < 0) {
-		// nop
+bool icontains(std::string_view str, std::string_view word)
+{
+	for (size_t i = 0; i + word.size() <= str.size(); i++) {
+		if (x_strnicmp(str.data() + i, word.data(), word.size()) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+} // namespace
+
+/**
+ * @brief 受信したバイト列から HTTP 応答を一度だけ読み進めて解析する
+ *
+ * ヘッダは空行が届いた時点でまとめて解析し、本文は受信バッファのまま呼び出し元へ返す。
+ * chunked の場合は受信しながら復号し、チャンクの中身だけを返す。
+ */
+class ResponseParser {
+public:
+	enum State {
+		Header,
+		Body,
+		Done,
+	};
+	static constexpr size_t MAX_HEADER_SIZE = 64 * 1024;
+private:
+	enum ChunkState {
+		ChunkSize,
+		ChunkExtension,
+		ChunkData,
+		ChunkDataEnd,
+		ChunkTrailer,
+	};
+	State state_ = Header;
+	std::string head_;       // 空行までのヘッダ
+	size_t scanned_ = 0;     // 空行を探し終えた位置
+	bool received_ = false;  // 1 バイトでも受信した
+	uint64_t body_size_ = 0; // 渡した本文のバイト数
+	long long content_length_ = -1;
+	long long remaining_ = 0;
+	bool chunked_ = false;
+	bool keep_alive_ = false;
+	bool close_ = false;
+	ChunkState chunk_state_ = ChunkSize;
+	unsigned long long chunk_size_ = 0;
+	bool trailer_line_empty_ = true;
+
+	void parse_fields(WebClient::Response *res);
+	template <typename Sink> void decode_chunked(char const *ptr, size_t len, Sink sink);
+public:
+	State state() const { return state_; }
+	bool done() const { return state_ == Done; }
+	bool received() const { return received_; }
+	uint64_t body_size() const { return body_size_; }
+	bool chunked() const { return chunked_; }
+	long long content_length() const { return content_length_; }
+
+	bool reusable(WebClient::Response const &res) const
+	{
+		bool http11 = res.version.hi == 1 && res.version.lo >= 1;
+		return done() && (keep_alive_ || http11) && !close_;
+	}
+
+	size_t parse_header(char const *ptr, size_t len, WebClient::Response *res);
+	template <typename Sink> void parse_body(char const *ptr, size_t len, Sink sink);
+};
+
+/**
+ * @brief ヘッダを読み進める
+ * @return ヘッダとして消費したバイト数。残りは本文
+ */
+size_t ResponseParser::parse_header(char const *ptr, size_t len, WebClient::Response *res)
+{
+	received_ = received_ || len > 0;
+	size_t base = head_.size();
+	head_.append(ptr, len);
+	size_t end = std::string::npos;
+	while (1) {
+		size_t i = head_.find('\n', scanned_);
+		if (i == std::string::npos) {
+			scanned_ = head_.size();
+			break;
+		}
+		size_t j = i + 1;
+		if (j < head_.size() && head_[j] == '\r') j++;
+		if (j >= head_.size()) { // 次の行がまだ届いていない
+			scanned_ = i;
+			break;
+		}
+		if (head_[j] == '\n') {
+			end = j + 1;
+			break;
+		}
+		scanned_ = i + 1;
+	}
+	if (end == std::string::npos) {
+		if (head_.size() > MAX_HEADER_SIZE) {
+			throw WebClient::Error("response header too large.");
+		}
+		return len;
+	}
+	head_.resize(end);
+	parse_fields(res);
+	size_t used = end - base;
+
+	if (res->code >= 100 && res->code < 200 && res->code != 101) { // 中間応答は読み捨てて次の応答を待つ
+		head_.clear();
+		scanned_ = 0;
+		content_length_ = -1;
+		chunked_ = keep_alive_ = close_ = false;
+		return used + parse_header(ptr + used, len - used, res);
+	}
+	if (res->code == 204 || res->code == 304) {
+		state_ = Done;
+	} else if (chunked_) {
+		state_ = Body;
+	} else if (content_length_ >= 0) {
+		remaining_ = content_length_;
+		state_ = remaining_ > 0 ? Body : Done;
 	} else {
-		for (size_t i = 0; i < len; i++) {
-			int c = ptr[i] & 0xff;
-			if (c == '\r') {
-				m->crlf_state |= 1;
-			} else if (c == '\n') {
-				m->crlf_state |= 1;
-				m->crlf_state++;
-			} else {
-				m->crlf_state = 0;
+		state_ = Body; // 切断まで
+	}
+	return used;
+}
+
+void ResponseParser::parse_fields(WebClient::Response *res)
+{
+	*res = WebClient::Response();
+	std::string_view view(head_);
+	while (!view.empty()) {
+		size_t n = view.find('\n');
+		std::string_view line = view.substr(0, n);
+		view.remove_prefix(n == std::string_view::npos ? view.size() : n + 1);
+		if (!line.empty() && line.back() == '\r') {
+			line.remove_suffix(1);
+		}
+		if (line.empty()) continue;
+		res->header.emplace_back(line);
+
+		size_t colon = line.find(':');
+		if (res->header.size() == 1 || colon == std::string_view::npos) continue;
+		std::string_view name = line.substr(0, colon);
+		std::string_view value = trimmed(line.substr(colon + 1));
+		if (iequals(name, "content-length")) {
+			content_length_ = strtoll(std::string(value).c_str(), nullptr, 10);
+		} else if (iequals(name, "connection")) {
+			if (icontains(value, "keep-alive")) {
+				keep_alive_ = true;
+			} else if (icontains(value, "close")) {
+				close_ = true;
+			}
+		} else if (iequals(name, "transfer-encoding")) {
+			while (!value.empty()) {
+				size_t comma = value.find(',');
+				if (iequals(trimmed(value.substr(0, comma)), "chunked")) {
+					chunked_ = true;
+				}
+				value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+			}
+		}
+	}
+	WebClient::parse_header(&res->header, res);
+}
+
+/**
+ * @brief 本文を読み進める
+ *
+ * 本文のバイト列（chunked なら復号したもの）を sink(ptr, len) に渡す。応答の終わりより後ろは無視する。
+ */
+template <typename Sink>
+void ResponseParser::parse_body(char const *ptr, size_t len, Sink sink)
+{
+	received_ = received_ || len > 0;
+	if (state_ != Body) return;
+	auto counted = [&](char const *p, size_t n){
+		body_size_ += n;
+		sink(p, n);
+	};
+	if (chunked_) {
+		decode_chunked(ptr, len, counted);
+		return;
+	}
+	if (content_length_ >= 0) {
+		len = (size_t)std::min<long long>(remaining_, (long long)len);
+		remaining_ -= len;
+		if (remaining_ == 0) {
+			state_ = Done;
+		}
+	}
+	if (len > 0) {
+		counted(ptr, len);
+	}
+}
+
+template <typename Sink>
+void ResponseParser::decode_chunked(char const *ptr, size_t len, Sink sink)
+{
+	size_t i = 0;
+	while (i < len && state_ == Body) {
+		if (chunk_state_ == ChunkData) {
+			size_t n = (size_t)std::min<unsigned long long>(chunk_size_, len - i);
+			sink(ptr + i, n);
+			chunk_size_ -= n;
+			i += n;
+			if (chunk_size_ == 0) {
+				chunk_state_ = ChunkDataEnd;
+			}
+			continue;
+		}
+		int c = (unsigned char)ptr[i++];
+		switch (chunk_state_) {
+		case ChunkSize:
+			if (isxdigit(c)) {
+				if (chunk_size_ >> 56) {
+					throw WebClient::Error("invalid chunk size.");
+				}
+				chunk_size_ = chunk_size_ * 16 + (isdigit(c) ? c - '0' : toupper(c) - 'A' + 10);
+				break;
 			}
-			if (m->crlf_state == 4) {
-				m->content_offset = offset + i + 1;
-				on_end_header(out, handler);
-				m->crlf_state = -1;
+			if (c == ';') { // chunk-ext は読み飛ばす
+				chunk_state_ = ChunkExtension;
 				break;
 			}
-		}
-	}
-	if (handler && m->content_offset > 0) {
-		offset = out->size();
-		if (offset > m->content_offset) {
-			size_t len = offset - m->content_offset;
-			char const *ptr = &out->at(m->content_offset);
-			handler->checkContent(ptr, len);
-		}
+			if (c != '\r' && c != '\n' && c != ' ' && c != '\t') {
+				throw WebClient::Error("invalid chunk size.");
+			}
+			// fallthrough
+		case ChunkExtension:
+			if (c == '\n') {
+				if (chunk_size_ == 0) { // last-chunk。続くトレーラは空行まで読み捨てる
+					chunk_state_ = ChunkTrailer;
+					trailer_line_empty_ = true;
+				} else {
+					chunk_state_ = ChunkData;
+				}
+			}
+			break;
+		case ChunkDataEnd:
+			if (c == '\n') {
+				chunk_state_ = ChunkSize;
+			} else if (c != '\r') {
+				throw WebClient::Error("invalid chunk data.");
+			}
+			break;
+		case ChunkTrailer:
+			if (c == '\n') {
+				if (trailer_line_empty_) {
+					state_ = Done;
+				}
+				trailer_line_empty_ = true;
+			} else if (c != '\r') {
+				trailer_line_empty_ = false;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/**
+ * @brief 受信したバイト列を解析して、本文を out（opt.sink があればそちら）に渡す
+ */
+void WebClient::receive_bytes_(RequestOption const &opt, ResponseParser *rp, char const *ptr, size_t len, std::vector<char> *out)
+{
+	if (rp->state() == ResponseParser::Header) {
+		size_t used = rp->parse_header(ptr, len, &m->response);
+		ptr += used;
+		len -= used;
+		if (rp->state() != ResponseParser::Header) {
+			if (opt.max_body_size > 0 && rp->content_length() > 0 && (uint64_t)rp->content_length() > opt.max_body_size && !rp->chunked()) {
+				throw Error("response body too large.");
+			}
+			if (rp->content_length() > 0 && !rp->chunked() && !opt.sink) {
+				out->reserve((size_t)std::min<long long>(rp->content_length(), 64 * 1024 * 1024));
+			}
+			if (opt.handler) {
+				opt.handler->checkHeader(this);
+			}
+		}
+	}
+	if (len > 0) {
+		rp->parse_body(ptr, len, [&](char const *p, size_t n){
+			if (opt.max_body_size > 0 && rp->body_size() > opt.max_body_size) {
+				throw Error("response body too large.");
+			}
+			if (opt.sink) {
+				(*opt.sink)(p, n);
+			} else {
+				out->insert(out->end(), p, p + n);
+			}
+			if (opt.handler) {
+				opt.handler->checkContent(p, n);
+			}
+		});
 	}
 }
 
-static char *stristr(char *str1, char const *str2)
+/**
+ * @brief 受信を終えた応答を確かめて、接続を使い回せるか決める
+ */
+void WebClient::end_receive_(ResponseParser const *rp)
 {
-	size_t len1 = strlen(str1);
-	size_t len2 = strlen(str2);
-	for (size_t i = 0; i + len2 <= len1; i++) {
-		if (x_strnicmp(str1 + i, str2, len2) == 0) {
-			return str1 + i;
-		}
+	if (rp->chunked() && !rp->done()) {
+		throw Error("chunked response is truncated.");
 	}
-	return nullptr;
-}
-
-class ResponseHeader {
-public:
-	size_t pos = 0;
-	std::vector<char> line;
-	int content_length = -1;
-	bool connection_keep_alive = false;
-	bool connection_close = false;
-	struct {
-		bool chunked = false;
-	} internal;
-	int lf = 0;
-	enum State {
-		Header,
-		Content,
-	};
-	State state = Header;
-	void put(int c)
-	{
-		pos++;
-		if (state == Header) {
-			if (c== '\r' || c == '\n') {
-				if (!line.empty()) {
-					line.push_back(0);
-					char *begin = &line[0];
-					char *p = strchr(begin, ':');
-					if (p && *p == ':') {
-						*p++ = 0;
-						auto IS = [&](char const *name){ return x_stricmp(begin, name) == 0; };
-						if (IS("content-length")) {
-							content_length = strtol(p, nullptr, 10);
-						} else if (IS("connection")) {
-							if (stristr(p, "keep-alive")) {
-								connection_keep_alive = true;
-							} else if (stristr(p, "close")) {
-								connection_close = true;
-							}
-						} else if (IS("transfer-encoding")) {
-							std::vector<std::string> vec;
-							auto SPLIT = [](char const *str, char sep, std::vector<std::string> *out){
-								out->clear();
-								char const *begin = str;
-								char const *end = begin + strlen(str);
-								char const *ptr = begin;
-								char const *left = ptr;
-								while (1) {
-									char c = 0;
-									if (ptr < end) {
-										c = *ptr;
-									}
-									if (c == sep || c == 0) {
-										if (left < ptr) {
-											char const *l = left;
-											char const *r = ptr;
-											while (l < r && isspace((unsigned char)*l)) l++;
-											while (l < r && isspace((unsigned char)r[-1])) r--;
-											out->emplace_back(l, r);
-										}
-										if (c == 0) break;
-										ptr++;
-										left = ptr;
-									} else {
-										ptr++;
-									}
-								}
-							};
-							SPLIT(p, ',', &vec);
-							auto it = std::find(vec.begin(), vec.end(), "chunked");
-							internal.chunked = it != vec.end();
-						}
-					}
-					line.clear();
-				}
-				if (c== '\r') {
-					return;
-				}
-				if (c == '\n') {
-					lf++;
-					if (lf == 2) {
-						state = Content;
-					}
-					return;
-				}
-			}
-			lf = 0;
-			line.push_back(c);
-		}
+	if (rp->content_length() >= 0 && !rp->done()) {
+		throw Error("response is shorter than Content-Length.");
 	}
-};
+	m->keep_alive = rp->reusable(m->response); // 本文の終わりが分からなければ再利用しない
+}
 
-void WebClient::receive_(RequestOption const &opt, std::function<int(char *, int)> const &rcv, ResponseHeader *rh, std::vector<char> *out)
+template <typename Receive>
+void WebClient::receive_(RequestOption const &opt, Receive rcv, ResponseParser *rp, std::vector<char> *out)
 {
-	char buf[4096];
-	size_t pos = 0;
-	while (1) {
-		int n;
-		if (rh->state == ResponseHeader::Content && rh->content_length >= 0) {
-			n = rh->pos + rh->content_length - pos;
-			if (n > (int)sizeof(buf)) {
-				n = sizeof(buf);
-			}
-			if (n < 1) break;
-		} else {
-			n = sizeof(buf);
+	std::vector<char> buffer(RECEIVE_BUFFER_SIZE);
+	char *buf = buffer.data();
+	while (!rp->done()) {
+		int n = RECEIVE_BUFFER_SIZE;
+		if (rp->state() == ResponseParser::Body && rp->content_length() >= 0 && !rp->chunked()) {
+			n = (int)std::min<long long>(n, rp->content_length() - (long long)rp->body_size());
 		}
 		n = rcv(buf, n);
 		if (n < 1) break;
-		append(buf, n, out, opt.handler);
-		pos += n;
-		if (rh->state == ResponseHeader::Header) {
-			for (int i = 0; i < n; i++) {
-				rh->put(buf[i]);
-				if (rh->state == ResponseHeader::Content) {
-					m->keep_alive = rh->connection_keep_alive && !rh->connection_close;
-					break;
-				}
-			}
-		}
+		receive_bytes_(opt, rp, buf, n, out);
 	}
+	end_receive_(rp);
 }
 
-static int inet_connect(std::string const &hostname, int port)
+/**
+ * @brief 要求を終えた接続を、使えるなら WebContext に返し、使えなければ閉じる
+ */
+void WebClient::release_connection(std::string const &key, RequestOption const &opt)
 {
-	struct sockaddr_in server;
-	memset((char *)&server, 0, sizeof(server));
-	server.sin_family = AF_INET;
+	if (opt.keep_alive && m->keep_alive && m->sock != INVALID_SOCKET) {
+		m->webcx->m->put_connection(key, m->sock, m->ssl);
+		m->sock = INVALID_SOCKET;
+		m->ssl = nullptr;
+	} else {
+		close();
+	}
+}
 
-	if (HostNameResolver().resolve(hostname.data(), &server.sin_addr)) {
-		server.sin_port = htons(port);
-		socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
-		if (sock != INVALID_SOCKET) {
-			if (connect(sock, (struct sockaddr*) &server, sizeof(server)) != SOCKET_ERROR) {
-				return sock;
-			}
-			closesocket(sock);
+/**
+ * @brief 接続する。期限を過ぎたら WebClient::Error を投げる
+ * @return ブロッキングモードのソケット。接続できなければ INVALID_SOCKET
+ */
+static socket_t inet_connect(std::string const &hostname, int port, Deadline const &deadline)
+{
+	Connector connector;
+	if (!connector.resolve(hostname, port)) {
+		return INVALID_SOCKET;
+	}
+	connector.update(nullptr, Connector::Clock::now());
+	std::vector<pollfd> fds;
+	while (!connector.connected() && !connector.failed()) {
+		if (deadline.expired()) {
+			throw WebClient::Error("connect timed out.");
+		}
+		fds.clear();
+		for (socket_t s : connector.attempts()) {
+			pollfd pfd = {};
+			pfd.fd = s;
+			pfd.events = POLLOUT;
+			fds.push_back(pfd);
+		}
+		int timeout = shorter_timeout(connector.wait_ms(Connector::Clock::now()), deadline.remaining_ms());
+		int n = poll_sockets(fds.data(), fds.size(), timeout);
+		if (n < 0 && !would_block()) {
 			return INVALID_SOCKET;
 		}
+		connector.update(n > 0 ? fds.data() : nullptr, Connector::Clock::now());
 	}
-	return INVALID_SOCKET;
+	socket_t sock = connector.take();
+	if (sock != INVALID_SOCKET) {
+		set_nonblocking(sock, false);
+	}
+	return sock;
 }
 
-bool WebClient::http_get(Request const &request, Post const *post, RequestOption const &opt, ResponseHeader *rh, std::vector<char> *out)
+bool WebClient::http_get(Request const &request, Post const *post, RequestOption const &opt, ResponseParser *rp, std::vector<char> *out)
 {
 	clear_error();
 	out->clear();
@@ -650,41 +1594,60 @@ bool WebClient::http_get(Request const &request, Post const *post, RequestOption
 
 	std::string hostname = server_req.url.host();
 	int port = get_port(&server_req.url, "http", "tcp");
+	std::string key = "http://" + hostname + ':' + std::to_string(port);
 
-	m->keep_alive = opt.keep_alive && hostname == m->last_host_name && port == m->last_port;
-	if (!m->keep_alive) close();
-
-	if (m->sock == INVALID_SOCKET) {
-		m->sock = inet_connect(hostname, port);
+	auto Connect = [&](){
+		m->sock = inet_connect(hostname, port, Deadline(m->timeouts.connect_ms).earlier(m->deadline));
 		if (m->sock == INVALID_SOCKET) {
 			throw Error("connect failed.");
 		}
+	};
+
+	close();
+	SSL *ssl = nullptr;
+	bool reused = opt.keep_alive && m->webcx->m->take_connection(key, &m->sock, &ssl);
+	if (!reused) {
+		Connect();
 	}
-	m->last_host_name = hostname;
-	m->last_port = port;
 
 	set_default_header(request, post, opt);
 
-	std::string req = make_http_request(request, post, proxy, false);
+	std::string const &req = make_http_request(request, post, proxy, false);
 
-	send_(m->sock, req.c_str(), (int)req.size());
-	if (post && !post->data.empty()) {
-		send_(m->sock, (char const *)&post->data[0], (int)post->data.size());
-	}
+	auto Exchange = [&](){
+		out->clear();
+		*rp = ResponseParser();
+		m->keep_alive = false;
+
+		send_request_(req, post);
 
-	m->crlf_state = 0;
-	m->content_offset = 0;
+		receive_(opt, [&](char *ptr, int len){
+			wait_io_(POLLIN);
+			return recv(m->sock, ptr, len, 0);
+		}, rp, out);
+	};
 
-	receive_(opt, [&](char *ptr, int len){
-		return recv(m->sock, ptr, len, 0);
-	}, rh, out);
+	if (reused) {
+		try {
+			Exchange();
+		} catch (Error const &) {
+			if (rp->received()) throw; // 受け取った本文を二重に渡さない
+		}
+		if (!rp->received()) { // 待機中に切断されていたので接続し直す
+			close();
+			Connect();
+			Exchange();
+		}
+	} else {
+		Exchange();
+	}
 
-	if (!m->keep_alive) close();
+	release_connection(key, opt);
 
 	return true;
 }
 
-bool WebClient::https_get(Request const &request_req, Post const *post, RequestOption const &opt, ResponseHeader *rh, std::vector<char> *out)
+bool WebClient::https_get(Request const &request_req, Post const *post, RequestOption const &opt, ResponseParser *rp, std::vector<char> *out)
 {
 #if USE_OPENSSL
 
@@ -697,13 +1660,6 @@ bool WebClient::https_get(Request const &request_req, Post const *post, RequestO
 	clear_error();
 	out->clear();
 
-	auto get_ssl_error = []()->std::string{
-		char tmp[1000];
-		unsigned long e = ERR_get_error();
-		ERR_error_string_n(e, tmp, sizeof(tmp));
-		return tmp;
-	};
-
 	Request server_req;
 
 	WebProxy const *proxy = m->webcx->https_proxy();
@@ -715,17 +1671,20 @@ bool WebClient::https_get(Request const &request_req, Post const *post, RequestO
 
 	std::string hostname = server_req.url.host();
 	int port = get_port(&server_req.url, "https", "tcp");
+	std::string key = "https://" + request_req.url.host() + ':' + std::to_string(get_port(&request_req.url, "https", "tcp"));
+	if (proxy) {
+		key += " via " + proxy->server;
+	}
 
-	m->keep_alive = opt.keep_alive && hostname == m->last_host_name && port == m->last_port;
-	if (!m->keep_alive) close();
-
-	socket_t sock = m->sock;
-	SSL *ssl = m->ssl;
-	if (sock == INVALID_SOCKET || !ssl) {
-		sock = inet_connect(hostname, port);
+	socket_t sock = INVALID_SOCKET;
+	SSL *ssl = nullptr;
+	auto Connect = [&](){
+		Deadline deadline = Deadline(m->timeouts.connect_ms).earlier(m->deadline); // ハンドシェイクまで含める
+		sock = inet_connect(hostname, port, deadline);
 		if (sock == INVALID_SOCKET) {
 			throw Error("connect failed.");
 		}
+		m->sock = sock; // 失敗したら close で閉じる
 
 		if (proxy) { // testing
 			char port[10];
@@ -735,8 +1694,9 @@ bool WebClient::https_get(Request const &request_req, Post const *post, RequestO
 			str += request_req.url.data.host;
 			str += port;
 			str += " HTTP/1.0\r\n\r\n";
-			send_(sock, str.c_str(), str.size());
+			send_(str.c_str(), str.size());
 			char tmp[1000];
+			wait_io_(POLLIN);
 			int n = recv(sock, tmp, sizeof(tmp), 0);
 			int i;
 			for (i = 0; i < n; i++) {
@@ -754,35 +1714,23 @@ bool WebClient::https_get(Request const &request_req, Post const *post, RequestO
 			}
 		}
 
-		ssl = SSL_new(sslctx);
-		if (!ssl) {
-			throw Error(get_ssl_error());
-		}
-
-		SSL_set_options(ssl, SSL_OP_NO_SSLv2);
-		SSL_set_options(ssl, SSL_OP_NO_SSLv3);
-		SSL_set_hostflags(ssl, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
-		if (!SSL_set1_host(ssl, hostname.c_str())) {
-			throw Error(get_ssl_error());
-		}
-		SSL_set_tlsext_host_name(ssl, hostname.c_str());
-
-		int ret;
-		ret = SSL_set_fd(ssl, sock);
-		if (ret == 0) {
-			throw Error(get_ssl_error());
-		}
-
-		RAND_poll();
-		while (RAND_status() == 0) {
-			unsigned short rand_ret = rand() % 65536;
-			RAND_seed(&rand_ret, sizeof(rand_ret));
-		}
+		ssl = m->webcx->m->new_ssl(key, hostname, sock);
+		m->ssl = ssl;
 
-		ret = SSL_connect(ssl);
-		if (ret != 1) {
-			throw Error(get_ssl_error());
+		set_nonblocking(sock, true);
+		while (1) {
+			int ret = SSL_connect(ssl);
+			if (ret == 1) break;
+			int e = SSL_get_error(ssl, ret);
+			if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE) {
+				throw Error(ssl_error_string());
+			}
+			if (!wait_socket(sock, e == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, deadline)) {
+				throw Error("connect timed out.");
+			}
 		}
+		set_nonblocking(sock, false);
+		m->webcx->m->count_handshake(ssl);
 
 		std::string cipher = SSL_get_cipher(ssl);
 		cipher += '\n';
@@ -858,82 +1806,60 @@ bool WebClient::https_get(Request const &request_req, Post const *post, RequestO
 		} else {
 			// wrong
 		}
+	};
+
+	close();
+	bool reused = opt.keep_alive && m->webcx->m->take_connection(key, &sock, &ssl);
+	if (reused) {
+		m->sock = sock;
+		m->ssl = ssl;
+	} else {
+		Connect();
 	}
-	m->last_host_name = hostname;
-	m->last_port = port;
 
 	set_default_header(request_req, post, opt);
 
-	std::string request = make_http_request(request_req, post, proxy, true);
+	std::string const &request = make_http_request(request_req, post, proxy, true);
 	if (0) { // for debug
 		fprintf(stderr, "%s\n", request.c_str());
 	}
 
-	auto SEND = [&](char const *ptr, int len){
-		while (len > 0) {
-			int n = SSL_write(ssl, ptr, len);
-			if (n < 1 || n > len) {
-				throw WebClient::Error(get_ssl_error());
-			}
-			ptr += n;
-			len -= n;
-		}
-	};
+	auto Exchange = [&](){
+		out->clear();
+		*rp = ResponseParser();
+		m->keep_alive = false;
 
-	SEND(request.c_str(), (int)request.size());
-	if (post && !post->data.empty()) {
-		SEND((char const *)&post->data[0], (int)post->data.size());
-	}
+		send_request_(request, post);
 
-	m->crlf_state = 0;
-	m->content_offset = 0;
+		receive_(opt, [&](char *ptr, int len){
+			wait_io_(POLLIN);
+			return SSL_read(ssl, ptr, len);
+		}, rp, out);
+	};
 
-	receive_(opt, [&](char *ptr, int len){
-		return SSL_read(ssl, ptr, len);
-	}, rh, out);
+	if (reused) {
+		try {
+			Exchange();
+		} catch (Error const &) {
+			if (rp->received()) throw; // 受け取った本文を二重に渡さない
+		}
+		if (!rp->received()) { // 待機中に切断されていたので接続し直す
+			close();
+			Connect();
+			Exchange();
+		}
+	} else {
+		Exchange();
+	}
 
-	m->sock = sock;
-	m->ssl = ssl;
-	if (!m->keep_alive) close();
+	m->webcx->m->save_session(key, ssl);
+	release_connection(key, opt);
 	return true;
 #endif
 	return false;
 }
 
-bool decode_chunked(char const *ptr, char const *end, std::vector<char> *out)
-{
-	out->clear();
-	int length = 0;
-	while (ptr < end) {
-		if (isxdigit((unsigned char)*ptr)) {
-			if (*ptr == '0' && length == 0) {
-				if (ptr + 2 < end && ptr[1] == '\r' && ptr[2] == '\n') {
-					return true; // normal exit
-				}
-				return false;
-			}
-			length *= 16;
-			if (isdigit(*ptr)) {
-				length += *ptr - '0';
-			} else {
-				length += toupper(*ptr) - 'A' + 10;
-			}
-			ptr++;
-		} else {
-			if (ptr + length + 4 < end && ptr[0] == '\r' && ptr[1] == '\n' && ptr[length + 2] == '\r' && ptr[length + 3] == '\n') {
-				ptr += 2;
-				out->insert(out->end(), ptr, ptr + length);
-				ptr += length + 2;
-			} else {
-				return false;
-			}
-			length = 0;
-		}
-	}
-	return false;
-}
-
-bool WebClient::get(Request const &req, Post const *post, Response *out, WebClientHandler *handler)
+bool WebClient::get(Request const &req, Post const *post, Response *out, WebClientHandler *handler, BodySink const *sink)
 {
 	reset();
 	bool ok = false;
@@ -945,30 +1871,20 @@ bool WebClient::get(Request const &req, Post const *post, Response *out, WebClie
 		RequestOption opt;
 		opt.keep_alive = m->webcx->m->use_keep_alive;
 		opt.handler = handler;
-		ResponseHeader rh;
+		opt.sink = sink;
+		opt.max_body_size = m->max_body_size;
+		m->timeouts = req.timeouts ? *req.timeouts : m->webcx->m->timeouts;
+		m->deadline = Deadline(m->timeouts.total_ms);
+		ResponseParser rp;
 		std::vector<char> res;
 		if (req.url.isssl()) {
 #if USE_OPENSSL
-			https_get(req, post, opt, &rh, &res);
+			https_get(req, post, opt, &rp, &res);
 #endif
 		} else {
-			http_get(req, post, opt, &rh, &res);
-		}
-		if (!res.empty()) {
-			char const *begin = &res[0];
-			char const *end = begin + res.size();
-			char const *ptr = begin + m->content_offset;
-			if (ptr < end) {
-				if (rh.internal.chunked) {
-					if (!decode_chunked(ptr, end, &out->content)) {
-						out->content.clear();
-						return false;
-					}
-				} else {
-					out->content.assign(ptr, end);
-				}
-			}
+			http_get(req, post, opt, &rp, &res);
 		}
+		out->content = std::move(res);
 		ok = true;
 	} catch (Error const &e) {
 		m->error = e;
@@ -1070,6 +1986,11 @@ std::string WebClient::header_value(std::string const &name) const
 	return header_value(&m->response.header, name);
 }
 
+std::string WebClient::header_value(Response const &res, std::string const &name)
+{
+	return header_value(&res.header, name);
+}
+
 std::string WebClient::content_type() const
 {
 	std::string s = header_value("Content-Type");
@@ -1108,20 +2029,430 @@ int WebClient::post(Request const &req, Post const *post, WebClientHandler *hand
 	return m->response.code;
 }
 
-void WebClient::close()
+/**
+ * @brief 本文を Response::content に溜めず、受信したそばから sink に渡す
+ *
+ * 失敗したときは、それまでに受け取った分が sink に渡っていることがある。
+ */
+int WebClient::download(Request const &req, BodySink const &sink, WebClientHandler *handler)
+{
+	get(req, nullptr, &m->response, handler, &sink);
+	return m->response.code;
+}
+
+/**
+ * @brief 本文をファイル記述子に書き出す
+ */
+int WebClient::download(Request const &req, int fd, WebClientHandler *handler)
+{
+	return download(req, [&](char const *ptr, size_t len){
+		while (len > 0) {
+#ifdef _WIN32
+			int n = _write(fd, ptr, (unsigned int)std::min<size_t>(len, 1 << 30));
+#else
+			ssize_t n = ::write(fd, ptr, len);
+			if (n < 0 && errno == EINTR) continue;
+#endif
+			if (n < 1) {
+				throw Error("write failed.");
+			}
+			ptr += n;
+			len -= n;
+		}
+	}, handler);
+}
+
+/**
+ * @brief 複数の要求を並行して処理する
+ *
+ * ノンブロッキングのソケットを poll で待ち、接続先ごとに max_per_host 本まで同時に接続する。
+ * WebContext の待機中の接続と TLS セッションを使い回す。終わったものから done を呼ぶ。
+ * タイムアウトは要求ごとに、指定が無ければ WebContext のものを使う。
+ * プロキシを使う要求は、先に一つずつ処理する。
+ * @return requests と同じ順の結果
+ */
+std::vector<WebClient::FetchResult> WebClient::fetch_all(WebContext *webcx, std::vector<Request> const &requests, FetchCallback const &done, size_t max_per_host)
 {
+	assert(webcx);
+	max_per_host = std::max<size_t>(max_per_host, 1);
+
+	struct Job {
+		size_t index = 0;
+		std::string key;
+		std::string hostname;
+		int port = 0;
+		bool https = false;
+		std::unique_ptr<WebClient> client;
+		RequestOption opt;
+		std::string request;
+		size_t sent = 0;
+		ResponseParser parser;
+		std::vector<char> body;
+		std::unique_ptr<Connector> connector;
+		Timeouts timeouts;
+		Deadline total_deadline;
+		Deadline connect_deadline;
+		Deadline io_deadline;
+		bool reused = false;
+		bool finished = false;
+		enum Step {
+			Connecting,
+			Handshake,
+			Sending,
+			Receiving,
+		} step = Connecting;
+		short events = POLLOUT;
+	};
+
+	std::vector<FetchResult> results(requests.size());
+	std::list<Job> active;
+	std::list<size_t> pending;
+	std::map<std::string, size_t> connections; // 接続先ごとの使用中の接続数
+	std::vector<char> buffer(RECEIVE_BUFFER_SIZE);
+
+	auto Finish = [&](Job &job, Error const *error){
+		FetchResult &r = results[job.index];
+		WebClient *client = job.client.get();
+		if (error) {
+			r.error = *error;
+			client->close();
+		} else {
+			r.ok = true;
+			client->m->response.content = std::move(job.body);
+			r.response = std::move(client->m->response);
 #if USE_OPENSSL
-	if (m->ssl) {
-		SSL_shutdown(m->ssl);
-		SSL_free(m->ssl);
-		m->ssl = nullptr;
-	}
+			if (client->m->ssl) {
+				webcx->m->save_session(job.key, client->m->ssl);
+			}
 #endif
-	if (m->sock != INVALID_SOCKET) {
-		shutdown(m->sock, 2); // SD_BOTH or SHUT_RDWR
-		closesocket(m->sock);
-		m->sock = INVALID_SOCKET;
+			if (job.opt.keep_alive && client->m->keep_alive) {
+				set_nonblocking(client->m->sock, false);
+			}
+			client->release_connection(job.key, job.opt);
+		}
+		job.finished = true;
+		connections[job.key]--;
+		if (done) {
+			done(job.index, r);
+		}
+	};
+
+	auto Connect = [&](Job &job){
+		job.client->close();
+		job.connector = std::make_unique<Connector>();
+		if (!job.connector->resolve(job.hostname, job.port)) {
+			throw Error("connect failed.");
+		}
+		job.connector->update(nullptr, Connector::Clock::now());
+		job.connect_deadline = Deadline(job.timeouts.connect_ms).earlier(job.total_deadline);
+		job.reused = false;
+		job.step = Job::Connecting;
+	};
+
+	auto Start = [&](size_t index){
+		Request const &req = requests[index];
+		active.emplace_back();
+		Job &job = active.back();
+		job.index = index;
+		job.https = req.url.isssl();
+		job.hostname = req.url.host();
+		job.port = get_port(&req.url, job.https ? "https" : "http", "tcp");
+		job.key = (job.https ? "https://" : "http://") + job.hostname + ':' + std::to_string(job.port);
+		job.client = std::make_unique<WebClient>(webcx);
+		job.opt.keep_alive = webcx->m->use_keep_alive;
+		job.timeouts = req.timeouts ? *req.timeouts : webcx->m->timeouts;
+		job.total_deadline = Deadline(job.timeouts.total_ms);
+		job.io_deadline = Deadline(job.timeouts.read_ms);
+		connections[job.key]++;
+		try {
+#if !USE_OPENSSL
+			if (job.https) {
+				throw Error("https is not supported.");
+			}
+#endif
+			job.client->set_default_header(req, nullptr, job.opt);
+			job.request = job.client->make_http_request(req, nullptr, nullptr, job.https);
+			socket_t sock = INVALID_SOCKET;
+			SSL *ssl = nullptr;
+			if (job.opt.keep_alive && webcx->m->take_connection(job.key, &sock, &ssl)) {
+				job.client->m->sock = sock;
+				job.client->m->ssl = ssl;
+				set_nonblocking(sock, true);
+				job.reused = true;
+				job.step = Job::Sending;
+				job.events = POLLOUT;
+			} else {
+				Connect(job);
+			}
+		} catch (Error const &e) {
+			Finish(job, &e);
+		}
+	};
+
+	auto StartPending = [&](){
+		for (auto it = pending.begin(); it != pending.end();) {
+			Request const &req = requests[*it];
+			bool https = req.url.isssl();
+			std::string key = (https ? "https://" : "http://") + req.url.host() + ':' + std::to_string(get_port(&req.url, https ? "https" : "http", "tcp"));
+			if (connections[key] < max_per_host) {
+				Start(*it);
+				it = pending.erase(it);
+			} else {
+				it++;
+			}
+		}
+	};
+
+	// 読み書きが完了を待つ必要があれば、待つ向きを events に設定して true を返す
+	auto WouldBlock = [&](Job &job, int ret){
+#if USE_OPENSSL
+		if (job.client->m->ssl) {
+			switch (SSL_get_error(job.client->m->ssl, ret)) {
+			case SSL_ERROR_WANT_READ:
+				job.events = POLLIN;
+				return true;
+			case SSL_ERROR_WANT_WRITE:
+				job.events = POLLOUT;
+				return true;
+			}
+			return false;
+		}
+#endif
+		if (ret < 0 && would_block()) {
+			job.events = job.step == Job::Receiving ? POLLIN : POLLOUT;
+			return true;
+		}
+		return false;
+	};
+
+	auto Advance = [&](Job &job){
+		WebClient *client = job.client.get();
+		while (1) {
+			switch (job.step) {
+			case Job::Connecting:
+				{
+					if (!job.connector->connected()) return;
+					client->m->sock = job.connector->take();
+					job.connector.reset();
+#if USE_OPENSSL
+					if (job.https) {
+						client->m->ssl = webcx->m->new_ssl(job.key, job.hostname, client->m->sock);
+						job.step = Job::Handshake;
+						continue;
+					}
+#endif
+					job.step = Job::Sending;
+				}
+				continue;
+#if USE_OPENSSL
+			case Job::Handshake:
+				{
+					int ret = SSL_connect(client->m->ssl);
+					if (ret != 1) {
+						if (WouldBlock(job, ret)) return;
+						throw Error(ssl_error_string());
+					}
+					webcx->m->count_handshake(client->m->ssl);
+					job.step = Job::Sending;
+				}
+				continue;
+#endif
+			case Job::Sending:
+				while (job.sent < job.request.size()) {
+					char const *ptr = job.request.data() + job.sent;
+					int len = (int)std::min<size_t>(job.request.size() - job.sent, 65536);
+#if USE_OPENSSL
+					int n = client->m->ssl ? SSL_write(client->m->ssl, ptr, len) : send(client->m->sock, ptr, len, MSG_NOSIGNAL);
+#else
+					int n = send(client->m->sock, ptr, len, MSG_NOSIGNAL);
+#endif
+					if (n > 0) {
+						job.sent += n;
+					} else if (WouldBlock(job, n)) {
+						return;
+					} else {
+						throw Error("send request failed.");
+					}
+				}
+				job.step = Job::Receiving;
+				job.events = POLLIN;
+				continue;
+			case Job::Receiving:
+				while (1) {
+#if USE_OPENSSL
+					int n = client->m->ssl ? SSL_read(client->m->ssl, buffer.data(), RECEIVE_BUFFER_SIZE) : recv(client->m->sock, buffer.data(), RECEIVE_BUFFER_SIZE, 0);
+					bool eof = n == 0 || (n < 0 && client->m->ssl && SSL_get_error(client->m->ssl, n) == SSL_ERROR_ZERO_RETURN);
+#else
+					int n = recv(client->m->sock, buffer.data(), RECEIVE_BUFFER_SIZE, 0);
+					bool eof = n == 0;
+#endif
+					if (n > 0) {
+						client->receive_bytes_(job.opt, &job.parser, buffer.data(), n, &job.body);
+						if (job.parser.done()) break;
+					} else if (eof) {
+						if (job.parser.state() == ResponseParser::Header) {
+							throw Error("connection closed.");
+						}
+						break;
+					} else if (WouldBlock(job, n)) {
+						return;
+					} else {
+						throw Error("receive failed.");
+					}
+				}
+				client->end_receive_(&job.parser);
+				Finish(job, nullptr);
+				return;
+			default:
+				throw Error("unexpected state.");
+			}
+		}
+	};
+
+	auto Step = [&](Job &job){
+		try {
+			Advance(job);
+			if (job.step == Job::Sending || job.step == Job::Receiving) {
+				job.io_deadline = Deadline(job.timeouts.read_ms); // 読み書きが進んだ
+			}
+		} catch (Error const &e) {
+			if (job.reused && !job.parser.received()) { // 待機中に切断されていたので接続し直す
+				try {
+					job.sent = 0;
+					job.parser = ResponseParser();
+					Connect(job);
+					return;
+				} catch (Error const &e) {
+					Finish(job, &e);
+					return;
+				}
+			}
+			Finish(job, &e);
+		}
+	};
+
+	std::set<std::string> hosts;
+	for (size_t i = 0; i < requests.size(); i++) {
+		Request const &req = requests[i];
+		if (req.url.isssl() ? webcx->https_proxy() : webcx->http_proxy()) {
+			WebClient client(webcx);
+			FetchResult &r = results[i];
+			r.ok = client.get(req, nullptr, &client.m->response, nullptr);
+			r.response = std::move(client.m->response);
+			r.error = client.error();
+			if (done) {
+				done(i, r);
+			}
+		} else {
+			pending.push_back(i);
+			hosts.insert(req.url.host());
+		}
+	}
+	for (std::string const &host : hosts) { // 接続を待たせている間に名前を解決しておく
+		HostNameResolver::lookup_async(host);
+	}
+
+	auto CheckConnecting = [&](Job &job){
+		if (job.connector->connected()) {
+			Step(job);
+		} else if (job.connector->failed()) {
+			Error e("connect failed.");
+			Finish(job, &e);
+		}
+	};
+
+	auto CheckTimeouts = [&](){
+		for (Job &job : active) {
+			if (job.finished) continue;
+			char const *what = nullptr;
+			bool connecting = job.step == Job::Connecting || job.step == Job::Handshake;
+			if (job.total_deadline.expired()) {
+				what = "request timed out.";
+			} else if (connecting && job.connect_deadline.expired()) {
+				what = "connect timed out.";
+			} else if (!connecting && job.io_deadline.expired()) {
+				what = "read timed out.";
+			}
+			if (what) {
+				Error e(what);
+				Finish(job, &e);
+			}
+		}
+	};
+
+	std::vector<pollfd> fds;
+	std::vector<Job *> jobs; // fds と同じ順
+	while (1) {
+		StartPending();
+		for (Job &job : active) {
+			if (!job.finished && job.step == Job::Connecting) {
+				CheckConnecting(job);
+			}
+		}
+		CheckTimeouts();
+		active.remove_if([](Job const &job){ return job.finished; });
+		if (active.empty()) {
+			if (pending.empty()) break;
+			continue;
+		}
+		fds.clear();
+		jobs.clear();
+		int timeout = -1;
+		auto now = Connector::Clock::now();
+		for (Job &job : active) {
+			pollfd pfd = {};
+			if (job.step == Job::Connecting) { // 接続を試みているすべてのソケットを待つ
+				for (socket_t s : job.connector->attempts()) {
+					pfd.fd = s;
+					pfd.events = POLLOUT;
+					fds.push_back(pfd);
+					jobs.push_back(&job);
+				}
+				timeout = shorter_timeout(timeout, job.connector->wait_ms(now));
+				timeout = shorter_timeout(timeout, job.connect_deadline.remaining_ms());
+			} else {
+				pfd.fd = job.client->m->sock;
+				pfd.events = job.events;
+				fds.push_back(pfd);
+				jobs.push_back(&job);
+				Deadline d = job.step == Job::Handshake ? job.connect_deadline : job.io_deadline;
+				timeout = shorter_timeout(timeout, d.remaining_ms());
+			}
+			timeout = shorter_timeout(timeout, job.total_deadline.remaining_ms());
+		}
+		int n = poll_sockets(fds.data(), fds.size(), timeout);
+		if (n < 0) {
+			if (would_block()) continue;
+			Error e("poll failed.");
+			for (Job &job : active) {
+				Finish(job, &e);
+			}
+			continue;
+		}
+		now = Connector::Clock::now();
+		for (size_t i = 0; i < fds.size();) {
+			Job &job = *jobs[i];
+			if (job.step == Job::Connecting) {
+				size_t count = job.connector->attempts().size();
+				job.connector->update(n > 0 ? &fds[i] : nullptr, now);
+				CheckConnecting(job);
+				i += count;
+			} else {
+				if (fds[i].revents) {
+					Step(job);
+				}
+				i++;
+			}
+		}
 	}
+	return results;
+}
+
+void WebClient::close()
+{
+	close_connection(m->sock, m->ssl);
+	m->sock = INVALID_SOCKET;
+	m->ssl = nullptr;
 }
 
 void WebClient::add_header(std::string const &text)
@@ -1175,7 +2506,9 @@ void WebClient::make_multipart_form_data(std::vector<Part> const &parts, WebClie
 			vappend(&out->data, "Content-Transfer-Encoding: " + part.content_transfer_encoding + "\r\n");
 		}
 		vappend(&out->data, "\r\n");
-		vappend(&out->data, part.data, part.size);
+		if (part.size > 0) {
+			out->references.push_back({out->data.size(), part.data, part.size}); // 送るときにここへ挟み込む
+		}
 		vappend(&out->data, "\r\n");
 	}
 
@@ -1202,17 +2535,16 @@ WebContext::WebContext(WebClient::HttpVersion httpver)
 {
 	set_http_version(httpver);
 #if USE_OPENSSL
-	SSL_load_error_strings();
-	SSL_library_init();
-//	m->ctx = SSL_CTX_new(SSLv23_client_method());
-	m->ctx = SSL_CTX_new(TLS_client_method());
-	SSL_CTX_set_default_verify_paths(m->ctx);
+	m->ctx = shared_ssl_ctx();
+	SSL_CTX_up_ref(m->ctx);
 #endif
 }
 
 WebContext::~WebContext()
 {
+	m->clear_connections();
 #if USE_OPENSSL
+	m->clear_sessions();
 	SSL_CTX_free(m->ctx);
 #endif
 	delete m;
@@ -1228,6 +2560,45 @@ void WebContext::set_keep_alive_enabled(bool f)
 	m->use_keep_alive = f;
 }
 
+/**
+ * @brief 待機させておく接続の数の上限を設定する
+ */
+void WebContext::set_max_idle_connections(size_t n)
+{
+	{
+		std::lock_guard lock(m->pool_mutex);
+		m->max_idle_connections = n;
+	}
+	if (n == 0) {
+		m->clear_connections();
+	}
+}
+
+/**
+ * @brief 待機中の接続を閉じるまでの時間を設定する
+ */
+void WebContext::set_idle_timeout(int seconds)
+{
+	std::lock_guard lock(m->pool_mutex);
+	m->idle_timeout = std::chrono::seconds(seconds);
+}
+
+/**
+ * @brief タイムアウトを指定しなかった要求に使うタイムアウトを設定する
+ */
+void WebContext::set_timeouts(WebClient::Timeouts const &t)
+{
+	m->timeouts = t;
+}
+
+/**
+ * @brief 待機中の接続をすべて閉じる
+ */
+void WebContext::close_idle_connections()
+{
+	m->clear_connections();
+}
+
 void WebContext::set_http_proxy(std::string const &proxy)
 {
 	m->http_proxy = WebProxy();
@@ -1262,6 +2633,12 @@ const WebProxy *WebContext::https_proxy() const
 bool WebContext::load_cacert(char const *path)
 {
 #if USE_OPENSSL
+	if (m->ctx == shared_ssl_ctx()) { // 共有の SSL_CTX は変更しないので、自分用のものを作る
+		close_idle_connections();
+		m->clear_sessions();
+		SSL_CTX_free(m->ctx);
+		m->ctx = new_ssl_ctx();
+	}
 	int r = SSL_CTX_load_verify_locations(m->ctx, path, nullptr);
 	return r == 1;
 #else
@@ -1274,11 +2651,42 @@ void WebContext::notify_broken_pipe()
 	m->broken_pipe = true;
 }
 
+/**
+ * @brief TLS ハンドシェイクの回数
+ */
+WebContext::TlsStatistics WebContext::tls_statistics() const
+{
+	TlsStatistics t;
+#if USE_OPENSSL
+	t.full_handshakes = m->full_handshakes;
+	t.resumed_handshakes = m->resumed_handshakes;
+#endif
+	return t;
+}
+
+/**
+ * @brief 静的な get が使う共有のコンテキスト
+ *
+ * 接続と SSL_CTX を呼び出しの間で使い回す。
+ */
+WebContext *WebContext::shared()
+{
+	static WebContext *wc = [](){
+		auto *p = new WebContext(WebClient::HTTP_1_1); // 終了時に他のスレッドが使っているかもしれないので破棄しない
+		p->set_keep_alive_enabled(true);
+		WebClient::Timeouts t; // 応答しない相手で止まらないように
+		t.connect_ms = 10000;
+		t.read_ms = 30000;
+		t.total_ms = 60000;
+		p->set_timeouts(t);
+		return p;
+	}();
+	return wc;
+}
+
 std::string WebClient::get(std::string const &url)
 {
-	WebContext wc(WebClient::HTTP_1_1);
-	wc.set_keep_alive_enabled(false);
-	WebClient http(&wc);
+	WebClient http(WebContext::shared());
 	if (http.get(WebClient::Request(url))) {
 		return {http.content_data(), http.content_length()};
 	}
@@ -2,6 +2,10 @@
 #ifndef WEBCLIENT_H_
 #define WEBCLIENT_H_
 
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <optional>
 #include <vector>
 #include <string>
 #include <functional>
@@ -13,8 +17,28 @@ class WebContext;
 class WebClient;
 
 typedef void _in_addr;
+
+/**
+ * @brief 名前解決
+ *
+ * 結果はプロセス全体で共有するキャッシュに ttl の間保持する（解決できなかった名前は negative_ttl の間）。
+ * 同じ名前を同時に解決しようとしたら、問い合わせは一度だけ行い、その結果を皆で使う。スレッドセーフ。
+ */
 class HostNameResolver {
 public:
+	struct Address {
+		int family = 0; // AF_INET または AF_INET6
+		unsigned char addr[16] = {}; // ネットワークバイトオーダー。IPv4 なら先頭の 4 バイト
+		uint32_t scope_id = 0;
+		std::string to_string() const;
+	};
+	using Addresses = std::shared_ptr<std::vector<Address> const>; // 解決できなければ空
+	static Addresses lookup(std::string const &name);
+	static std::shared_future<Addresses> lookup_async(std::string const &name);
+	static void set_ttl(int seconds, int negative_seconds);
+	static void set_max_entries(size_t n);
+	static void clear();
+
 	bool resolve(char const *name, _in_addr *out);
 };
 
@@ -27,6 +51,9 @@ public:
 	{
 		(void)wc;
 	}
+	/**
+	 * @brief 本文を受信するたびに、新しく届いた部分（chunked なら復号済み）を渡す
+	 */
 	virtual void checkContent(char const *ptr, size_t len)
 	{
 		(void)ptr;
@@ -43,9 +70,10 @@ public:
 	}
 };
 
-struct ResponseHeader;
+class ResponseParser;
 
 class WebClient {
+	friend class ResponseParser;
 public:
 	class ContentType {
 	public:
@@ -84,12 +112,21 @@ public:
 		std::string uid;
 		std::string pwd;
 	};
+	/**
+	 * @brief タイムアウト（ミリ秒）。0 なら無制限
+	 */
+	struct Timeouts {
+		int connect_ms = 0; // 接続して TLS のハンドシェイクを終えるまで
+		int read_ms = 0; // 読み書きが進まない時間
+		int total_ms = 0; // 要求全体
+	};
 	class Request {
 		friend class ::WebClient;
 	private:
 		URL url;
 		Authorization auth;
 		std::vector<std::string> headers;
+		std::optional<Timeouts> timeouts; // 無ければ WebContext のもの
 	public:
 		Request() = default;
 		Request(std::string const &loc, std::vector<std::string> const &headers = {})
@@ -115,6 +152,10 @@ public:
 		{
 			headers.push_back(s);
 		}
+		void set_timeouts(Timeouts const &t)
+		{
+			timeouts = t;
+		}
 	};
 	class Error {
 	private:
@@ -144,6 +185,25 @@ public:
 		std::string content_type;
 		std::string boundary;
 		std::vector<char> data;
+		/**
+		 * @brief data の offset の位置に挟んで送る、呼び出し側のデータ
+		 *
+		 * コピーしないので、送り終えるまで有効でなければならない。offset の昇順に並べる。
+		 */
+		struct Reference {
+			size_t offset;
+			char const *data;
+			size_t size;
+		};
+		std::vector<Reference> references;
+		size_t size() const
+		{
+			size_t n = data.size();
+			for (Reference const &r : references) {
+				n += r.size;
+			}
+			return n;
+		}
 	};
 	struct ContentDisposition {
 		std::string type;
@@ -168,27 +228,42 @@ public:
 			content_disposition = cd;
 		}
 	};
+	/**
+	 * @brief 受信した本文を順に受け取る
+	 */
+	using BodySink = std::function<void (char const *ptr, size_t len)>;
 	struct RequestOption {
 		WebClientHandler *handler = nullptr;
 		bool keep_alive = true;
+		BodySink const *sink = nullptr; // 指定すると本文を Response::content に溜めずに渡す
+		uint64_t max_body_size = 0; // 0 なら無制限
+	};
+	struct FetchResult {
+		bool ok = false;
+		Response response;
+		Error error;
 	};
+	using FetchCallback = std::function<void (size_t index, FetchResult const &result)>;
 private:
 	struct Private;
 	Private *m;
 	void clear_error();
 	static int get_port(URL const *url, char const *scheme, char const *protocol);
 	void set_default_header(const Request &url, Post const *post, const RequestOption &opt);
-	std::string make_http_request(const Request &url, Post const *post, const WebProxy *proxy, bool https);
-	void parse_http_header(char const *begin, char const *end, std::vector<std::string> *header);
-	void parse_http_header(char const *begin, char const *end, Response *out);
-	bool http_get(const Request &request_req, Post const *post, RequestOption const &opt, ResponseHeader *rh, std::vector<char> *out);
-	bool https_get(const Request &request_url, Post const *post, RequestOption const &opt, ResponseHeader *rh, std::vector<char> *out);
-	bool get(const Request &req, Post const *post, Response *out, WebClientHandler *handler);
+	std::string const &make_http_request(const Request &url, Post const *post, const WebProxy *proxy, bool https);
+	void send_request_(std::string const &head, Post const *post);
+	bool http_get(const Request &request_req, Post const *post, RequestOption const &opt, ResponseParser *rp, std::vector<char> *out);
+	bool https_get(const Request &request_url, Post const *post, RequestOption const &opt, ResponseParser *rp, std::vector<char> *out);
+	bool get(const Request &req, Post const *post, Response *out, WebClientHandler *handler, BodySink const *sink = nullptr);
 	static void parse_header(std::vector<std::string> const *header, WebClient::Response *res);
 	static std::string header_value(std::vector<std::string> const *header, std::string const &name);
-	void append(char const *ptr, size_t len, std::vector<char> *out, WebClientHandler *handler);
-	void on_end_header(const std::vector<char> *vec, WebClientHandler *handler);
-	void receive_(const RequestOption &opt, std::function<int (char *, int)> const &, ResponseHeader *rh, std::vector<char> *out);
+	static constexpr int RECEIVE_BUFFER_SIZE = 65536;
+	void receive_bytes_(const RequestOption &opt, ResponseParser *rp, char const *ptr, size_t len, std::vector<char> *out);
+	void end_receive_(ResponseParser const *rp);
+	void send_(char const *ptr, size_t len);
+	void wait_io_(short events);
+	template <typename Receive> void receive_(const RequestOption &opt, Receive rcv, ResponseParser *rp, std::vector<char> *out);
+	void release_connection(std::string const &key, RequestOption const &opt);
 	void output_debug_string(char const *str);
 	void output_debug_strings(const std::vector<std::string> &vec);
 	static void cleanup();
@@ -201,10 +276,13 @@ public:
 	void operator = (WebClient const &) = delete;
 
 	void set_http_version(HttpVersion httpver);
+	void set_max_body_size(uint64_t n);
 
 	Error const &error() const;
 	int get(const Request &req, WebClientHandler *handler = nullptr);
 	int post(const Request &req, Post const *post, WebClientHandler *handler = nullptr);
+	int download(const Request &req, BodySink const &sink, WebClientHandler *handler = nullptr);
+	int download(const Request &req, int fd, WebClientHandler *handler = nullptr);
 	void close();
 	void add_header(std::string const &text);
 	Response const &response() const;
@@ -214,9 +292,13 @@ public:
 	char const *content_data() const;
 
 	static void make_application_www_form_urlencoded(char const *begin, char const *end, WebClient::Post *out);
-	static void make_multipart_form_data(const std::vector<Part> &parts, WebClient::Post *out, std::string const &boundary);
+	static void make_multipart_form_data(const std::vector<Part> &parts, WebClient::Post *out, std::string const &boundary); // Part のデータはコピーせずに参照する
 	static void make_multipart_form_data(char const *data, size_t size, WebClient::Post *out, std::string const &boundary);
 
+	static std::string header_value(Response const &res, std::string const &name);
+
+	static std::vector<FetchResult> fetch_all(WebContext *webcx, std::vector<Request> const &requests, FetchCallback const &done = {}, size_t max_per_host = 6);
+
 	static std::string get(const std::string &url);
 	static std::string checkip();
 };
@@ -224,6 +306,10 @@ public:
 class WebContext {
 	friend class WebClient;
 public:
+	struct TlsStatistics {
+		uint64_t full_handshakes = 0;
+		uint64_t resumed_handshakes = 0;
+	};
 private:
 	struct Private;
 	Private *m;
@@ -235,6 +321,10 @@ public:
 
 	void set_http_version(WebClient::HttpVersion httpver);
 	void set_keep_alive_enabled(bool f);
+	void set_max_idle_connections(size_t n);
+	void set_idle_timeout(int seconds);
+	void set_timeouts(WebClient::Timeouts const &t);
+	void close_idle_connections();
 
 	void set_http_proxy(std::string const &proxy);
 	void set_https_proxy(std::string const &proxy);
@@ -244,6 +334,9 @@ public:
 	bool load_cacert(char const *path);
 
 	void notify_broken_pipe();
+	TlsStatistics tls_statistics() const;
+
+	static WebContext *shared();
 };
 
 #endif